@@ -0,0 +1,96 @@
+#!/bin/bash
+set -e
+
+# Builds a single benchmark variant with the same pipeline as docker/run.sh and records
+# per-stage compile times, stack frame sizes, and the assembly next to the produced binary.
+#
+# Usage: compile.sh <src.c> <output_dir> <variant> [-DOBF_<ANNOTATION> ...]
+#
+# Expects `ZIG`, `OPT`, `LLC`, `LLVM_READOBJ`, `PASS_DIR` and `BENCH_TARGET` in the environment
+
+if [ "$#" -lt 3 ]; then
+  echo "Usage: $0 <src.c> <output_dir> <variant> [defines...]"
+  exit 1
+fi
+
+SRC_FILE="$1"
+OUT_DIR="$2"
+VARIANT="$3"
+shift 3
+
+NAME="$(basename "$SRC_FILE" .c)-$VARIANT"
+PREFIX="$OUT_DIR/$NAME"
+
+mkdir -p "$OUT_DIR"
+
+now() {
+  date +%s.%N
+}
+
+elapsed() {
+  awk -v start="$1" -v end="$2" 'BEGIN { printf "%.6f", end - start }'
+}
+
+# Compile, the optimizations run in the obfuscation pipeline
+start=$(now)
+"$ZIG" cc \
+  -target "$BENCH_TARGET" \
+  -emit-llvm -O3 -Xclang -disable-llvm-passes -S \
+  -g0 \
+  "$@" \
+  -o "$PREFIX.orig.ll" \
+  "$SRC_FILE"
+frontendTime=$(elapsed "$start" "$(now)")
+
+# Optimize and apply obfuscations using optimizer, so `obfuscation_s` includes the optimizations.
+# The baseline runs the same pipeline without annotations, so that the numbers include the cost of scanning
+# unannotated code
+start=$(now)
+"$OPT" \
+  -load-pass-plugin="$PASS_DIR/annotation/libAnnotationPass.so" \
+  -load-pass-plugin="$PASS_DIR/flatten/libFlattenPass.so" \
+  -load-pass-plugin="$PASS_DIR/bogus-switch/libBogusSwitchPass.so" \
+  -load-pass-plugin="$PASS_DIR/bogus-branch/libBogusBranchPass.so" \
+  -load-pass-plugin="$PASS_DIR/function-merge/libFunctionMergePass.so" \
+  -load-pass-plugin="$PASS_DIR/encrypt/libEncryptPass.so" \
+  -load-pass-plugin="$PASS_DIR/encode/libEncodePass.so" \
+  -load-pass-plugin="$PASS_DIR/virtualize/libVirtualizePass.so" \
+  -load-pass-plugin="$PASS_DIR/mba/libMBAPass.so" \
+  -passes="module(annotation),default<O3>,module(encrypt),module(function-merge),function(virtualize),function(flatten),function(bogus-switch),function(bogus-branch),function(encode),module(mba-helpers),function(mba)" \
+  -o "$PREFIX.obf.ll" -S \
+  "$PREFIX.orig.ll"
+obfuscationTime=$(elapsed "$start" "$(now)")
+
+# Convert IR to an object file, emitting a `.stack_sizes` section for stack usage
+start=$(now)
+"$LLC" \
+  -O2 \
+  -mtriple="$BENCH_TARGET" \
+  -stack-size-section \
+  -filetype=obj \
+  -o "$PREFIX.o" \
+  "$PREFIX.obf.ll"
+codegenTime=$(elapsed "$start" "$(now)")
+
+# Assembly for static cost estimates with llvm-mca
+"$LLC" \
+  -O2 \
+  -mtriple="$BENCH_TARGET" \
+  -filetype=asm \
+  -o "$PREFIX.s" \
+  "$PREFIX.obf.ll"
+
+start=$(now)
+"$ZIG" cc -target "$BENCH_TARGET" "$PREFIX.o" -o "$PREFIX.out"
+linkTime=$(elapsed "$start" "$(now)")
+
+"$LLVM_READOBJ" --stack-sizes "$PREFIX.o" > "$PREFIX.stack.txt"
+
+cat > "$PREFIX.build.json" <<EOF
+{
+  "frontend_s": $frontendTime,
+  "obfuscation_s": $obfuscationTime,
+  "codegen_s": $codegenTime,
+  "link_s": $linkTime
+}
+EOF
@@ -0,0 +1,82 @@
+#include <stdint.h>
+
+#include "obf.h"
+
+#define BLOCK_NUM 1024
+#define XTEA_ROUNDS 32
+
+#define ROTL32(value, shift) (((value) << (shift)) | ((value) >> (32 - (shift))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+  a += b; d ^= a; d = ROTL32(d, 16); \
+  c += d; b ^= c; b = ROTL32(b, 12); \
+  a += b; d ^= a; d = ROTL32(d, 8); \
+  c += d; b ^= c; b = ROTL32(b, 7);
+
+// ChaCha20 block function
+OBF_TARGET void chachaBlock(uint32_t *out, const uint32_t *in) {
+  uint32_t x[16];
+
+  for (int i = 0; i < 16; i++) {
+    x[i] = in[i];
+  }
+
+  for (int i = 0; i < 10; i++) {
+    QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+    QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+    QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+    QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+    QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+    QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+    QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+    QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    out[i] = x[i] + in[i];
+  }
+}
+
+// XTEA block encryption
+OBF_TARGET void xteaEncrypt(uint32_t *block, const uint32_t *key) {
+  uint32_t v0 = block[0];
+  uint32_t v1 = block[1];
+  uint32_t sum = 0;
+  const uint32_t delta = 0x9E3779B9u;
+
+  for (int i = 0; i < XTEA_ROUNDS; i++) {
+    v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
+    sum += delta;
+    v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
+  }
+
+  block[0] = v0;
+  block[1] = v1;
+}
+
+int main(int argc, char **argv) {
+  long iterations = bench_iterations(argc, argv, 600);
+
+  static uint32_t state[16] = {
+    0x61707865u, 0x3320646eu, 0x79622d32u, 0x6b206574u,
+    1, 2, 3, 4, 5, 6, 7, 8, 0, 0, 9, 10,
+  };
+  static const uint32_t key[4] = {0xdeadbeefu, 0x01234567u, 0x89abcdefu, 0xfeedfaceu};
+
+  uint32_t stream[16];
+  unsigned long long checksum = 0;
+
+  for (long i = 0; i < iterations; i++) {
+    for (int j = 0; j < BLOCK_NUM; j++) {
+      state[12] = (uint32_t)(i * BLOCK_NUM + j);
+      chachaBlock(stream, state);
+      xteaEncrypt(stream, key);
+
+      checksum = checksum * 33 + stream[0] + stream[15];
+    }
+  }
+
+  bench_report(checksum);
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+#include <stdint.h>
+
+#include "obf.h"
+
+#define BUFFER_SIZE 4096
+
+OBF_TARGET uint32_t fnv1a(const uint8_t *data, int size) {
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+OBF_TARGET uint32_t murmurMix(const uint8_t *data, int size, uint32_t seed) {
+  uint32_t hash = seed;
+
+  for (int i = 0; i + 4 <= size; i += 4) {
+    uint32_t k = (uint32_t)data[i]
+      | (uint32_t)data[i + 1] << 8
+      | (uint32_t)data[i + 2] << 16
+      | (uint32_t)data[i + 3] << 24;
+
+    k *= 0xcc9e2d51u;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593u;
+
+    hash ^= k;
+    hash = (hash << 13) | (hash >> 19);
+    hash = hash * 5 + 0xe6546b64u;
+  }
+
+  hash ^= (uint32_t)size;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
+OBF_TARGET void fillBuffer(uint8_t *data, int size, uint32_t state) {
+  for (int i = 0; i < size; i++) {
+    state = state * 1103515245u + 12345u;
+    data[i] = (uint8_t)(state >> 16);
+  }
+}
+
+int main(int argc, char **argv) {
+  long iterations = bench_iterations(argc, argv, 10000);
+
+  static uint8_t buffer[BUFFER_SIZE];
+  unsigned long long checksum = 0;
+
+  for (long i = 0; i < iterations; i++) {
+    fillBuffer(buffer, BUFFER_SIZE, (uint32_t)i);
+    checksum += fnv1a(buffer, BUFFER_SIZE);
+    checksum += murmurMix(buffer, BUFFER_SIZE, (uint32_t)checksum);
+  }
+
+  bench_report(checksum);
+
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdint.h>
+
+#include "obf.h"
+
+#define REGISTER_NUM 8
+
+enum Opcode {
+  OP_LOADI,  // r[a] = imm
+  OP_ADD,    // r[a] = r[b] + r[c]
+  OP_SUB,    // r[a] = r[b] - r[c]
+  OP_MUL,    // r[a] = r[b] * r[c]
+  OP_XOR,    // r[a] = r[b] ^ r[c]
+  OP_SHR,    // r[a] = r[b] >> imm
+  OP_JNZ,    // if (r[a] != 0) pc = imm
+  OP_HALT,   // return r[a]
+};
+
+struct Instruction {
+  uint8_t opcode;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+  int32_t imm;
+};
+
+// Computes a mixed sum over `r1` iterations:
+//   r0 = 0; r1 = n; r2 = 1; r3 = 0
+//   loop: r3 = r3 + r1 * r1; r3 = r3 ^ (r3 >> 7); r0 = r0 + r3; r1 = r1 - r2; if (r1) goto loop
+static const struct Instruction program[] = {
+  {OP_LOADI, 0, 0, 0, 0},
+  {OP_LOADI, 2, 0, 0, 1},
+  {OP_LOADI, 3, 0, 0, 0},
+  {OP_MUL, 4, 1, 1, 0},
+  {OP_ADD, 3, 3, 4, 0},
+  {OP_SHR, 5, 3, 0, 7},
+  {OP_XOR, 3, 3, 5, 0},
+  {OP_ADD, 0, 0, 3, 0},
+  {OP_SUB, 1, 1, 2, 0},
+  {OP_JNZ, 1, 0, 0, 3},
+  {OP_HALT, 0, 0, 0, 0},
+};
+
+OBF_TARGET uint64_t execute(const struct Instruction *code, uint64_t *registers) {
+  int pc = 0;
+
+  for (;;) {
+    const struct Instruction *inst = &code[pc++];
+
+    switch (inst->opcode) {
+      case OP_LOADI:
+        registers[inst->a] = (uint64_t)(int64_t)inst->imm;
+        break;
+      case OP_ADD:
+        registers[inst->a] = registers[inst->b] + registers[inst->c];
+        break;
+      case OP_SUB:
+        registers[inst->a] = registers[inst->b] - registers[inst->c];
+        break;
+      case OP_MUL:
+        registers[inst->a] = registers[inst->b] * registers[inst->c];
+        break;
+      case OP_XOR:
+        registers[inst->a] = registers[inst->b] ^ registers[inst->c];
+        break;
+      case OP_SHR:
+        registers[inst->a] = registers[inst->b] >> inst->imm;
+        break;
+      case OP_JNZ:
+        if (registers[inst->a] != 0) {
+          pc = inst->imm;
+        }
+        break;
+      case OP_HALT:
+        return registers[inst->a];
+      default:
+        return 0;
+    }
+  }
+}
+
+OBF_TARGET uint64_t run(uint64_t n) {
+  uint64_t registers[REGISTER_NUM] = {0};
+  registers[1] = n;
+
+  return execute(program, registers);
+}
+
+int main(int argc, char **argv) {
+  long iterations = bench_iterations(argc, argv, 10000);
+
+  unsigned long long checksum = 0;
+
+  for (long i = 0; i < iterations; i++) {
+    checksum += run(1000 + (uint64_t)(i & 255));
+  }
+
+  bench_report(checksum);
+
+  return 0;
+}
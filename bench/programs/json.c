@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "obf.h"
+
+#define DOCUMENT_CAPACITY 65536
+
+struct ParseStats {
+  long objects;
+  long arrays;
+  long strings;
+  long numbers;
+  long literals;
+  int64_t numberSum;
+};
+
+struct Parser {
+  const char *text;
+  int pos;
+  int size;
+};
+
+static int parseValue(struct Parser *parser, struct ParseStats *stats, int depth);
+
+OBF_TARGET void skipWhitespace(struct Parser *parser) {
+  while (parser->pos < parser->size) {
+    char c = parser->text[parser->pos];
+    if (c != ' ' && c != '\n' && c != '\t' && c != '\r') {
+      return;
+    }
+    parser->pos++;
+  }
+}
+
+OBF_TARGET int parseString(struct Parser *parser) {
+  // Opening quote
+  parser->pos++;
+
+  while (parser->pos < parser->size) {
+    char c = parser->text[parser->pos++];
+
+    if (c == '\\') {
+      parser->pos++;
+    } else if (c == '"') {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+OBF_TARGET int parseNumber(struct Parser *parser, int64_t *value) {
+  int64_t result = 0;
+  int negative = 0;
+
+  if (parser->text[parser->pos] == '-') {
+    negative = 1;
+    parser->pos++;
+  }
+
+  int digits = 0;
+  while (parser->pos < parser->size) {
+    char c = parser->text[parser->pos];
+    if (c < '0' || c > '9') {
+      break;
+    }
+
+    result = result * 10 + (c - '0');
+    parser->pos++;
+    digits++;
+  }
+
+  *value = negative ? -result : result;
+
+  return digits > 0;
+}
+
+static int parseContainer(struct Parser *parser, struct ParseStats *stats, int depth, char close) {
+  // Opening bracket
+  parser->pos++;
+  skipWhitespace(parser);
+
+  if (parser->pos < parser->size && parser->text[parser->pos] == close) {
+    parser->pos++;
+    return 1;
+  }
+
+  for (;;) {
+    if (close == '}') {
+      skipWhitespace(parser);
+      if (parser->text[parser->pos] != '"' || !parseString(parser)) {
+        return 0;
+      }
+
+      skipWhitespace(parser);
+      if (parser->text[parser->pos++] != ':') {
+        return 0;
+      }
+    }
+
+    if (!parseValue(parser, stats, depth + 1)) {
+      return 0;
+    }
+
+    skipWhitespace(parser);
+
+    char c = parser->text[parser->pos++];
+    if (c == close) {
+      return 1;
+    }
+    if (c != ',') {
+      return 0;
+    }
+  }
+}
+
+static int parseValue(struct Parser *parser, struct ParseStats *stats, int depth) {
+  skipWhitespace(parser);
+
+  if (parser->pos >= parser->size || depth > 64) {
+    return 0;
+  }
+
+  char c = parser->text[parser->pos];
+
+  switch (c) {
+    case '{':
+      stats->objects++;
+      return parseContainer(parser, stats, depth, '}');
+    case '[':
+      stats->arrays++;
+      return parseContainer(parser, stats, depth, ']');
+    case '"':
+      stats->strings++;
+      return parseString(parser);
+    case 't':
+    case 'f':
+    case 'n':
+      stats->literals++;
+      while (parser->pos < parser->size && parser->text[parser->pos] >= 'a' && parser->text[parser->pos] <= 'z') {
+        parser->pos++;
+      }
+      return 1;
+    default: {
+      int64_t value;
+      if (!parseNumber(parser, &value)) {
+        return 0;
+      }
+      stats->numbers++;
+      stats->numberSum += value;
+      return 1;
+    }
+  }
+}
+
+// Generates a deterministic document of nested records
+static int generateDocument(char *buffer, int capacity) {
+  int size = 0;
+  uint32_t state = 7;
+
+  size += snprintf(buffer + size, capacity - size, "[");
+
+  for (int i = 0; size < capacity - 256; i++) {
+    state = state * 1103515245u + 12345u;
+
+    size += snprintf(
+      buffer + size, capacity - size,
+      "%s{\"id\": %d, \"name\": \"item\\\"%u\", \"tags\": [\"a\", \"b\", %d], \"ok\": %s, \"next\": null}",
+      i == 0 ? "" : ",\n  ", i, state >> 20, -(int)(state % 1000), (state & 1) ? "true" : "false"
+    );
+  }
+
+  size += snprintf(buffer + size, capacity - size, "]");
+
+  return size;
+}
+
+int main(int argc, char **argv) {
+  long iterations = bench_iterations(argc, argv, 1200);
+
+  static char document[DOCUMENT_CAPACITY];
+  int size = generateDocument(document, DOCUMENT_CAPACITY);
+
+  unsigned long long checksum = 0;
+
+  for (long i = 0; i < iterations; i++) {
+    struct ParseStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    struct Parser parser = {document, 0, size};
+    int ok = parseValue(&parser, &stats, 0);
+
+    checksum += (unsigned long long)ok
+      + stats.objects * 3
+      + stats.arrays * 5
+      + stats.strings * 7
+      + stats.numbers * 11
+      + stats.literals * 13
+      + (unsigned long long)stats.numberSum;
+  }
+
+  bench_report(checksum);
+
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef OBF_BENCH_H
+#define OBF_BENCH_H
+
+// Annotations are selected at compile time, so the same source is built once per
+// obfuscation combination (see `BENCH_VARIANTS` in bench/CMakeLists.txt)
+
+#ifdef OBF_FLATTEN
+#define OBF_ANNOTATE_FLATTEN __attribute__((annotate("flatten")))
+#else
+#define OBF_ANNOTATE_FLATTEN
+#endif
+
+#ifdef OBF_BOGUS_SWITCH
+#define OBF_ANNOTATE_BOGUS_SWITCH __attribute__((annotate("bogus-switch")))
+#else
+#define OBF_ANNOTATE_BOGUS_SWITCH
+#endif
+
+#ifdef OBF_FUNCTION_MERGE
+#define OBF_ANNOTATE_FUNCTION_MERGE __attribute__((annotate("function-merge")))
+#else
+#define OBF_ANNOTATE_FUNCTION_MERGE
+#endif
+
+#ifdef OBF_MBA
+#define OBF_ANNOTATE_MBA __attribute__((annotate("mba")))
+#else
+#define OBF_ANNOTATE_MBA
+#endif
+
+#ifdef OBF_VIRTUALIZE
+#define OBF_ANNOTATE_VIRTUALIZE __attribute__((annotate("virtualize")))
+#else
+#define OBF_ANNOTATE_VIRTUALIZE
+#endif
+
+// Marks a benchmark kernel. Kernels are `static` so that Function Merging is allowed to merge them
+#define OBF_TARGET \
+  __attribute__((noinline)) \
+  OBF_ANNOTATE_FLATTEN \
+  OBF_ANNOTATE_BOGUS_SWITCH \
+  OBF_ANNOTATE_FUNCTION_MERGE \
+  OBF_ANNOTATE_MBA \
+  OBF_ANNOTATE_VIRTUALIZE \
+  static
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Number of benchmark iterations, optionally overridden by the first command-line argument
+static inline long bench_iterations(int argc, char **argv, long defaultIterations) {
+  if (argc > 1) {
+    long iterations = strtol(argv[1], NULL, 10);
+    if (iterations > 0) {
+      return iterations;
+    }
+  }
+
+  return defaultIterations;
+}
+
+// Every program prints a single checksum, which must be identical for all variants
+static inline void bench_report(unsigned long long checksum) {
+  printf("checksum %llu\n", checksum);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdint.h>
+
+#include "obf.h"
+
+#define ARRAY_SIZE 8192
+#define INSERTION_SORT_THRESHOLD 16
+
+OBF_TARGET void insertionSort(int32_t *values, int low, int high) {
+  for (int i = low + 1; i <= high; i++) {
+    int32_t value = values[i];
+    int j = i - 1;
+
+    while (j >= low && values[j] > value) {
+      values[j + 1] = values[j];
+      j--;
+    }
+
+    values[j + 1] = value;
+  }
+}
+
+OBF_TARGET int partition(int32_t *values, int low, int high) {
+  int middle = low + (high - low) / 2;
+  int32_t pivot = values[middle];
+
+  values[middle] = values[high];
+  values[high] = pivot;
+
+  int store = low;
+  for (int i = low; i < high; i++) {
+    if (values[i] < pivot) {
+      int32_t tmp = values[i];
+      values[i] = values[store];
+      values[store] = tmp;
+      store++;
+    }
+  }
+
+  values[high] = values[store];
+  values[store] = pivot;
+
+  return store;
+}
+
+static void quickSort(int32_t *values, int low, int high) {
+  while (high - low > INSERTION_SORT_THRESHOLD) {
+    int pivot = partition(values, low, high);
+
+    // Recurse into the smaller half to bound the stack depth
+    if (pivot - low < high - pivot) {
+      quickSort(values, low, pivot - 1);
+      low = pivot + 1;
+    } else {
+      quickSort(values, pivot + 1, high);
+      high = pivot - 1;
+    }
+  }
+
+  insertionSort(values, low, high);
+}
+
+int main(int argc, char **argv) {
+  long iterations = bench_iterations(argc, argv, 400);
+
+  static int32_t values[ARRAY_SIZE];
+  unsigned long long checksum = 0;
+  uint32_t state = 42;
+
+  for (long i = 0; i < iterations; i++) {
+    for (int j = 0; j < ARRAY_SIZE; j++) {
+      state = state * 1664525u + 1013904223u;
+      values[j] = (int32_t)(state >> 1);
+    }
+
+    quickSort(values, 0, ARRAY_SIZE - 1);
+
+    for (int j = 0; j < ARRAY_SIZE; j += 97) {
+      checksum = checksum * 31 + (uint32_t)values[j];
+    }
+  }
+
+  bench_report(checksum);
+
+  return 0;
+}
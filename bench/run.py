@@ -0,0 +1,330 @@
+#!/usr/bin/env python3
+"""Runs the obfuscation benchmarks and reports overhead relative to the unobfuscated baseline.
+
+  run.py run --build-dir <bench_build_dir> [--repeat N] [--output results.json]
+  run.py compare <old_results.json> <new_results.json>
+  run.py summary <results.json>...
+
+Binaries of a foreign architecture run under the emulator from the manifest (e.g. `qemu-aarch64`), so their
+runtime ratios are only indicative. Static estimates from llvm-mca are reported for every target.
+"""
+
+import argparse
+import json
+import math
+import os
+import re
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SCHEMA_VERSION = 1
+BASELINE_VARIANT = "baseline"
+
+# Metrics compared against the baseline, all "lower is better"
+RATIO_METRICS = [
+    "runtime_s", "text_bytes", "file_bytes", "max_frame_bytes", "total_frame_bytes", "compile_s",
+    "mca_instructions", "mca_rthroughput",
+]
+
+FUNCTION_TYPE = re.compile(r"^\s*\.type\s+([^,\s]+),\s*[@%]function")
+FUNCTION_LABEL = re.compile(r"^([^\s:#]+):")
+FUNCTION_END = re.compile(r"^\.Lfunc_end\d+:")
+
+
+def elf_section_size(path, section_name):
+    """Returns the size of an ELF section, or None if the section is missing."""
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:4] != b"\x7fELF":
+        return None
+
+    is64 = data[4] == 2
+    endian = "<" if data[5] == 1 else ">"
+
+    if is64:
+        shoff, = struct.unpack_from(endian + "Q", data, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from(endian + "HHH", data, 0x3A)
+    else:
+        shoff, = struct.unpack_from(endian + "I", data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from(endian + "HHH", data, 0x2E)
+
+    def section(index):
+        base = shoff + index * shentsize
+        if is64:
+            name, _, _, _, offset, size = struct.unpack_from(endian + "IIQQQQ", data, base)
+        else:
+            name, _, _, _, offset, size = struct.unpack_from(endian + "IIIIII", data, base)
+        return name, offset, size
+
+    _, strtabOffset, _ = section(shstrndx)
+
+    for i in range(shnum):
+        name, _, size = section(i)
+        end = data.index(b"\0", strtabOffset + name)
+        if data[strtabOffset + name:end].decode() == section_name:
+            return size
+
+    return None
+
+
+def parse_stack_sizes(path):
+    """Parses `llvm-readobj --stack-sizes` output into a map of function name to frame size."""
+    sizes = {}
+
+    if not os.path.exists(path):
+        return sizes
+
+    with open(path) as f:
+        text = f.read()
+
+    for functions, size in re.findall(r"Functions: \[([^\]]*)\]\s*Size: (0x[0-9A-Fa-f]+)", text):
+        for function in functions.split(","):
+            sizes[function.strip()] = int(size, 16)
+
+    return sizes
+
+
+def mca_estimates(asm_path, target, llvm_mca, cpu):
+    """Static cost of every function in the assembly, treating its body as a single block:
+    the number of instructions and the block reciprocal throughput (cycles per execution of all instructions)."""
+    with open(asm_path) as f:
+        lines = f.read().splitlines()
+
+    functions = {match.group(1) for match in map(FUNCTION_TYPE.match, lines) if match}
+
+    # Every function becomes an llvm-mca code region. `#` starts a line comment on both x86-64 and AArch64
+    annotated = []
+    current = None
+    for line in lines:
+        if current and FUNCTION_END.match(line):
+            annotated.append("# LLVM-MCA-END %s" % current)
+            current = None
+
+        annotated.append(line)
+
+        label = FUNCTION_LABEL.match(line)
+        if current is None and label and label.group(1) in functions:
+            current = label.group(1)
+            annotated.append("# LLVM-MCA-BEGIN %s" % current)
+
+    with tempfile.NamedTemporaryFile("w", suffix=".s") as regions:
+        regions.write("\n".join(annotated) + "\n")
+        regions.flush()
+
+        result = subprocess.run(
+            [llvm_mca, "-mtriple=" + target, "-mcpu=" + cpu, "-json", regions.name],
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+        )
+
+    if result.returncode != 0:
+        print("llvm-mca failed on %s: %s" % (asm_path, result.stderr.decode(errors="replace")), file=sys.stderr)
+        return {}
+
+    estimates = {}
+    for region in json.loads(result.stdout).get("CodeRegions", []):
+        summary = region.get("SummaryView", {})
+        iterations = summary.get("Iterations") or 1
+        estimates[region.get("Name")] = {
+            "instructions": summary.get("Instructions", 0) // iterations,
+            "rthroughput": summary.get("BlockRThroughput", 0.0),
+        }
+
+    return estimates
+
+
+def run_binary(command, repeat):
+    """Runs the binary `repeat` times and returns the median wall time and the checksum output."""
+    times = []
+    output = None
+
+    for _ in range(repeat):
+        start = time.perf_counter()
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+        times.append(time.perf_counter() - start)
+        output = result.stdout.decode().strip()
+
+    return statistics.median(times), output
+
+
+def measure(build_dir, manifest, program, variant, repeat):
+    prefix = os.path.join(build_dir, "out", "%s-%s" % (program, variant))
+    binary = prefix + ".out"
+
+    with open(prefix + ".build.json") as f:
+        build = json.load(f)
+
+    runtime, output = run_binary(manifest.get("emulator", []) + [binary], repeat)
+    frames = parse_stack_sizes(prefix + ".stack.txt")
+    estimates = mca_estimates(prefix + ".s", manifest["target"], manifest["llvm_mca"], manifest["mca_cpu"])
+
+    return {
+        "program": program,
+        "variant": variant,
+        "target": manifest["target"],
+        "checksum": output,
+        "runtime_s": runtime,
+        "text_bytes": elf_section_size(binary, ".text"),
+        "file_bytes": os.path.getsize(binary),
+        "max_frame_bytes": max(frames.values(), default=0),
+        "total_frame_bytes": sum(frames.values()),
+        "compile_s": build["obfuscation_s"] + build["codegen_s"],
+        "emulated": bool(manifest.get("emulator")),
+        "mca_instructions": sum(e["instructions"] for e in estimates.values()) or None,
+        "mca_rthroughput": sum(e["rthroughput"] for e in estimates.values()) or None,
+        "mca_functions": estimates,
+        "build": build,
+    }
+
+
+def add_ratios(result, baseline):
+    result["correct"] = result["checksum"] == baseline["checksum"]
+    result["relative"] = {}
+
+    for metric in RATIO_METRICS:
+        value = result.get(metric)
+        base = baseline.get(metric)
+        result["relative"][metric] = value / base if value is not None and base else None
+
+
+def command_run(args):
+    with open(os.path.join(args.build_dir, "manifest.json")) as f:
+        manifest = json.load(f)
+
+    programs = args.programs or manifest["programs"]
+    results = []
+    failed = False
+
+    for program in programs:
+        baseline = measure(args.build_dir, manifest, program, BASELINE_VARIANT, args.repeat)
+
+        for variant in manifest["variants"]:
+            result = baseline if variant == BASELINE_VARIANT else measure(
+                args.build_dir, manifest, program, variant, args.repeat
+            )
+            add_ratios(result, baseline)
+            results.append(result)
+
+            failed |= not result["correct"]
+
+            print("%-8s %-22s runtime x%-7.2f text x%-6.2f frame x%-6.2f compile x%-6.2f mca x%-6.2f%s" % (
+                program, variant,
+                result["relative"]["runtime_s"] or 0,
+                result["relative"]["text_bytes"] or 0,
+                result["relative"]["max_frame_bytes"] or 0,
+                result["relative"]["compile_s"] or 0,
+                result["relative"]["mca_rthroughput"] or 0,
+                "" if result["correct"] else "  CHECKSUM MISMATCH",
+            ))
+
+    report = {
+        "schema": SCHEMA_VERSION,
+        "target": manifest["target"],
+        "emulator": manifest.get("emulator", []),
+        "mca_cpu": manifest.get("mca_cpu"),
+        "repeat": args.repeat,
+        "results": results,
+    }
+
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+        f.write("\n")
+
+    return 1 if failed else 0
+
+
+def command_compare(args):
+    with open(args.old) as f:
+        old = {(r["program"], r["variant"]): r for r in json.load(f)["results"]}
+    with open(args.new) as f:
+        new = {(r["program"], r["variant"]): r for r in json.load(f)["results"]}
+
+    for key in sorted(new):
+        if key not in old:
+            print("%-8s %-22s (new)" % key)
+            continue
+
+        deltas = []
+        for metric in RATIO_METRICS:
+            before = old[key]["relative"].get(metric)
+            after = new[key]["relative"].get(metric)
+            if before and after:
+                deltas.append("%s %+.1f%%" % (metric, (after / before - 1) * 100))
+
+        print("%-8s %-22s %s" % (key + (", ".join(deltas),)))
+
+    return 0
+
+
+def geometric_mean(values):
+    values = [v for v in values if v]
+    return math.exp(sum(map(math.log, values)) / len(values)) if values else None
+
+
+def command_summary(args):
+    """Geometric mean overhead of every variant over all programs, one column per report (architecture)."""
+    reports = []
+    for path in args.reports:
+        with open(path) as f:
+            reports.append(json.load(f))
+
+    metrics = ["runtime_s", "mca_rthroughput", "mca_instructions", "text_bytes"]
+    variants = []
+    for report in reports:
+        for result in report["results"]:
+            if result["variant"] not in variants:
+                variants.append(result["variant"])
+
+    header = "%-22s %-16s" % ("variant", "metric")
+    for report in reports:
+        header += " %20s" % (report["target"] + ("*" if report.get("emulator") else ""))
+    print(header)
+
+    for variant in variants:
+        for metric in metrics:
+            line = "%-22s %-16s" % (variant, metric)
+            for report in reports:
+                ratio = geometric_mean([
+                    r["relative"].get(metric) for r in report["results"] if r["variant"] == variant
+                ])
+                line += " %20s" % ("x%.2f" % ratio if ratio else "-")
+            print(line)
+
+    if any(report.get("emulator") for report in reports):
+        print("* runtime measured under emulation")
+
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    subparsers = parser.add_subparsers(dest="command", required=True)
+
+    run = subparsers.add_parser("run", help="run benchmarks and write a JSON report")
+    run.add_argument("--build-dir", required=True)
+    run.add_argument("--repeat", type=int, default=5)
+    run.add_argument("--output", default="results.json")
+    run.add_argument("--programs", nargs="*")
+
+    compare = subparsers.add_parser("compare", help="compare overhead ratios of two JSON reports")
+    compare.add_argument("old")
+    compare.add_argument("new")
+
+    summary = subparsers.add_parser("summary", help="per-architecture overhead of every variant")
+    summary.add_argument("reports", nargs="+")
+
+    args = parser.parse_args()
+
+    if args.command == "run":
+        return command_run(args)
+    if args.command == "summary":
+        return command_summary(args)
+    return command_compare(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
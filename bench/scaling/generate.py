@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Generates a synthetic annotated IR module for compile-time scaling measurements.
+
+Every generated function consists of a forward-branching chain of blocks. Blocks end with either
+a conditional branch or a `switch` of the configured width, and a fraction of blocks (the PHI
+density) merges the values of its predecessors with a `phi` node. `main` calls the generated
+functions from the configured number of call sites.
+"""
+
+import argparse
+import random
+import sys
+
+
+def generate_function(out, name, blocks, switch_width, phi_density, ops_per_block, rng):
+    # Predecessor lists are collected first, so that `phi` nodes can reference every incoming edge
+    successors = []
+    for i in range(blocks - 1):
+        if switch_width >= 2 and i % 2 == 0:
+            targets = sorted({min(i + 1 + k, blocks - 1) for k in range(switch_width)})
+        else:
+            targets = sorted({i + 1, min(i + 2, blocks - 1)})
+        successors.append(targets)
+    successors.append([])
+
+    predecessors = [[] for _ in range(blocks)]
+    for i, targets in enumerate(successors):
+        for target in targets:
+            predecessors[target].append(i)
+
+    out.write("define internal i32 @%s(i32 %%x) noinline {\n" % name)
+    out.write("entry:\n  br label %b0\n")
+
+    for i in range(blocks):
+        out.write("b%d:\n" % i)
+
+        base = "%x"
+        if i == 0:
+            out.write("  %p0 = phi i32 [ %x, %entry ]\n")
+            base = "%p0"
+        elif predecessors[i] and rng.random() < phi_density:
+            incoming = ", ".join("[ %%v%d, %%b%d ]" % (p, p) for p in predecessors[i])
+            out.write("  %%p%d = phi i32 %s\n" % (i, incoming))
+            base = "%%p%d" % i
+
+        value = base
+        for k in range(ops_per_block):
+            op = ("add", "xor", "mul", "add")[k % 4]
+            out.write("  %%t%d.%d = %s i32 %s, %d\n" % (i, k, op, value, rng.randint(1, 1 << 16)))
+            value = "%%t%d.%d" % (i, k)
+        out.write("  %%v%d = add i32 %s, %d\n" % (i, value, i))
+
+        targets = successors[i]
+        if not targets:
+            out.write("  ret i32 %%v%d\n" % i)
+        elif len(targets) == 1:
+            out.write("  br label %%b%d\n" % targets[0])
+        elif i % 2 == 0 and switch_width >= 2:
+            out.write("  %%s%d = and i32 %%v%d, 255\n" % (i, i))
+            cases = " ".join("i32 %d, label %%b%d" % (k, target) for k, target in enumerate(targets[1:]))
+            out.write("  switch i32 %%s%d, label %%b%d [ %s ]\n" % (i, targets[0], cases))
+        else:
+            out.write("  %%c%d = icmp sgt i32 %%v%d, 0\n" % (i, i))
+            out.write("  br i1 %%c%d, label %%b%d, label %%b%d\n" % (i, targets[0], targets[1]))
+
+    out.write("}\n\n")
+
+
+def generate(out, args):
+    rng = random.Random(args.seed)
+    names = ["f%d" % i for i in range(args.functions)]
+
+    # Annotation strings and the `llvm.global.annotations` table, as emitted by clang
+    for annotation in args.annotations:
+        data = annotation.encode() + b"\0"
+        out.write("@.str.%s = private unnamed_addr constant [%d x i8] c\"%s\\00\", section \"llvm.metadata\"\n" % (
+            annotation.replace("-", "_"), len(data), annotation
+        ))
+    out.write("@.file = private unnamed_addr constant [6 x i8] c\"gen.c\\00\", section \"llvm.metadata\"\n")
+
+    entries = [
+        "{ ptr, ptr, ptr, i32, ptr } { ptr @%s, ptr @.str.%s, ptr @.file, i32 1, ptr null }" % (
+            name, annotation.replace("-", "_")
+        )
+        for name in names
+        for annotation in args.annotations
+    ]
+    if entries:
+        out.write("@llvm.global.annotations = appending global [%d x { ptr, ptr, ptr, i32, ptr }] [\n  %s\n], section \"llvm.metadata\"\n\n" % (
+            len(entries), ",\n  ".join(entries)
+        ))
+
+    for name in names:
+        generate_function(out, name, args.blocks, args.switch_width, args.phi_density, args.ops_per_block, rng)
+
+    out.write("define i32 @main(i32 %argc) {\nentry:\n")
+    value = "%argc"
+    for i in range(args.call_sites):
+        out.write("  %%r%d = call i32 @%s(i32 %s)\n" % (i, names[i % len(names)], value))
+        out.write("  %%a%d = add i32 %s, %%r%d\n" % (i, value, i))
+        value = "%%a%d" % i
+    out.write("  ret i32 %s\n}\n" % value)
+
+
+def add_arguments(parser):
+    parser.add_argument("--blocks", type=int, default=64, help="basic blocks per function")
+    parser.add_argument("--switch-width", type=int, default=4, help="successors of every generated switch (0 disables switches)")
+    parser.add_argument("--phi-density", type=float, default=0.5, help="fraction of blocks starting with a phi node")
+    parser.add_argument("--functions", type=int, default=4, help="number of annotated functions")
+    parser.add_argument("--call-sites", type=int, default=16, help="number of call sites in main")
+    parser.add_argument("--ops-per-block", type=int, default=4, help="arithmetic instructions per block")
+    parser.add_argument("--annotations", nargs="*", default=["flatten", "bogus-switch", "function-merge", "mba"])
+    parser.add_argument("--seed", type=int, default=1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    add_arguments(parser)
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+
+    if args.functions < 1 or args.blocks < 1:
+        parser.error("at least one function with one block is required")
+
+    if args.output == "-":
+        generate(sys.stdout, args)
+    else:
+        with open(args.output, "w") as out:
+            generate(out, args)
+
+
+if __name__ == "__main__":
+    main()
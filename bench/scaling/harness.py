@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""Measures how the compile time and peak memory of every pass scale with the input size.
+
+For every pass and every axis of the grid (see grid.json), the harness generates synthetic modules
+where only that axis varies, runs `opt` with `-time-passes`, and fits the growth exponent of the
+pass time: `time ~ size^k`. Passes whose exponent exceeds the configured bound are flagged.
+
+  harness.py --opt <path/to/opt> --pass-dir <pass/build> [--grid grid.json] [--output scaling.json]
+"""
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+import types
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import generate
+
+PLUGINS = [
+    "annotation/libAnnotationPass.so",
+    "flatten/libFlattenPass.so",
+    "bogus-switch/libBogusSwitchPass.so",
+    "function-merge/libFunctionMergePass.so",
+    "mba/libMBAPass.so",
+]
+
+# `number (percent%)` columns of a `-time-passes` report line; the last one is the wall time
+TIMER_COLUMN = re.compile(r"([0-9.]+) \(\s*[0-9.]+%\)")
+
+
+def pass_wall_time(report, timer):
+    """Sums the wall time of all `-time-passes` lines of the given pass."""
+    total = 0.0
+
+    for line in report.splitlines():
+        if not line.rstrip().endswith(timer):
+            continue
+
+        columns = TIMER_COLUMN.findall(line)
+        if columns:
+            total += float(columns[-1])
+
+    return total
+
+
+def run_opt(args, module, pipeline):
+    """Runs `opt` once and returns the output of `-time-passes` and the peak RSS in KiB."""
+    command = [args.opt]
+    command += ["-load-pass-plugin=" + os.path.join(args.pass_dir, plugin) for plugin in PLUGINS]
+    command += args.opt_arg
+    command += ["-passes=" + pipeline, "-time-passes", "-disable-output", module]
+
+    with tempfile.TemporaryFile() as stderr:
+        process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=stderr)
+        # `wait4` reports the resource usage of this child only
+        _, status, usage = os.wait4(process.pid, 0)
+        process.returncode = os.waitstatus_to_exitcode(status)
+
+        stderr.seek(0)
+        report = stderr.read().decode(errors="replace")
+
+    if process.returncode != 0:
+        raise RuntimeError("opt failed on %s:\n%s" % (module, report))
+
+    return report, usage.ru_maxrss
+
+
+def fit_exponent(sizes, times):
+    """Least-squares slope of log(time) over log(size)."""
+    points = [(math.log(s), math.log(t)) for s, t in zip(sizes, times) if s > 0 and t > 0]
+    if len(points) < 2:
+        return None
+
+    meanX = sum(x for x, _ in points) / len(points)
+    meanY = sum(y for _, y in points) / len(points)
+    variance = sum((x - meanX) ** 2 for x, _ in points)
+    if variance == 0:
+        return None
+
+    return sum((x - meanX) * (y - meanY) for x, y in points) / variance
+
+
+def measure_axis(args, grid, name, config, axis, values, workdir):
+    points = []
+
+    for value in values:
+        parameters = dict(grid["defaults"])
+        parameters[axis] = value
+
+        module = os.path.join(workdir, "%s-%s-%s.ll" % (name, axis, value))
+        generatorArgs = types.SimpleNamespace(annotations=config["annotations"], seed=1, **parameters)
+        with open(module, "w") as out:
+            generate.generate(out, generatorArgs)
+
+        times = []
+        peakRss = 0
+        for _ in range(grid.get("repeat", 1)):
+            start = time.perf_counter()
+            report, rss = run_opt(args, module, config["pipeline"])
+            elapsed = time.perf_counter() - start
+
+            times.append(pass_wall_time(report, config["timer"]) or elapsed)
+            peakRss = max(peakRss, rss)
+
+        points.append({"value": value, "pass_s": min(times), "peak_rss_kib": peakRss})
+
+    sizes = [p["value"] for p in points]
+    exponent = fit_exponent(sizes, [p["pass_s"] for p in points])
+    rssExponent = fit_exponent(sizes, [p["peak_rss_kib"] for p in points])
+    bound = config.get("max_exponent", grid.get("max_exponent", 1.25))
+
+    return {
+        "pass": name,
+        "axis": axis,
+        "points": points,
+        "time_exponent": exponent,
+        "rss_exponent": rssExponent,
+        "max_exponent": bound,
+        "flagged": exponent is not None and exponent > bound,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--opt", default=os.path.join(os.environ.get("LLVM_HOME", ""), "bin", "opt"))
+    parser.add_argument("--pass-dir", required=True)
+    parser.add_argument("--grid", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "grid.json"))
+    parser.add_argument("--passes", nargs="*", help="subset of passes from the grid")
+    parser.add_argument("--output", default="scaling.json")
+    parser.add_argument("--opt-arg", action="append", default=[], help="extra argument for opt")
+    args = parser.parse_args()
+
+    with open(args.grid) as f:
+        grid = json.load(f)
+
+    results = []
+
+    with tempfile.TemporaryDirectory() as workdir:
+        for name, config in grid["passes"].items():
+            if args.passes and name not in args.passes:
+                continue
+
+            for axis, values in config["axes"].items():
+                result = measure_axis(args, grid, name, config, axis, values, workdir)
+                results.append(result)
+
+                exponent = result["time_exponent"]
+                print("%-15s %-14s time ~ n^%-6s rss ~ n^%-6s%s" % (
+                    name, axis,
+                    "%.2f" % exponent if exponent is not None else "?",
+                    "%.2f" % result["rss_exponent"] if result["rss_exponent"] is not None else "?",
+                    "  EXCEEDS n^%.2f" % result["max_exponent"] if result["flagged"] else "",
+                ))
+
+    with open(args.output, "w") as f:
+        json.dump({"grid": grid, "results": results}, f, indent=2, sort_keys=True)
+        f.write("\n")
+
+    return 1 if any(r["flagged"] for r in results) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
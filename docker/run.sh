@@ -12,35 +12,119 @@ fi
 SRC_FILE="/app/in/target.c"
 OUT_FILE="/app/out/$1"
 
+# Target of the produced binary, e.g. TARGET_TRIPLE=aarch64-linux-gnu
+TARGET="${TARGET_TRIPLE:-x86_64-linux-gnu}"
+
 mkdir build
 
+# OBF_PROFILE=1 instruments the flattened dispatchers, see runtime/obfprof.c
+OPT_ARGS=()
+LINK_ARGS=()
+if [ "${OBF_PROFILE:-0}" = "1" ]; then
+  OPT_ARGS+=(-flatten-profile -bogus-switch-profile)
+  LINK_ARGS+=(/app/runtime/obfprof.c -lpthread)
+fi
+
+# OBF_PROVENANCE=1 tags the instructions inserted by every transform and keeps line tables in the binary,
+# see tools/obf-attribution.py
+DEBUG_ARGS=(-g0)
+if [ "${OBF_PROVENANCE:-0}" = "1" ]; then
+  DEBUG_ARGS=(-gline-tables-only)
+  OPT_ARGS+=(-annotation-provenance)
+fi
+
+# OBF_POLICY=default selects functions with the built-in policy, OBF_POLICY=<file.json> with a rules file.
+# The chosen tiers are reported next to the binary.
+# Annotations are attached before the optimizations, so the annotated code stays tagged when it is inlined
+PASSES="module(annotation),default<O3>,module(encrypt),module(function-merge),function(virtualize),function(flatten),function(bogus-switch),function(bogus-branch),function(encode),module(mba-helpers),function(mba)"
+if [ -n "${OBF_POLICY:-}" ]; then
+  PASSES="module(annotation),default<O3>,module(encrypt),module(policy),module(function-merge),function(virtualize),function(flatten),function(bogus-switch),function(bogus-branch),function(encode),module(mba-helpers),function(mba)"
+  OPT_ARGS+=(-policy-report="$OUT_FILE.policy.json")
+  if [ "$OBF_POLICY" != "default" ]; then
+    OPT_ARGS+=(-policy-file="$OBF_POLICY")
+  fi
+fi
+
+# OBF_BUDGET_MS=<ms> limits the compile time of the function passes, intensities are reduced to fit.
+# The function passes share one adaptor, so every function gets all of them before the next one in the priority
+# order of the plan. The plan and what the passes did are reported next to the binary
+FUNCTION_PASSES="function(virtualize),function(flatten),function(bogus-switch),function(bogus-branch),function(encode),module(mba-helpers),function(mba)"
+if [ -n "${OBF_BUDGET_MS:-}" ]; then
+  PASSES="${PASSES/$FUNCTION_PASSES/module(budget),module(mba-helpers),function(virtualize,flatten,bogus-switch,bogus-branch,encode,mba),module(budget-report)}"
+  OPT_ARGS+=(-budget-ms="$OBF_BUDGET_MS" -budget-report="$OUT_FILE.budget.json")
+fi
+
+# OBF_VARIANTS=<n> builds n variants with different seeds from a single parse and optimization of the input,
+# see pass/driver/ObfVariants.cpp. Variant i of <name>.out is written to <name>.<i>.out.
+# The variants are obfuscated in one process, which can't write one policy or budget report per variant
+if [ -n "${OBF_VARIANTS:-}" ] && [ -n "${OBF_POLICY:-}${OBF_BUDGET_MS:-}${OBF_SERVICE_SOCKET:-}" ]; then
+  echo -e "${BLUE}OBF_VARIANTS can't be combined with OBF_POLICY, OBF_BUDGET_MS, or OBF_SERVICE_SOCKET${NC}"
+  exit 1
+fi
+
 echo -e "${BLUE}Compiling...${NC}"
 
-# Compile
+# Compile, the optimizations run in the obfuscation pipeline
 zig cc \
-  -target x86_64-linux-gnu \
-  -emit-llvm -O3 -S \
-  -g0 \
+  -target "$TARGET" \
+  -emit-llvm -O3 -Xclang -disable-llvm-passes -S \
+  -I/app/runtime \
+  "${DEBUG_ARGS[@]}" \
   -o build/orig.ll \
   "$SRC_FILE"
 
 echo -e "${BLUE}Obfuscating...${NC}"
 
-# Apply obfuscations using optimizer
-/opt/llvm-project/build/bin/opt \
-  -load-pass-plugin="/app/pass/build/annotation/libAnnotationPass.so" \
-  -load-pass-plugin="/app/pass/build/flatten/libFlattenPass.so" \
-  -load-pass-plugin="/app/pass/build/bogus-switch/libBogusSwitchPass.so" \
-  -load-pass-plugin="/app/pass/build/function-merge/libFunctionMergePass.so" \
-  -load-pass-plugin="/app/pass/build/mba/libMBAPass.so" \
-  -passes="module(annotation),module(function-merge),function(flatten),function(bogus-switch),function(mba)" \
-  -o build/obf.ll -S \
-  build/orig.ll
+# Apply obfuscations using optimizer, or using a running obf-service if OBF_SERVICE_SOCKET is set.
+# The service takes pass options on its own command line, so OBF_PROFILE, OBF_PROVENANCE, OBF_BUDGET_MS, and policy files need a service started with them
+if [ -n "${OBF_VARIANTS:-}" ]; then
+  /app/pass/build/driver/obf-variants \
+    -n "$OBF_VARIANTS" \
+    -prepare="module(annotation),default<O3>" \
+    -passes="${PASSES#module(annotation),default<O3>,}" \
+    "${OPT_ARGS[@]}" \
+    -o build/obf -S \
+    build/orig.ll
+elif [ -n "${OBF_SERVICE_SOCKET:-}" ]; then
+  /app/pass/build/driver/obf-client \
+    -socket="$OBF_SERVICE_SOCKET" \
+    -passes="$PASSES" \
+    -o build/obf.ll -S \
+    build/orig.ll
+else
+  /opt/llvm-project/build/bin/opt \
+    -load-pass-plugin="/app/pass/build/annotation/libAnnotationPass.so" \
+    -load-pass-plugin="/app/pass/build/flatten/libFlattenPass.so" \
+    -load-pass-plugin="/app/pass/build/bogus-switch/libBogusSwitchPass.so" \
+    -load-pass-plugin="/app/pass/build/bogus-branch/libBogusBranchPass.so" \
+    -load-pass-plugin="/app/pass/build/function-merge/libFunctionMergePass.so" \
+    -load-pass-plugin="/app/pass/build/encrypt/libEncryptPass.so" \
+    -load-pass-plugin="/app/pass/build/encode/libEncodePass.so" \
+    -load-pass-plugin="/app/pass/build/virtualize/libVirtualizePass.so" \
+    -load-pass-plugin="/app/pass/build/mba/libMBAPass.so" \
+    -load-pass-plugin="/app/pass/build/policy/libPolicyPass.so" \
+    -load-pass-plugin="/app/pass/build/budget/libBudgetPass.so" \
+    -passes="$PASSES" \
+    "${OPT_ARGS[@]}" \
+    -o build/obf.ll -S \
+    build/orig.ll
+fi
 
 echo -e "${BLUE}Compiling IR to binary...${NC}"
 
-# Convert IR file to a binary
-zig cc -target x86_64-linux-gnu build/obf.ll -o "$OUT_FILE"
+# Convert IR file to a binary, the variants concurrently
+if [ -n "${OBF_VARIANTS:-}" ]; then
+  pids=()
+  for ((i = 0; i < OBF_VARIANTS; i++)); do
+    zig cc -target "$TARGET" "build/obf.$i.ll" "${LINK_ARGS[@]}" -o "${OUT_FILE%.out}.$i.out" &
+    pids+=($!)
+  done
+  for pid in "${pids[@]}"; do
+    wait "$pid"
+  done
+else
+  zig cc -target "$TARGET" build/obf.ll "${LINK_ARGS[@]}" -o "$OUT_FILE"
+fi
 
 if [ $? -eq 0 ]; then
   echo -e "${BLUE}Executable created!${NC}"
@@ -1,28 +1,197 @@
-#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+
+#include "OpaqueValue.cpp"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "annotation"
+
+STATISTIC(NumAnnotationsAttached, "Number of annotations attached to functions and global variables");
+STATISTIC(NumAnnotatedValues, "Number of functions and global variables with at least one annotation");
+STATISTIC(NumRegions, "Number of source-level regions");
+STATISTIC(NumRegionInstructions, "Number of instructions tagged as parts of regions");
+
+static cl::opt<uint64_t> AnnotationSeed(
+  "annotation-seed", cl::init(0),
+  cl::desc("Seed of the random choices made by the obfuscation passes, stored in the `obf.seed` module flag")
+);
+
+static cl::opt<bool> AnnotationProvenance(
+  "annotation-provenance", cl::init(false),
+  cl::desc("Tag instructions inserted by the obfuscation passes with the pass and the transform kind, "
+           "stored in the `obf.provenance` module flag")
+);
+
 namespace {
+  // Attaches the annotations of `llvm.global.annotations` to the annotated functions and global variables.
+  //
+  // The instructions of annotated functions are tagged as well, for the passes that can obfuscate regions,
+  // and so are the instructions between region markers (runtime/obf.h). Unlike function metadata, the tags
+  // are copied along when a function is inlined, so the pass runs before the optimizations
   class AnnotationPass : public PassInfoMixin<AnnotationPass> {
+  private:
+    static constexpr const char *regionBeginName = "__obf_region_begin";
+    static constexpr const char *regionEndName = "__obf_region_end";
+
+    // Passes that obfuscate instructions and blocks rather than whole functions
+    static bool isRegionAnnotation(StringRef annotation) {
+      return annotation == "flatten" || annotation == "bogus-switch" || annotation == "bogus-branch"
+        || annotation == "mba" || annotation == "encode";
+    }
+
+    // Annotation of a region marker call, nothing if `inst` is not a call of `markerFunc`
+    static std::optional<StringRef> getMarkerAnnotation(const Instruction &inst, const Function *markerFunc) {
+      auto *call = dyn_cast<CallBase>(&inst);
+      if (!call || !markerFunc || call->getCalledOperand() != markerFunc) {
+        return std::nullopt;
+      }
+
+      StringRef annotation;
+      if (call->arg_size() != 1 || !getConstantStringInfo(call->getArgOperand(0), annotation)) {
+        errs() << "[annotation] ERROR: Region marker without a constant annotation in " << call->getFunction()->getName() << "\n";
+        throw std::runtime_error("Region marker without a constant annotation");
+      }
+
+      if (!AnnotationPass::isRegionAnnotation(annotation)) {
+        errs() << "[annotation] ERROR: Annotation can't be applied to a region: " << annotation << "\n";
+        throw std::runtime_error("Annotation can't be applied to a region");
+      }
+
+      return annotation;
+    }
+
+    // Tags the instructions reachable from `begin` up to the end markers of the same annotation.
+    // Returns the number of tagged instructions
+    unsigned tagRegion(CallBase *begin, StringRef annotation, const Function *endFunc) const {
+      unsigned taggedNum = 0;
+      SmallPtrSet<BasicBlock *, 16> visited;
+      std::vector<Instruction *> worklist = {begin->getNextNode()};
+
+      while (!worklist.empty()) {
+        Instruction *start = worklist.back();
+        worklist.pop_back();
+
+        for (Instruction *inst = start; inst; inst = inst->getNextNode()) {
+          if (AnnotationPass::getMarkerAnnotation(*inst, endFunc) == annotation) {
+            break;
+          }
+
+          inst->addAnnotationMetadata(annotation);
+          taggedNum++;
+
+          if (!inst->isTerminator()) {
+            continue;
+          }
+
+          for (BasicBlock *successor : successors(inst->getParent())) {
+            if (visited.insert(successor).second) {
+              worklist.push_back(&successor->front());
+            }
+          }
+        }
+      }
+
+      return taggedNum;
+    }
+
+    // Tags the regions between markers and removes the markers, adds their annotations to `regionAnnotations`.
+    // Returns false if there are none
+    bool markRegions(Module &M, std::set<std::string> &regionAnnotations) const {
+      Function *beginFunc = M.getFunction(AnnotationPass::regionBeginName);
+      Function *endFunc = M.getFunction(AnnotationPass::regionEndName);
+
+      std::vector<Instruction *> markers;
+
+      for (auto &F : M) {
+        for (auto &inst : instructions(F)) {
+          if (AnnotationPass::getMarkerAnnotation(inst, endFunc)) {
+            markers.push_back(&inst);
+          }
+
+          auto annotation = AnnotationPass::getMarkerAnnotation(inst, beginFunc);
+          if (!annotation) {
+            continue;
+          }
+
+          markers.push_back(&inst);
+          regionAnnotations.insert(annotation->str());
+          NumRegions++;
+          NumRegionInstructions += this->tagRegion(cast<CallBase>(&inst), *annotation, endFunc);
+
+          LLVM_DEBUG(dbgs() << "[annotation] Region in " << F.getName() << " -> " << *annotation << "\n");
+        }
+      }
+
+      if (markers.empty()) {
+        return false;
+      }
+
+      for (auto *marker : markers) {
+        marker->eraseFromParent();
+      }
+
+      // Calls in bodies that are not materialized yet can't be seen, a declaration without them costs nothing
+      for (auto *markerFunc : {beginFunc, endFunc}) {
+        if (markerFunc && markerFunc->use_empty() && M.isMaterialized()) {
+          markerFunc->eraseFromParent();
+        }
+      }
+
+      return true;
+    }
+
   public:
     PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
       LLVMContext &context = M.getContext();
 
+      // Passes derive per-function seeds from it, an explicit seed overrides the one of a linked module
+      if (AnnotationSeed.getNumOccurrences() > 0 || !M.getModuleFlag("obf.seed")) {
+        M.setModuleFlag(Module::Override, "obf.seed", ConstantInt::get(Type::getInt64Ty(context), AnnotationSeed));
+      }
+
+      // Inserted instructions get metadata and debug locations naming their transform, see Provenance.cpp
+      if (AnnotationProvenance) {
+        M.setModuleFlag(Module::Override, "obf.provenance", ConstantInt::get(Type::getInt32Ty(context), 1));
+      }
+
+      std::set<std::string> usedAnnotations;
+      const bool regionsMarked = this->markRegions(M, usedAnnotations);
+
+      // The function passes that need the opaque value can't define it themselves
+      auto defineOpaqueValue = [&]() {
+        if (llvm::any_of(usedAnnotations, [](const std::string &name) { return OpaqueValue::isUsedBy(name); })) {
+          OpaqueValue::define(M);
+        }
+      };
+
       auto *annotations = M.getNamedGlobal("llvm.global.annotations");
       if (!annotations || !annotations->hasInitializer()) {
-        return PreservedAnalyses::all();
+        defineOpaqueValue();
+        return regionsMarked ? PreservedAnalyses::none() : PreservedAnalyses::all();
       }
 
       auto *initializer = dyn_cast<ConstantArray>(annotations->getInitializer());
       if (!initializer) {
-        return PreservedAnalyses::all();
+        defineOpaqueValue();
+        return regionsMarked ? PreservedAnalyses::none() : PreservedAnalyses::all();
       }
 
-      std::map<Function *, SmallVector<Metadata *>> valueAnnotationsMap;
+      MapVector<GlobalObject *, SmallVector<Metadata *>> valueAnnotationsMap;
 
       for (unsigned i = 0; i < initializer->getNumOperands(); ++i) {
         auto *operand = dyn_cast<ConstantStruct>(initializer->getOperand(i));
@@ -44,18 +213,19 @@ namespace {
           continue;
         }
 
-        if (auto *F = dyn_cast<Function>(value)) {
+        // Functions, and global variables for `encrypt`
+        if (auto *object = dyn_cast<GlobalObject>(value)) {
           // Remove last element of the parsed string with ASCII code 0
           std::string annotation = annotationMD->getAsString().str();
           annotation.pop_back();
 
           MDNode *mdNode = MDNode::get(context, MDString::get(context, annotation));
-          valueAnnotationsMap[F].push_back(mdNode);
+          valueAnnotationsMap[object].push_back(mdNode);
 
-          errs() << "[annotation] Attached annotation: " << F->getName()
-                 << " -> " << annotation << "\n";
+          NumAnnotationsAttached++;
+          LLVM_DEBUG(dbgs() << "[annotation] Attached annotation: " << object->getName() << " -> " << annotation << "\n");
         } else {
-          errs() << "[annotation] No annotation: " << value->getName() << "\n";
+          LLVM_DEBUG(dbgs() << "[annotation] No annotation: " << value->getName() << "\n");
         }
       }
 
@@ -65,8 +235,36 @@ namespace {
 
         MDNode *annotationNode = MDNode::get(value->getContext(), annotations);
         value->setMetadata("annotation", annotationNode);
+
+        // The tags stay with the instructions when the function is inlined
+        auto *F = dyn_cast<Function>(value);
+        if (!F) {
+          continue;
+        }
+
+        for (auto *annotation : annotations) {
+          StringRef name = cast<MDString>(cast<MDNode>(annotation)->getOperand(0))->getString();
+          usedAnnotations.insert(name.str());
+
+          // A whole function is virtualized, its body must not be inlined into native code
+          if (name == "virtualize") {
+            F->removeFnAttr(Attribute::AlwaysInline);
+            F->addFnAttr(Attribute::NoInline);
+          }
+
+          if (!AnnotationPass::isRegionAnnotation(name)) {
+            continue;
+          }
+
+          for (auto &inst : instructions(*F)) {
+            inst.addAnnotationMetadata(name);
+          }
+        }
       }
 
+      NumAnnotatedValues += valueAnnotationsMap.size();
+      defineOpaqueValue();
+
       return PreservedAnalyses::none();
     }
   };
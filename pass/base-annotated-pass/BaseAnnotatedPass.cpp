@@ -1,5 +1,18 @@
+#include <random>
+
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
+
+#include "CompileBudget.cpp"
+#include "FunctionCache.cpp"
+#include "Provenance.cpp"
 
 using namespace llvm;
 
@@ -8,18 +21,60 @@ class BaseAnnotatedPass : public PassInfoMixin<T> {
 private:
   const std::string annotationName;
 
-  virtual PreservedAnalyses applyPass(Function &F) const = 0;
+  mutable std::mt19937_64 rng;
 
-public:
-  BaseAnnotatedPass(const std::string &annotationName): annotationName(annotationName) {}
+  // Set while a function is transformed: the whole function is annotated, or only regions of it
+  mutable bool wholeFunction = true;
 
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    auto *md = F.getMetadata("annotation");
+  // Set while a function is transformed, see `getIntensity`
+  mutable double intensity = 1;
+
+  // Transforms an annotated function. Passes report their work with `STATISTIC` counters and
+  // optimization remarks (`-stats`, `-pass-remarks-output`) and stay silent otherwise
+  virtual PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const = 0;
+
+  // Module seed set by the annotation pass (`-annotation-seed`)
+  uint64_t getModuleSeed(const Module &M) const {
+    auto *seed = mdconst::extract_or_null<ConstantInt>(M.getModuleFlag("obf.seed"));
+    return seed ? seed->getZExtValue() : 0;
+  }
+
+protected:
+  // Checks the `!annotation` metadata of an instruction: strings added by `Instruction::addAnnotationMetadata`,
+  // and tuples of strings, like the ones the passes attach to their own instructions
+  static bool hasAnnotation(const Instruction &inst, StringRef annotation) {
+    auto *md = inst.getMetadata(LLVMContext::MD_annotation);
     if (!md) {
-      return PreservedAnalyses::all();
+      return false;
+    }
+
+    for (auto &mdOperand : md->operands()) {
+      if (auto *mdString = dyn_cast<MDString>(mdOperand)) {
+        if (mdString->getString() == annotation) {
+          return true;
+        }
+        continue;
+      }
+
+      if (auto *mdNode = dyn_cast<MDNode>(mdOperand)) {
+        for (auto &nested : mdNode->operands()) {
+          auto *mdString = dyn_cast<MDString>(nested);
+          if (mdString && mdString->getString() == annotation) {
+            return true;
+          }
+        }
+      }
     }
 
-    bool annotationFound = false;
+    return false;
+  }
+
+  // Checks if the whole function is annotated with `annotation`
+  static bool hasFunctionAnnotation(const Function &F, StringRef annotation) {
+    auto *md = F.getMetadata("annotation");
+    if (!md) {
+      return false;
+    }
 
     for (auto &mdOperand : md->operands()) {
       auto *mdNode = dyn_cast<MDNode>(mdOperand);
@@ -28,29 +83,144 @@ public:
       }
 
       auto *mdString = dyn_cast<MDString>(mdNode->getOperand(0));
-      if (!mdString) {
-        continue;
+      if (mdString && mdString->getString() == annotation) {
+        return true;
       }
+    }
 
-      if (mdString->getString() == this->annotationName) {
-        annotationFound = true;
-        break;
-      }
+    return false;
+  }
+
+  // Options that change the output of the pass, part of the cache key
+  virtual std::string getConfiguration() const {
+    return "";
+  }
+
+  // Completes a function spliced from the cache, e.g. defines the helpers it calls that only existed
+  // in the module it was obfuscated in
+  virtual void restoreCachedFunction(Function &F) const {}
+
+  // Random numbers for the current function. The generator is reseeded from the module seed, the pass,
+  // and the function name, so that a function is obfuscated the same way regardless of the rest of the module
+  uint64_t random() const {
+    return this->rng();
+  }
+
+  // Whether the whole function is annotated. Otherwise, the pass only obfuscates annotated regions:
+  // bodies of annotated functions inlined into the function, and code between region markers (runtime/obf.h).
+  // The annotation pass tags their instructions with `!annotation` metadata, which survives inlining
+  bool isWholeFunction() const {
+    return this->wholeFunction;
+  }
+
+  // Checks if an instruction is to be obfuscated: any instruction of an annotated function, or one of a region
+  bool isAnnotated(const Instruction &inst) const {
+    return this->wholeFunction || BaseAnnotatedPass::hasAnnotation(inst, this->annotationName);
+  }
+
+  // Checks if a block belongs to a region. A region begins and ends in the middle of the blocks
+  // it was inlined into, so a block with any annotated instruction belongs to it
+  bool isAnnotated(const BasicBlock &block) const {
+    return llvm::any_of(block, [&](const Instruction &inst) { return this->isAnnotated(inst); });
+  }
+
+  // Fraction of the usual density the pass applies to the current function, lowered by the budget pass
+  // (`-budget-ms`) to stay within the compile-time budget. Passes scale their probabilities and counts by it
+  double getIntensity() const {
+    return this->intensity;
+  }
+
+public:
+  BaseAnnotatedPass(const std::string &annotationName): annotationName(annotationName) {}
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    bool annotationFound = BaseAnnotatedPass::hasFunctionAnnotation(F, this->annotationName);
+
+    this->wholeFunction = annotationFound;
+
+    bool regionFound = !annotationFound && llvm::any_of(instructions(F), [&](const Instruction &inst) {
+      return BaseAnnotatedPass::hasAnnotation(inst, this->annotationName);
+    });
+
+    if (!annotationFound && !regionFound) {
+      return PreservedAnalyses::all();
+    }
+
+    Module &M = *F.getParent();
+
+    // Functions come in the priority order of the budget pass, the ones left when it runs out stay as they are
+    this->intensity = CompileBudget::getIntensity(F);
+    if (this->intensity > 0 && CompileBudget::isExhausted(M)) {
+      this->intensity = 0;
+      NumFunctionsOverBudget++;
+      CompileBudget::record(F, this->annotationName, "exhausted", 0);
+
+      FAM.getResult<OptimizationRemarkEmitterAnalysis>(F).emit([&]() {
+        return OptimizationRemarkMissed(this->annotationName.c_str(), "BudgetExhausted", &F)
+          << "left as is, the compile-time budget ran out";
+      });
+      return PreservedAnalyses::all();
     }
 
-    if (!annotationFound) {
+    if (this->intensity <= 0) {
+      if (CompileBudget::isEnabled(M)) {
+        CompileBudget::record(F, this->annotationName, "skipped", 0);
+      }
       return PreservedAnalyses::all();
     }
 
-    errs() << "[" << this->annotationName << "] Applying to: " << F.getName() << "\n";
+    DEBUG_WITH_TYPE(this->annotationName.c_str(), dbgs() << "[" << this->annotationName << "] Applying to: " << F.getName()
+                                                         << (regionFound ? " (regions)" : "") << "\n");
+
+    const CompileBudget::Clock::time_point begin = CompileBudget::Clock::now();
 
+    // Shows up as a separate scope of the pass in `-time-trace` profiles
+    TimeTraceScope timeScope(this->annotationName, F.getName());
+
+    const uint64_t seed = this->getModuleSeed(M);
+    this->rng.seed(xxh3_64bits(std::to_string(seed) + "/" + this->annotationName + "/" + F.getName().str()));
+
+    // Unchanged functions are spliced from the cache (`OBF_CACHE_DIR`) instead of being transformed again
+    FunctionCache cache;
+    std::string cacheKey;
+    if (cache.isEnabled()) {
+      // Provenance tags change the output as much as the options do
+      std::string configuration = this->getConfiguration();
+      if (Provenance::isEnabled(M)) {
+        configuration += " provenance";
+      }
+      if (this->intensity < 1) {
+        configuration += " intensity=" + std::to_string(this->intensity);
+      }
+
+      cacheKey = cache.key(F, this->annotationName, configuration, seed);
+      if (cache.load(F, cacheKey)) {
+        this->restoreCachedFunction(F);
+        if (CompileBudget::isEnabled(M)) {
+          int64_t spent = CompileBudget::charge(M, this->annotationName, begin);
+          CompileBudget::record(F, this->annotationName, "cached", this->intensity, spent);
+        }
+        return PreservedAnalyses::none();
+      }
+    }
+
+    bool changed;
     try {
-      this->applyPass(F);
+      changed = !this->applyPass(F, FAM).areAllPreserved();
     } catch (const std::runtime_error& e) {
       errs() << "[" << this->annotationName << "] ERROR: " << e.what() << "\n";
       throw e;
     }
 
+    if (cache.isEnabled()) {
+      cache.store(F, cacheKey);
+    }
+
+    if (CompileBudget::isEnabled(M)) {
+      int64_t spent = CompileBudget::charge(M, this->annotationName, begin);
+      CompileBudget::record(F, this->annotationName, changed ? "obfuscated" : "unchanged", this->intensity, spent);
+    }
+
     return PreservedAnalyses::none();
   }
 };
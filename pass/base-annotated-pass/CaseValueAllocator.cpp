@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <set>
+#include <vector>
+
+// Allocates dispatcher case values from a dense range `[0, R)`, where `R` is the requested capacity plus 1/16.
+//
+// Values are drawn from the range in a random order (an incremental Fisher-Yates shuffle). The range stays dense,
+// so the backend lowers the dispatcher to a single bounded jump table, while blocks that are adjacent in the layout
+// get unrelated values. When the range is exhausted, it grows by 1/8 and previously allocated values stay valid.
+// A dispatcher that takes the requested number of values uses at least 16/17 of the range (8/9 once it grew),
+// unless values reserved beyond the range leave gaps below them
+class CaseValueAllocator {
+private:
+  uint64_t range = 0;
+
+  // Values of the range that are not drawn yet
+  std::vector<uint64_t> pool;
+  std::set<uint64_t> used;
+
+  std::mt19937_64 rng;
+
+  void grow(uint64_t newRange) {
+    for (uint64_t value = this->range; value < newRange; value++) {
+      this->pool.push_back(value);
+    }
+
+    this->range = newRange;
+  }
+
+public:
+  CaseValueAllocator(uint64_t capacity, uint64_t seed) : rng(seed) {
+    capacity = std::max<uint64_t>(capacity, 2);
+    this->grow(capacity + capacity / 16);
+  }
+
+  // Marks an existing case value as taken, e.g. the cases of a dispatcher generated by another pass
+  void reserve(uint64_t value) {
+    this->used.insert(value);
+
+    if (value >= this->range) {
+      this->grow(value + 1);
+    }
+  }
+
+  uint64_t allocate() {
+    while (true) {
+      if (this->pool.empty()) {
+        this->grow(this->range + this->range / 8 + 1);
+      }
+
+      std::swap(this->pool[this->rng() % this->pool.size()], this->pool.back());
+      uint64_t value = this->pool.back();
+      this->pool.pop_back();
+
+      if (this->used.insert(value).second) {
+        return value;
+      }
+    }
+  }
+};
@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "obf-budget"
+
+STATISTIC(NumFunctionsOverBudget, "Number of functions left as is after the compile-time budget ran out");
+
+// Compile-time budget of the obfuscation passes, planned by the budget pass (`-budget-ms`).
+//
+// The state lives in the module, because the passes are separate plugins:
+//   - the `obf.budget` module flag holds the budget in microseconds
+//   - `!obf.budget.spent` named metadata holds the time every pass spent so far, `!{!"<pass>", i64 <us>}`
+//   - `!obf.intensity !{double}` function metadata holds the intensity planned for a function, 1 if it is missing.
+//     Passes scale their density by it, and flattening is dropped below `flattenIntensity`
+//   - `!obf.budget.outcome` named metadata holds what every pass actually did to every function,
+//     `!{ptr @f, !"<pass>", !"<outcome>", double <intensity>, i64 <us>}`, for the report of the budget pass.
+//     It is module metadata, so that it doesn't become part of the functions kept by the cache
+class CompileBudget {
+private:
+  static constexpr const char *flagName = "obf.budget";
+  static constexpr const char *spentName = "obf.budget.spent";
+  static constexpr const char *intensityName = "obf.intensity";
+  static constexpr const char *outcomeName = "obf.budget.outcome";
+
+public:
+  static constexpr double flattenIntensity = 0.5;
+
+  using Clock = std::chrono::steady_clock;
+
+  struct Outcome {
+    std::string pass;
+    // `obfuscated`, `unchanged` (the pass had nothing to do at this intensity), `cached`,
+    // `skipped` (planned intensity 0), or `exhausted` (the budget ran out before the function)
+    std::string outcome;
+    double intensity;
+    int64_t spent;
+  };
+
+  static bool isEnabled(const Module &M) {
+    return CompileBudget::getBudget(M) > 0;
+  }
+
+  // Budget in microseconds, 0 if there is none
+  static int64_t getBudget(const Module &M) {
+    auto *flag = mdconst::extract_or_null<ConstantInt>(M.getModuleFlag(CompileBudget::flagName));
+    return flag ? flag->getSExtValue() : 0;
+  }
+
+  // Starts a budget of `budget` microseconds, nothing is spent yet
+  static void start(Module &M, int64_t budget) {
+    M.setModuleFlag(Module::Override, CompileBudget::flagName, ConstantInt::get(Type::getInt64Ty(M.getContext()), budget));
+
+    for (const char *name : {CompileBudget::spentName, CompileBudget::outcomeName}) {
+      if (auto *md = M.getNamedMetadata(name)) {
+        M.eraseNamedMetadata(md);
+      }
+    }
+  }
+
+  // Microseconds spent by `pass`, or by all passes if `pass` is empty
+  static int64_t getSpent(const Module &M, StringRef pass = "") {
+    auto *spent = M.getNamedMetadata(CompileBudget::spentName);
+    if (!spent) {
+      return 0;
+    }
+
+    int64_t total = 0;
+    for (auto *entry : spent->operands()) {
+      if (pass.empty() || cast<MDString>(entry->getOperand(0))->getString() == pass) {
+        total += mdconst::extract<ConstantInt>(entry->getOperand(1))->getSExtValue();
+      }
+    }
+
+    return total;
+  }
+
+  static bool isExhausted(const Module &M) {
+    return CompileBudget::isEnabled(M) && CompileBudget::getSpent(M) >= CompileBudget::getBudget(M);
+  }
+
+  // Adds the time elapsed since `begin` to the time spent by `pass`, returns the elapsed microseconds
+  static int64_t charge(Module &M, StringRef pass, Clock::time_point begin) {
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+
+    LLVMContext &context = M.getContext();
+    NamedMDNode *spent = M.getOrInsertNamedMetadata(CompileBudget::spentName);
+
+    unsigned i = 0;
+    while (i < spent->getNumOperands() && cast<MDString>(spent->getOperand(i)->getOperand(0))->getString() != pass) {
+      i++;
+    }
+
+    MDNode *entry = MDNode::get(context, {
+      MDString::get(context, pass),
+      ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(context), CompileBudget::getSpent(M, pass) + elapsed)),
+    });
+
+    if (i < spent->getNumOperands()) {
+      spent->setOperand(i, entry);
+    } else {
+      spent->addOperand(entry);
+    }
+
+    return elapsed;
+  }
+
+  // Records what `pass` did to `F`, with the intensity it applied and the microseconds it took
+  static void record(Function &F, StringRef pass, StringRef outcome, double intensity, int64_t spent = 0) {
+    LLVMContext &context = F.getContext();
+    F.getParent()->getOrInsertNamedMetadata(CompileBudget::outcomeName)->addOperand(MDNode::get(context, {
+      ConstantAsMetadata::get(&F),
+      MDString::get(context, pass),
+      MDString::get(context, outcome),
+      ConstantAsMetadata::get(ConstantFP::get(Type::getDoubleTy(context), intensity)),
+      ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(context), spent)),
+    }));
+  }
+
+  // Recorded outcomes of every function, in the order of the passes
+  static DenseMap<const Function *, std::vector<Outcome>> getOutcomes(const Module &M) {
+    DenseMap<const Function *, std::vector<Outcome>> outcomes;
+
+    auto *md = M.getNamedMetadata(CompileBudget::outcomeName);
+    if (!md) {
+      return outcomes;
+    }
+
+    for (auto *entry : md->operands()) {
+      // Functions erased after a pass leave null operands
+      auto *F = mdconst::dyn_extract_or_null<Function>(entry->getOperand(0));
+      if (!F) {
+        continue;
+      }
+
+      outcomes[F].push_back({
+        cast<MDString>(entry->getOperand(1))->getString().str(),
+        cast<MDString>(entry->getOperand(2))->getString().str(),
+        mdconst::extract<ConstantFP>(entry->getOperand(3))->getValueAPF().convertToDouble(),
+        mdconst::extract<ConstantInt>(entry->getOperand(4))->getSExtValue(),
+      });
+    }
+
+    return outcomes;
+  }
+
+  static double getIntensity(const Function &F) {
+    auto *md = F.getMetadata(CompileBudget::intensityName);
+    if (!md || md->getNumOperands() != 1) {
+      return 1;
+    }
+
+    auto *intensity = mdconst::dyn_extract<ConstantFP>(md->getOperand(0));
+    return intensity ? intensity->getValueAPF().convertToDouble() : 1;
+  }
+
+  static void setIntensity(Function &F, double intensity) {
+    LLVMContext &context = F.getContext();
+    F.setMetadata(CompileBudget::intensityName, MDNode::get(context, {
+      ConstantAsMetadata::get(ConstantFP::get(Type::getDoubleTy(context), intensity)),
+    }));
+  }
+};
+
+#undef DEBUG_TYPE
@@ -0,0 +1,231 @@
+#include <vector>
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+// Instruments a flattened dispatcher (`switch` over `caseVar`) with per-thread counters.
+//
+// Each function gets a descriptor global that is passed to the `obfprof` runtime (runtime/obfprof.c)
+// once per invocation. The runtime returns a thread-local block of `i64` counters:
+//   [0, N)                      - executions of every case, N is the number of switch cases
+//   [N, N + (N + 1) * N)        - transitions `previous case -> case`, the row N is the function entry
+//   [T]                         - dispatcher iterations
+//   [T + 1]                     - cycles spent between the dispatcher and the case (optional)
+// Increments are plain loads and stores, the counters are never shared between threads.
+class DispatcherProfiler {
+private:
+  static constexpr const char *metadataName = "obfprof";
+  static constexpr const char *runtimeFuncName = "__obfprof_counters";
+  static constexpr unsigned descVersion = 1;
+
+  // Transition matrix grows quadratically, larger dispatchers only record case counts
+  static constexpr unsigned maxTransitionCases = 256;
+
+  enum Flags : unsigned {
+    RecordTransitions = 1,
+    RecordCycles = 2,
+  };
+
+  const bool recordCycles;
+
+  void tag(Value *value) const {
+    if (auto *inst = dyn_cast<Instruction>(value)) {
+      inst->setMetadata(this->metadataName, MDNode::get(inst->getContext(), {}));
+    }
+  }
+
+  // Emits `counters[idx] += amount`
+  void increment(IRBuilder<> &builder, Value *counters, Value *idx, Value *amount) const {
+    Type *int64Ty = builder.getInt64Ty();
+
+    Value *ptr = builder.CreateInBoundsGEP(int64Ty, counters, idx);
+    Value *count = builder.CreateLoad(int64Ty, ptr);
+    Value *sum = builder.CreateAdd(count, amount);
+    Value *store = builder.CreateStore(sum, ptr);
+
+    for (auto *value : {ptr, count, sum, store}) {
+      this->tag(value);
+    }
+  }
+
+  GlobalVariable *createDescriptor(Function &F, SwitchInst *switchInst, unsigned flags) const {
+    Module &M = *F.getParent();
+    LLVMContext &context = F.getContext();
+    Type *ptrTy = PointerType::get(context, 0);
+    Type *int32Ty = Type::getInt32Ty(context);
+
+    std::vector<uint32_t> caseValues;
+    for (auto &switchCase : switchInst->cases()) {
+      caseValues.push_back(switchCase.getCaseValue()->getZExtValue());
+    }
+
+    Constant *nameInit = ConstantDataArray::getString(context, F.getName());
+    auto *name = new GlobalVariable(
+      M, nameInit->getType(), true, GlobalValue::PrivateLinkage, nameInit, "obfprof.name"
+    );
+
+    Constant *valuesInit = ConstantDataArray::get(context, caseValues);
+    auto *values = new GlobalVariable(
+      M, valuesInit->getType(), true, GlobalValue::PrivateLinkage, valuesInit, "obfprof.values"
+    );
+
+    // { version, caseNum, flags, id (assigned by the runtime), name, caseValues, next (runtime registry) }
+    StructType *descTy = StructType::get(context, {int32Ty, int32Ty, int32Ty, int32Ty, ptrTy, ptrTy, ptrTy});
+    Constant *descInit = ConstantStruct::get(descTy, {
+      ConstantInt::get(int32Ty, this->descVersion),
+      ConstantInt::get(int32Ty, caseValues.size()),
+      ConstantInt::get(int32Ty, flags),
+      ConstantInt::get(int32Ty, 0),
+      name,
+      values,
+      ConstantPointerNull::get(cast<PointerType>(ptrTy)),
+    });
+
+    return new GlobalVariable(M, descTy, false, GlobalValue::InternalLinkage, descInit, "obfprof.desc");
+  }
+
+public:
+  DispatcherProfiler(bool recordCycles) : recordCycles(recordCycles) {}
+
+  // Removes the instrumentation, e.g. before the dispatcher gets new cases
+  void strip(Function &F) const {
+    std::vector<Instruction *> instrumentation;
+    SetVector<GlobalVariable *> descriptors;
+
+    for (auto &block : F) {
+      for (auto &inst : block) {
+        if (!inst.getMetadata(this->metadataName)) {
+          continue;
+        }
+
+        instrumentation.push_back(&inst);
+
+        if (auto *call = dyn_cast<CallInst>(&inst)) {
+          if (auto *desc = dyn_cast<GlobalVariable>(call->getArgOperand(0))) {
+            descriptors.insert(desc);
+          }
+        }
+      }
+    }
+
+    for (auto *inst : instrumentation) {
+      inst->dropAllReferences();
+    }
+    for (auto *inst : instrumentation) {
+      inst->eraseFromParent();
+    }
+
+    for (auto *desc : descriptors) {
+      if (!desc->use_empty()) {
+        continue;
+      }
+
+      auto *descInit = cast<ConstantStruct>(desc->getInitializer());
+      SmallVector<GlobalVariable *, 2> arrays;
+      for (unsigned i : {4, 5}) {
+        if (auto *global = dyn_cast<GlobalVariable>(descInit->getOperand(i))) {
+          arrays.push_back(global);
+        }
+      }
+      desc->eraseFromParent();
+
+      // The uniqued initializer outlives the descriptor and still uses the name and the case values
+      for (auto *global : arrays) {
+        global->removeDeadConstantUsers();
+        if (global->use_empty()) {
+          global->eraseFromParent();
+        }
+      }
+    }
+  }
+
+  void instrument(Function &F, SwitchInst *switchInst) const {
+    Module &M = *F.getParent();
+    LLVMContext &context = F.getContext();
+    IRBuilder<> builder(context);
+
+    Type *ptrTy = PointerType::get(context, 0);
+    Type *int32Ty = Type::getInt32Ty(context);
+    Type *int64Ty = Type::getInt64Ty(context);
+
+    const unsigned caseNum = switchInst->getNumCases();
+    const bool recordTransitions = caseNum <= this->maxTransitionCases;
+
+    unsigned flags = (recordTransitions ? RecordTransitions : 0) | (this->recordCycles ? RecordCycles : 0);
+    const uint64_t transitionsOffset = caseNum;
+    const uint64_t dispatchIdx = caseNum + (recordTransitions ? (uint64_t)(caseNum + 1) * caseNum : 0);
+    const uint64_t cyclesIdx = dispatchIdx + 1;
+
+    GlobalVariable *desc = this->createDescriptor(F, switchInst, flags);
+    FunctionCallee runtimeFunc = M.getOrInsertFunction(
+      this->runtimeFuncName, FunctionType::get(ptrTy, {ptrTy}, false)
+    );
+
+    // Per-invocation state lives in the entry block, so that it dominates every case
+    BasicBlock &entryBlock = F.front();
+    builder.SetInsertPoint(&*entryBlock.getFirstInsertionPt());
+    AllocaInst *prevCase = builder.CreateAlloca(int32Ty, nullptr, "obfprof.prev");
+    AllocaInst *dispatchStart = builder.CreateAlloca(int64Ty, nullptr, "obfprof.start");
+    this->tag(prevCase);
+    this->tag(dispatchStart);
+
+    builder.SetInsertPoint(entryBlock.getTerminator());
+    CallInst *counters = builder.CreateCall(runtimeFunc, {desc}, "obfprof");
+    this->tag(counters);
+    this->tag(builder.CreateStore(ConstantInt::get(int32Ty, caseNum), prevCase));
+
+    // Dispatcher
+    builder.SetInsertPoint(&*switchInst->getParent()->getFirstInsertionPt());
+    this->increment(builder, counters, builder.getInt64(dispatchIdx), builder.getInt64(1));
+    if (this->recordCycles) {
+      Value *now = builder.CreateIntrinsic(Intrinsic::readcyclecounter, ArrayRef<Type *>(), ArrayRef<Value *>());
+      this->tag(now);
+      this->tag(builder.CreateStore(now, dispatchStart));
+    }
+
+    // Cases
+    unsigned caseIdx = 0;
+    for (auto &switchCase : switchInst->cases()) {
+      BasicBlock *caseBlock = switchCase.getCaseSuccessor();
+      builder.SetInsertPoint(&*caseBlock->getFirstInsertionPt());
+
+      if (this->recordCycles) {
+        Value *now = builder.CreateIntrinsic(Intrinsic::readcyclecounter, ArrayRef<Type *>(), ArrayRef<Value *>());
+        Value *start = builder.CreateLoad(int64Ty, dispatchStart);
+        Value *cycles = builder.CreateSub(now, start);
+        for (auto *value : {now, start, cycles}) {
+          this->tag(value);
+        }
+        this->increment(builder, counters, builder.getInt64(cyclesIdx), cycles);
+      }
+
+      this->increment(builder, counters, builder.getInt64(caseIdx), builder.getInt64(1));
+
+      if (recordTransitions) {
+        // transitions[prev * N + case]
+        Value *prev = builder.CreateLoad(int32Ty, prevCase);
+        Value *prev64 = builder.CreateZExt(prev, int64Ty);
+        Value *row = builder.CreateMul(prev64, builder.getInt64(caseNum));
+        Value *idx = builder.CreateAdd(row, builder.getInt64(transitionsOffset + caseIdx));
+        for (auto *value : {prev, prev64, row, idx}) {
+          this->tag(value);
+        }
+        this->increment(builder, counters, idx, builder.getInt64(1));
+        this->tag(builder.CreateStore(ConstantInt::get(int32Ty, caseIdx), prevCase));
+      }
+
+      caseIdx++;
+    }
+  }
+
+  // Checks if the instruction was inserted by the profiler
+  static bool isInstrumentation(const Instruction &inst) {
+    return inst.getMetadata(metadataName) != nullptr;
+  }
+};
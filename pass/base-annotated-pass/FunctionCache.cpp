@@ -0,0 +1,478 @@
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "obf-cache"
+
+STATISTIC(NumCacheHits, "Number of obfuscated functions spliced from the cache");
+STATISTIC(NumCacheMisses, "Number of annotated functions not found in the cache");
+STATISTIC(NumCacheStores, "Number of obfuscated functions written to the cache");
+
+// Struct types of a cached module parsed into the same context get a numeric suffix (`%struct.s.0`).
+// Maps them back to the layout-identical types of the module, so that spliced bodies keep the original types
+class CachedTypeRemapper : public ValueMapTypeRemapper {
+private:
+  LLVMContext &context;
+  DenseMap<Type *, Type *> remapped;
+
+public:
+  CachedTypeRemapper(LLVMContext &context) : context(context) {}
+
+  Type *remapType(Type *type) override {
+    auto it = this->remapped.find(type);
+    if (it != this->remapped.end()) {
+      return it->second;
+    }
+
+    Type *result = type;
+
+    if (auto *structTy = dyn_cast<StructType>(type)) {
+      SmallVector<Type *, 8> elements;
+      for (Type *element : structTy->elements()) {
+        elements.push_back(this->remapType(element));
+      }
+
+      if (!structTy->hasName()) {
+        result = structTy->isOpaque() ? structTy : StructType::get(this->context, elements, structTy->isPacked());
+      } else {
+        auto [stem, suffix] = structTy->getName().rsplit('.');
+        StructType *original = !suffix.empty() && all_of(suffix, isDigit)
+          ? StructType::getTypeByName(this->context, stem)
+          : nullptr;
+
+        if (
+          original && original != structTy
+          && original->isPacked() == structTy->isPacked()
+          && original->elements() == ArrayRef<Type *>(elements)
+        ) {
+          result = original;
+        }
+      }
+    } else if (auto *arrayTy = dyn_cast<ArrayType>(type)) {
+      result = ArrayType::get(this->remapType(arrayTy->getElementType()), arrayTy->getNumElements());
+    } else if (auto *vectorTy = dyn_cast<VectorType>(type)) {
+      result = VectorType::get(this->remapType(vectorTy->getElementType()), vectorTy->getElementCount());
+    }
+
+    this->remapped[type] = result;
+    return result;
+  }
+};
+
+// On-disk cache of obfuscated function bodies, enabled by the `OBF_CACHE_DIR` environment variable.
+//
+// An entry is keyed by the SHA-256 of the function as a standalone module (its body, annotations, and declarations
+// of the referenced globals), the pass name and configuration, and the module seed. It stores the obfuscated
+// function together with the local globals it exclusively owns, e.g. the ones created by the passes.
+// On a hit, the body of the function is replaced with the cached one, and references are resolved by name
+class FunctionCache {
+private:
+  // Bump when the layout of the entries or the key changes, or when a pass transforms differently
+  // with the same options. Entries of other versions are never hit
+  static constexpr const char *cacheVersion = "obf-cache-2";
+
+  std::string directory;
+
+  // Checks if `value` is only reachable from `F`: used by its instructions, or by constants and local globals
+  // that are themselves only used by `F`
+  static bool isUsedOnlyBy(const Value *value, const Function &F, DenseSet<const Value *> &visited) {
+    if (!visited.insert(value).second) {
+      return true;
+    }
+
+    for (const User *user : value->users()) {
+      if (auto *inst = dyn_cast<Instruction>(user)) {
+        if (inst->getFunction() != &F) {
+          return false;
+        }
+      } else if (auto *global = dyn_cast<GlobalVariable>(user)) {
+        if (!global->hasLocalLinkage() || !isUsedOnlyBy(global, F, visited)) {
+          return false;
+        }
+      } else if (isa<Constant>(user) && !isa<GlobalValue>(user)) {
+        if (!isUsedOnlyBy(user, F, visited)) {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Local definitions that may be copied together with the function
+  static bool isOwnedBy(const GlobalValue *global, const Function &F) {
+    if (!global->hasLocalLinkage() || global->isDeclaration() || !isa<GlobalVariable>(global)) {
+      return false;
+    }
+
+    DenseSet<const Value *> visited;
+    return isUsedOnlyBy(global, F, visited);
+  }
+
+  // Collects globals referenced by `value`, looking through constant expressions and aggregates
+  static void collectGlobals(const Value *value, SetVector<GlobalValue *> &globals, DenseSet<const Value *> &visited) {
+    if (!visited.insert(value).second) {
+      return;
+    }
+
+    if (auto *global = dyn_cast<GlobalValue>(value)) {
+      globals.insert(const_cast<GlobalValue *>(global));
+      return;
+    }
+
+    if (auto *constant = dyn_cast<Constant>(value)) {
+      for (const Value *operand : constant->operands()) {
+        collectGlobals(operand, globals, visited);
+      }
+    }
+  }
+
+  // Local globals exclusively owned by the body of `F`, including the ones only referenced by their initializers
+  static std::vector<GlobalVariable *> getOwnedGlobals(Function &F) {
+    SetVector<GlobalValue *> globals;
+    DenseSet<const Value *> visited;
+
+    if (F.hasPersonalityFn()) {
+      collectGlobals(F.getPersonalityFn(), globals, visited);
+    }
+    for (auto &inst : instructions(F)) {
+      for (const Value *operand : inst.operands()) {
+        collectGlobals(operand, globals, visited);
+      }
+    }
+
+    std::vector<GlobalVariable *> owned;
+
+    // `globals` grows while owned initializers are scanned
+    for (size_t i = 0; i < globals.size(); i++) {
+      if (globals[i] != &F && isOwnedBy(globals[i], F)) {
+        auto *globalVar = cast<GlobalVariable>(globals[i]);
+        owned.push_back(globalVar);
+        collectGlobals(globalVar->getInitializer(), globals, visited);
+      }
+    }
+
+    return owned;
+  }
+
+  // Copies `F` into a standalone module. Exclusively owned local globals are copied as definitions,
+  // all other referenced globals as declarations with the same names
+  std::unique_ptr<Module> extract(Function &F) const {
+    Module &M = *F.getParent();
+    LLVMContext &context = F.getContext();
+
+    auto extracted = std::make_unique<Module>(this->cacheVersion, context);
+    extracted->setDataLayout(M.getDataLayout());
+    extracted->setTargetTriple(M.getTargetTriple());
+
+    SetVector<GlobalValue *> globals;
+    DenseSet<const Value *> visited;
+
+    if (F.hasPersonalityFn()) {
+      collectGlobals(F.getPersonalityFn(), globals, visited);
+    }
+    for (auto &block : F) {
+      for (auto &inst : block) {
+        for (const Value *operand : inst.operands()) {
+          collectGlobals(operand, globals, visited);
+        }
+      }
+    }
+
+    ValueToValueMapTy VMap;
+    std::vector<std::pair<GlobalVariable *, GlobalVariable *>> ownedGlobals;
+
+    // `globals` grows while owned initializers are scanned
+    for (size_t i = 0; i < globals.size(); i++) {
+      GlobalValue *global = globals[i];
+      if (global == &F) {
+        continue;
+      }
+
+      if (this->isOwnedBy(global, F)) {
+        auto *globalVar = cast<GlobalVariable>(global);
+        auto *copy = new GlobalVariable(
+          *extracted, globalVar->getValueType(), globalVar->isConstant(), globalVar->getLinkage(),
+          nullptr, globalVar->getName(), nullptr, globalVar->getThreadLocalMode(), globalVar->getAddressSpace()
+        );
+        copy->copyAttributesFrom(globalVar);
+        ownedGlobals.push_back({globalVar, copy});
+        VMap[globalVar] = copy;
+
+        collectGlobals(globalVar->getInitializer(), globals, visited);
+        continue;
+      }
+
+      if (auto *func = dyn_cast<Function>(global)) {
+        auto *decl = Function::Create(func->getFunctionType(), GlobalValue::ExternalLinkage, func->getName(), *extracted);
+        decl->setCallingConv(func->getCallingConv());
+        decl->setAttributes(func->getAttributes());
+        VMap[func] = decl;
+      } else if (global->getValueType()->isFunctionTy()) {
+        // Aliases and ifuncs of functions are only referenced by name
+        VMap[global] = Function::Create(
+          cast<FunctionType>(global->getValueType()), GlobalValue::ExternalLinkage, global->getName(), *extracted
+        );
+      } else {
+        auto *globalVar = dyn_cast<GlobalVariable>(global);
+        VMap[global] = new GlobalVariable(
+          *extracted, global->getValueType(), globalVar && globalVar->isConstant(), GlobalValue::ExternalLinkage,
+          nullptr, global->getName(), nullptr, global->getThreadLocalMode(), global->getAddressSpace()
+        );
+      }
+    }
+
+    Function *copy = Function::Create(F.getFunctionType(), F.getLinkage(), F.getName(), *extracted);
+    VMap[&F] = copy;
+
+    for (auto [arg, copyArg] : zip(F.args(), copy->args())) {
+      copyArg.setName(arg.getName());
+      VMap[&arg] = &copyArg;
+    }
+
+    SmallVector<ReturnInst *, 8> returns;
+    CloneFunctionInto(copy, &F, VMap, CloneFunctionChangeType::DifferentModule, returns);
+
+    // After the body, initializers may hold addresses of its blocks (e.g. bytecode of `virtualize`)
+    for (auto &[original, copy] : ownedGlobals) {
+      copy->setInitializer(MapValue(original->getInitializer(), VMap));
+    }
+    this->removeEmptyCompileUnits(*extracted);
+
+    return extracted;
+  }
+
+  // Cloning into another module creates `!llvm.dbg.cu` even for functions without debug info
+  static void removeEmptyCompileUnits(Module &M) {
+    NamedMDNode *compileUnits = M.getNamedMetadata("llvm.dbg.cu");
+    if (compileUnits && compileUnits->getNumOperands() == 0) {
+      compileUnits->eraseFromParent();
+    }
+  }
+
+  std::string entryPath(StringRef key) const {
+    SmallString<256> path(this->directory);
+    sys::path::append(path, key.take_front(2), key + ".bc");
+    return std::string(path);
+  }
+
+public:
+  FunctionCache() {
+    if (const char *directory = std::getenv("OBF_CACHE_DIR")) {
+      this->directory = directory;
+    }
+  }
+
+  bool isEnabled() const {
+    return !this->directory.empty();
+  }
+
+  std::string key(Function &F, StringRef passName, StringRef configuration, uint64_t seed) const {
+    std::string text;
+    raw_string_ostream os(text);
+
+    os << this->cacheVersion << "\n" << LLVM_VERSION_STRING << "\n"
+       << passName << "\n" << configuration << "\n" << seed << "\n";
+    this->extract(F)->print(os, nullptr);
+
+    SHA256 hasher;
+    hasher.update(os.str());
+    return toHex(hasher.final(), true);
+  }
+
+  // Replaces the body of `F` with the cached one. Leaves `F` untouched on a miss
+  bool load(Function &F, StringRef key) const {
+    Module &M = *F.getParent();
+    LLVMContext &context = F.getContext();
+
+    auto buffer = MemoryBuffer::getFile(this->entryPath(key));
+    if (!buffer) {
+      NumCacheMisses++;
+      return false;
+    }
+
+    auto cachedOrError = parseBitcodeFile((*buffer)->getMemBufferRef(), context);
+    if (!cachedOrError) {
+      consumeError(cachedOrError.takeError());
+      NumCacheMisses++;
+      return false;
+    }
+
+    std::unique_ptr<Module> cached = std::move(*cachedOrError);
+    CachedTypeRemapper typeRemapper(context);
+
+    Function *cachedFunc = cached->getFunction(F.getName());
+    if (
+      !cachedFunc || cachedFunc->isDeclaration()
+      || typeRemapper.remapType(cachedFunc->getFunctionType()) != F.getFunctionType()
+    ) {
+      NumCacheMisses++;
+      return false;
+    }
+
+    // Check that all declarations resolve before touching the module
+    for (auto &global : cached->global_values()) {
+      if (&global == cachedFunc || !global.isDeclaration()) {
+        continue;
+      }
+
+      // Unnamed globals can't be resolved
+      if (!global.hasName()) {
+        NumCacheMisses++;
+        return false;
+      }
+
+      auto *func = dyn_cast<Function>(&global);
+      auto *target = M.getNamedValue(global.getName());
+      if (func && target && !func->isIntrinsic() && isa<Function>(target)
+          && typeRemapper.remapType(func->getFunctionType()) != cast<Function>(target)->getFunctionType()) {
+        NumCacheMisses++;
+        return false;
+      }
+    }
+
+    ValueToValueMapTy VMap;
+    VMap[cachedFunc] = &F;
+
+    for (auto [cachedArg, arg] : zip(cachedFunc->args(), F.args())) {
+      VMap[&cachedArg] = &arg;
+    }
+
+    // Drop the current body first, together with the globals owned by it: their names can be reused,
+    // so that the spliced function is identical to a freshly obfuscated one
+    std::vector<GlobalVariable *> previousGlobals = this->getOwnedGlobals(F);
+
+    for (auto &block : F) {
+      block.dropAllReferences();
+    }
+    while (!F.empty()) {
+      F.begin()->eraseFromParent();
+    }
+    F.clearMetadata();
+
+    // Owned globals may reference each other, so all initializers go before any of them
+    for (GlobalVariable *global : previousGlobals) {
+      global->setInitializer(nullptr);
+    }
+    for (GlobalVariable *global : previousGlobals) {
+      global->removeDeadConstantUsers();
+      if (global->use_empty()) {
+        global->eraseFromParent();
+      }
+    }
+
+    std::vector<std::pair<GlobalVariable *, GlobalVariable *>> ownedGlobals;
+
+    for (auto &global : cached->global_values()) {
+      if (&global == cachedFunc) {
+        continue;
+      }
+
+      if (global.isDeclaration()) {
+        if (auto *target = M.getNamedValue(global.getName())) {
+          VMap[&global] = target;
+        } else if (auto *func = dyn_cast<Function>(&global)) {
+          auto *decl = Function::Create(
+            cast<FunctionType>(typeRemapper.remapType(func->getFunctionType())),
+            GlobalValue::ExternalLinkage, func->getName(), M
+          );
+          decl->setCallingConv(func->getCallingConv());
+          decl->setAttributes(func->getAttributes());
+          VMap[&global] = decl;
+        } else {
+          auto *globalVar = cast<GlobalVariable>(&global);
+          VMap[&global] = new GlobalVariable(
+            M, typeRemapper.remapType(globalVar->getValueType()), globalVar->isConstant(), GlobalValue::ExternalLinkage,
+            nullptr, globalVar->getName(), nullptr, globalVar->getThreadLocalMode(), globalVar->getAddressSpace()
+          );
+        }
+        continue;
+      }
+
+      auto *cachedVar = cast<GlobalVariable>(&global);
+
+      if (auto *previous = M.getNamedGlobal(cachedVar->getName())) {
+        previous->removeDeadConstantUsers();
+        if (previous->hasLocalLinkage() && previous->use_empty()) {
+          previous->eraseFromParent();
+        }
+      }
+
+      auto *copy = new GlobalVariable(
+        M, typeRemapper.remapType(cachedVar->getValueType()), cachedVar->isConstant(), cachedVar->getLinkage(),
+        nullptr, cachedVar->getName(), nullptr, cachedVar->getThreadLocalMode(), cachedVar->getAddressSpace()
+      );
+      copy->copyAttributesFrom(cachedVar);
+      ownedGlobals.push_back({cachedVar, copy});
+      VMap[cachedVar] = copy;
+    }
+
+    SmallVector<ReturnInst *, 8> returns;
+    CloneFunctionInto(&F, cachedFunc, VMap, CloneFunctionChangeType::DifferentModule, returns, "", nullptr, &typeRemapper);
+
+    for (auto &[cachedVar, copy] : ownedGlobals) {
+      copy->setInitializer(MapValue(cachedVar->getInitializer(), VMap, RF_None, &typeRemapper));
+    }
+    this->removeEmptyCompileUnits(M);
+
+    NumCacheHits++;
+    LLVM_DEBUG(dbgs() << "[obf-cache] Hit: " << F.getName() << " (" << key << ")\n");
+
+    return true;
+  }
+
+  // Writes the obfuscated `F`. Entries are renamed into place, so concurrent builds may share the directory
+  void store(Function &F, StringRef key) const {
+    std::string path = this->entryPath(key);
+
+    if (sys::fs::create_directories(sys::path::parent_path(path))) {
+      return;
+    }
+
+    int fd;
+    SmallString<256> tempPath;
+    if (sys::fs::createUniqueFile(path + ".tmp-%%%%%%%%", fd, tempPath)) {
+      return;
+    }
+
+    {
+      raw_fd_ostream os(fd, true);
+      WriteBitcodeToFile(*this->extract(F), os);
+    }
+
+    if (sys::fs::rename(tempPath, path)) {
+      sys::fs::remove(tempPath);
+      return;
+    }
+
+    NumCacheStores++;
+    LLVM_DEBUG(dbgs() << "[obf-cache] Stored: " << F.getName() << " (" << key << ")\n");
+  }
+};
+
+#undef DEBUG_TYPE
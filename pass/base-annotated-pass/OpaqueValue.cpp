@@ -0,0 +1,83 @@
+#include <string>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+// `obf.opaque`, an i64 that the compiler can't know: a module constructor stores a square derived from
+// the frame address at startup. Opaque predicates rely on squares being 0 or 1 mod 4, decoded constants
+// don't depend on the value at all.
+//
+// Module passes define it once per module (`define`), the annotation pass and the policy pass when they attach
+// an annotation that uses it, so that the function passes don't add globals and constructors to the module
+// while they run. Functions load it once in the entry block
+class OpaqueValue {
+private:
+  static constexpr const char *globalName = "obf.opaque";
+
+public:
+  // Annotations of the passes that load the value
+  static bool isUsedBy(StringRef annotation) {
+    return annotation == "bogus-branch" || annotation == "encode";
+  }
+
+  // Defines the value and its constructor, unless the module already has them. It is kept in
+  // `llvm.compiler.used`, the optimizations would otherwise remove it before the passes load it
+  static GlobalVariable *define(Module &M) {
+    if (GlobalVariable *opaque = OpaqueValue::getGlobal(M)) {
+      return opaque;
+    }
+
+    LLVMContext &context = M.getContext();
+    Type *int64Ty = Type::getInt64Ty(context);
+
+    // Holds a square before the constructor runs, too
+    uint64_t initial = xxh3_64bits(M.getSourceFileName());
+    GlobalVariable *opaque = M.getNamedGlobal(OpaqueValue::globalName);
+    if (!opaque) {
+      opaque = new GlobalVariable(M, int64Ty, false, GlobalValue::PrivateLinkage, nullptr, OpaqueValue::globalName);
+    }
+    opaque->setLinkage(GlobalValue::PrivateLinkage);
+    opaque->setInitializer(ConstantInt::get(int64Ty, initial * initial));
+
+    // The frame address differs from run to run with ASLR, and isn't known to the compiler
+    Function *init = Function::Create(
+      FunctionType::get(Type::getVoidTy(context), false), GlobalValue::InternalLinkage,
+      std::string(OpaqueValue::globalName) + ".init", M
+    );
+    IRBuilder<> builder(BasicBlock::Create(context, "entry", init));
+    Value *frame = builder.CreateIntrinsic(
+      Intrinsic::frameaddress, {PointerType::get(context, M.getDataLayout().getAllocaAddrSpace())},
+      {builder.getInt32(0)}
+    );
+    Value *value = builder.CreatePtrToInt(frame, int64Ty);
+    builder.CreateStore(builder.CreateMul(value, value), opaque);
+    builder.CreateRetVoid();
+
+    appendToGlobalCtors(M, init, 0);
+    appendToCompilerUsed(M, {opaque});
+
+    return opaque;
+  }
+
+  // The value defined by `define`, nullptr if the module has none
+  static GlobalVariable *getGlobal(Module &M) {
+    GlobalVariable *opaque = M.getNamedGlobal(OpaqueValue::globalName);
+    return opaque && !opaque->isDeclaration() ? opaque : nullptr;
+  }
+
+  // Loads the value at the beginning of the entry block of `F`, which must be in a module with the value defined
+  static LoadInst *load(Function &F) {
+    GlobalVariable *opaque = OpaqueValue::getGlobal(*F.getParent());
+    assert(opaque && "The opaque value is defined by a module pass");
+
+    BasicBlock &entryBlock = F.getEntryBlock();
+    IRBuilder<> builder(&entryBlock, entryBlock.getFirstInsertionPt());
+    return builder.CreateLoad(opaque->getValueType(), opaque, "opaque");
+  }
+};
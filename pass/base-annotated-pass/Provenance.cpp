@@ -0,0 +1,104 @@
+#include <string>
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+// Tags instructions inserted by an obfuscation pass with the pass and the kind of the transform,
+// so that runtime samples can be attributed to the transforms (tools/obf-attribution.py).
+//
+// Enabled by the `obf.provenance` module flag (`-annotation-provenance`). A tagged instruction gets:
+//   - `!obf.provenance !{!"<pass>", !"<kind>"}` metadata, which is visible in the IR
+//   - a debug location in the file `obf-provenance/<pass>/<kind>`, if the function has debug info.
+//     It keeps the line and the inlining scope of the original code, and ends up in the line table of the binary
+class Provenance {
+private:
+  static constexpr const char *flagName = "obf.provenance";
+  static constexpr const char *metadataName = "obf.provenance";
+  static constexpr const char *directoryPrefix = "obf-provenance/";
+
+  const std::string passName;
+  const bool enabled;
+
+  // Scope of a location without the files of earlier tags, e.g. for code inserted for a tagged instruction
+  static DILocalScope *getOriginalScope(DILocalScope *scope) {
+    while (auto *fileScope = dyn_cast<DILexicalBlockFile>(scope)) {
+      if (!fileScope->getDirectory().starts_with(Provenance::directoryPrefix)) {
+        break;
+      }
+      scope = fileScope->getScope();
+    }
+
+    return scope;
+  }
+
+public:
+  Provenance(const Module &M, StringRef passName) : passName(passName), enabled(Provenance::isEnabled(M)) {}
+
+  static bool isEnabled(const Module &M) {
+    auto *flag = mdconst::extract_or_null<ConstantInt>(M.getModuleFlag(Provenance::flagName));
+    return flag && !flag->isZero();
+  }
+
+  static bool isTagged(const Instruction &inst) {
+    return inst.getMetadata(Provenance::metadataName) != nullptr;
+  }
+
+  // Tags an inserted instruction, `origin` is the location of the code it was inserted for.
+  // Values that are not instructions (folded constants) are ignored
+  void tag(Value *value, StringRef kind, DebugLoc origin = DebugLoc()) const {
+    auto *inst = dyn_cast_or_null<Instruction>(value);
+    if (!this->enabled || !inst) {
+      return;
+    }
+
+    LLVMContext &context = inst->getContext();
+    inst->setMetadata(Provenance::metadataName, MDNode::get(context, {
+      MDString::get(context, this->passName),
+      MDString::get(context, kind),
+    }));
+
+    DISubprogram *subprogram = inst->getFunction()->getSubprogram();
+    if (!subprogram) {
+      return;
+    }
+
+    if (!origin) {
+      origin = inst->getDebugLoc();
+    }
+
+    // The location must belong to the function, e.g. not to the body of a merged function
+    DILocalScope *scope = subprogram;
+    unsigned line = 0;
+    unsigned column = 0;
+    DILocation *inlinedAt = nullptr;
+
+    if (origin && origin->getInlinedAtScope()->getSubprogram() == subprogram) {
+      scope = Provenance::getOriginalScope(origin->getScope());
+      line = origin.getLine();
+      column = origin.getCol();
+      inlinedAt = origin->getInlinedAt();
+    }
+
+    auto *file = DIFile::get(context, kind, Provenance::directoryPrefix + this->passName);
+    auto *fileScope = DILexicalBlockFile::get(context, scope, file, 0);
+    inst->setDebugLoc(DILocation::get(context, line, column, fileScope, inlinedAt));
+  }
+
+  // Tags the instructions in `[begin, end)`, e.g. the ones an IRBuilder inserted before `end`
+  void tag(BasicBlock::iterator begin, BasicBlock::iterator end, StringRef kind, DebugLoc origin = DebugLoc()) const {
+    if (!this->enabled) {
+      return;
+    }
+
+    for (auto it = begin; it != end; it++) {
+      this->tag(&*it, kind, origin);
+    }
+  }
+};
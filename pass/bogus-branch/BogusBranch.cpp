@@ -0,0 +1,283 @@
+#include <vector>
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "BaseAnnotatedPass.cpp"
+#include "OpaqueValue.cpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "bogus-branch"
+
+static cl::opt<double> BogusBranchRatio(
+  "bogus-branch-ratio", cl::init(0.5),
+  cl::desc("Fraction of the eligible blocks that get a bogus branch")
+);
+
+static cl::opt<bool> BogusBranchInnermost(
+  "bogus-branch-innermost", cl::init(false),
+  cl::desc("Also insert bogus branches into innermost loops, where they cost a branch per iteration")
+);
+
+STATISTIC(NumBogusBranches, "Number of inserted bogus branches");
+STATISTIC(NumInstsCloned, "Number of instructions cloned into dead blocks");
+STATISTIC(NumInnermostLoopBlocksSkipped, "Number of blocks in innermost loops left without bogus branches");
+
+namespace {
+  // Bogus Control Flow for code that is not flattened.
+  //
+  // A block is split, and the halves are connected by a branch on an opaque predicate, which is always true.
+  // Its other edge goes to a dead block with a mutated copy of the second half. The predicates are computed
+  // from `obf.opaque`, a square (x mod 4 is 0 or 1) stored by a module constructor at startup, so they are
+  // opaque to the compiler (see `OpaqueValue`). A function loads it once in the entry block, and a predicate
+  // of a block in a loop is computed before the loop, so the added cost is one well-predicted branch.
+  // Blocks of innermost loops are skipped unless `-bogus-branch-innermost` is given
+  class BogusBranchPass : public BaseAnnotatedPass<BogusBranchPass> {
+  private:
+    static constexpr const char *annotationName = "bogus-branch";
+
+    // Dead blocks clone at most this many instructions of the block they replace
+    static constexpr unsigned maxClonedInsts = 8;
+
+    // An always-true condition on the square `x`
+    ICmpInst *insertPredicate(IRBuilder<> &builder, Value *x) const {
+      Type *type = x->getType();
+
+      switch (this->random() % 3) {
+        case 0:
+          // Squares are 0 or 1 mod 4
+          return cast<ICmpInst>(builder.CreateICmpEQ(builder.CreateAnd(x, 2), ConstantInt::get(type, 0)));
+        case 1: {
+          // y * (y + 1) is even
+          Value *y = builder.CreateAdd(x, ConstantInt::get(type, this->random()));
+          Value *product = builder.CreateMul(y, builder.CreateAdd(y, ConstantInt::get(type, 1)));
+          return cast<ICmpInst>(builder.CreateICmpEQ(builder.CreateAnd(product, 1), ConstantInt::get(type, 0)));
+        }
+        default: {
+          // Squares of odd numbers are 1 mod 8
+          Value *y = builder.CreateOr(builder.CreateXor(x, ConstantInt::get(type, this->random())), 1);
+          Value *square = builder.CreateMul(y, y);
+          return cast<ICmpInst>(builder.CreateICmpEQ(builder.CreateAnd(square, 7), ConstantInt::get(type, 1)));
+        }
+      }
+    }
+
+    // Instructions of the dead block may be cloned up to the first one that can't be
+    static bool isClonable(const Instruction &inst) {
+      return !isa<AllocaInst>(inst) && !isa<CallBase>(inst) && !inst.isEHPad() && !inst.getType()->isTokenTy();
+    }
+
+    // Fills `dead` with a copy of the beginning of `body`, with the operations of integer arithmetic swapped.
+    // Returns the number of cloned instructions
+    unsigned cloneMutated(BasicBlock *body, BasicBlock *dead) const {
+      static constexpr Instruction::BinaryOps mutations[] = {
+        Instruction::Add, Instruction::Sub, Instruction::Xor, Instruction::And, Instruction::Or,
+      };
+
+      ValueToValueMapTy VMap;
+      unsigned count = 0;
+
+      for (auto &inst : *body) {
+        if (inst.isTerminator() || !this->isClonable(inst) || count == BogusBranchPass::maxClonedInsts) {
+          break;
+        }
+
+        Instruction *clone = inst.clone();
+        clone->setName(inst.getName());
+        clone->insertInto(dead, dead->end());
+        RemapInstruction(clone, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+
+        auto *binary = dyn_cast<BinaryOperator>(clone);
+        if (binary && llvm::is_contained(mutations, binary->getOpcode())) {
+          auto opcode = mutations[this->random() % std::size(mutations)];
+          auto *mutated = BinaryOperator::Create(opcode, binary->getOperand(0), binary->getOperand(1), "", clone);
+          mutated->takeName(clone);
+          mutated->setDebugLoc(clone->getDebugLoc());
+          clone->eraseFromParent();
+          clone = mutated;
+        }
+
+        VMap[&inst] = clone;
+        count++;
+      }
+
+      return count;
+    }
+
+    // Splits `block` at a random point and connects the halves by an opaque predicate computed at the end of
+    // `predicateBlock`. Returns the number of instructions cloned into the dead block
+    unsigned insertBogusBranch(
+      BasicBlock *block, BasicBlock *predicateBlock, Instruction *opaque, const Provenance &provenance
+    ) const {
+      LLVMContext &context = block->getContext();
+      Function *F = block->getParent();
+
+      // Static allocas must stay in the entry block, and the predicate needs the value of `obf.opaque`.
+      // The block is split before the terminator only if there is nothing else to clone
+      std::vector<Instruction *> splitPoints;
+      for (auto it = block->getFirstInsertionPt(); it != block->end(); it++) {
+        if (isa<AllocaInst>(*it) || &*it == opaque) {
+          splitPoints.clear();
+          continue;
+        }
+        if (!it->isTerminator() || splitPoints.empty()) {
+          splitPoints.push_back(&*it);
+        }
+      }
+
+      Instruction *splitPoint = splitPoints[this->random() % splitPoints.size()];
+      DebugLoc origin = splitPoint->getDebugLoc();
+
+      BasicBlock *body = block->splitBasicBlock(splitPoint, block->getName() + ".body");
+      BasicBlock *dead = BasicBlock::Create(context, block->getName() + ".bogus", F, body);
+
+      Instruction *predicatePoint = predicateBlock->getTerminator();
+      IRBuilder<> builder(predicatePoint);
+      Instruction *previous = predicatePoint->getPrevNode();
+      ICmpInst *predicate = this->insertPredicate(builder, opaque);
+
+      // Either edge may be the real one
+      const bool inverted = this->random() % 2;
+      if (inverted) {
+        predicate->setPredicate(predicate->getInversePredicate());
+      }
+
+      provenance.tag(
+        previous ? std::next(previous->getIterator()) : predicatePoint->getParent()->begin(),
+        predicatePoint->getIterator(), "opaque-predicate", origin
+      );
+
+      MDBuilder mdBuilder(context);
+      block->getTerminator()->eraseFromParent();
+      builder.SetInsertPoint(block);
+      BranchInst *branch = inverted
+        ? builder.CreateCondBr(predicate, dead, body, mdBuilder.createUnlikelyBranchWeights())
+        : builder.CreateCondBr(predicate, body, dead, mdBuilder.createLikelyBranchWeights());
+      branch->setDebugLoc(origin);
+      provenance.tag(branch, "opaque-predicate", origin);
+
+      unsigned cloned = this->cloneMutated(body, dead);
+
+      builder.SetInsertPoint(dead);
+      builder.CreateBr(body)->setDebugLoc(origin);
+      provenance.tag(dead->begin(), dead->end(), "dead-code", origin);
+
+      return cloned;
+    }
+
+    PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const override {
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+      Provenance provenance(*F.getParent(), BogusBranchPass::annotationName);
+
+      // Blocks with the blocks their predicates are computed in, outside of loops
+      std::vector<std::pair<BasicBlock *, BasicBlock *>> targets;
+      unsigned innermostSkipped = 0;
+
+      for (auto &block : F) {
+        if (!DT.isReachableFromEntry(&block) || block.isEHPad() || !this->isAnnotated(block)) {
+          continue;
+        }
+
+        Loop *loop = LI.getLoopFor(&block);
+        if (loop && loop->isInnermost() && !BogusBranchInnermost) {
+          innermostSkipped++;
+          continue;
+        }
+
+        if ((this->random() >> 11) * 0x1.0p-53 >= BogusBranchRatio * this->getIntensity()) {
+          continue;
+        }
+
+        BasicBlock *predicateBlock = &block;
+        while (Loop *outer = LI.getLoopFor(predicateBlock)) {
+          predicateBlock = DT.getNode(outer->getHeader())->getIDom()->getBlock();
+        }
+
+        targets.push_back({&block, predicateBlock});
+      }
+
+      NumInnermostLoopBlocksSkipped += innermostSkipped;
+
+      if (targets.empty()) {
+        return PreservedAnalyses::all();
+      }
+
+      // Defined by the annotation pass or the policy pass, which attach the annotation
+      if (!OpaqueValue::getGlobal(*F.getParent())) {
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "NoOpaqueValue", &F)
+            << "no bogus branches inserted, the module has no opaque value (run the annotation pass first)";
+        });
+        return PreservedAnalyses::all();
+      }
+
+      Instruction *opaque = OpaqueValue::load(F);
+      provenance.tag(opaque, "opaque-predicate");
+
+      unsigned cloned = 0;
+      for (auto &[block, predicateBlock] : targets) {
+        // A split predicate block keeps its top half, whose terminator still dominates the loops
+        cloned += this->insertBogusBranch(block, predicateBlock, opaque, provenance);
+      }
+
+      NumBogusBranches += targets.size();
+      NumInstsCloned += cloned;
+
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Inserted", &F)
+          << "inserted " << ore::NV("Branches", (unsigned)targets.size()) << " bogus branches with "
+          << ore::NV("Cloned", cloned) << " cloned instructions, skipped "
+          << ore::NV("InnermostLoopBlocks", innermostSkipped) << " blocks of innermost loops";
+      });
+
+      return PreservedAnalyses::none();
+    }
+
+  protected:
+    std::string getConfiguration() const override {
+      return formatv("ratio={0} innermost={1}", (double)BogusBranchRatio, (bool)BogusBranchInnermost).str();
+    }
+
+  public:
+    BogusBranchPass() : BaseAnnotatedPass(BogusBranchPass::annotationName) {}
+  };
+} // namespace
+
+PassPluginLibraryInfo getBogusBranchPassPluginInfo() {
+  return {
+    LLVM_PLUGIN_API_VERSION,
+    "BogusBranchPass",
+    LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          FunctionPassManager &FPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "bogus-branch") {
+            FPM.addPass(BogusBranchPass());
+            return true;
+          }
+          return false;
+        }
+      );
+    }
+  };
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getBogusBranchPassPluginInfo();
+}
@@ -1,15 +1,55 @@
 #include <vector>
 #include <map>
 #include <cmath>
-
+#include <limits>
+#include <optional>
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 #include "BaseAnnotatedPass.cpp"
+#include "CaseValueAllocator.cpp"
+#include "DispatcherProfile.cpp"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "bogus-switch"
+
+STATISTIC(NumCasesDuplicated, "Number of duplicated switch cases");
+STATISTIC(NumStoresRemapped, "Number of `caseVar` stores remapped to duplicated cases");
+STATISTIC(NumCasesPartiallyDuplicated, "Number of duplicated switch cases sharing a tail with the original case");
+STATISTIC(NumBytesDuplicated, "Estimated size of duplicated code in bytes");
+STATISTIC(NumCasesOverBudget, "Number of switch cases not duplicated because of the size budget");
+
+static cl::opt<double> BogusSwitchPrefix(
+  "bogus-switch-prefix", cl::init(1.0),
+  cl::desc("Fraction of the instructions of a case block cloned into its duplicate. Below 1, the duplicate is a "
+           "rescheduled prefix that jumps into the rest of the original block, which both cases share")
+);
+
+static cl::opt<unsigned> BogusSwitchBudget(
+  "bogus-switch-budget", cl::init(0),
+  cl::desc("Maximum estimated size of duplicated code per function in bytes (0 means no limit)")
+);
+
+static cl::opt<bool> BogusSwitchProfile(
+  "bogus-switch-profile", cl::init(false),
+  cl::desc("Re-instrument dispatchers with duplicated cases with per-thread counters (link with runtime/obfprof.c)")
+);
+
+static cl::opt<bool> BogusSwitchProfileCycles(
+  "bogus-switch-profile-cycles", cl::init(false),
+  cl::desc("Additionally count cycles spent in the dispatcher (requires -bogus-switch-profile)")
+);
+
 namespace {
   class BogusSwitchPass : public BaseAnnotatedPass<BogusSwitchPass> {
   private:
@@ -26,6 +66,20 @@ namespace {
     // A value close to zero may lead to unreachable duplicated blocks (dead code)
     const double storeInstRemappingPart = 0.5;
 
+    // TargetTransformInfo measures code size in instructions. They are counted as 4 bytes, the size of every
+    // AArch64 instruction and about the average size of x86-64 instructions
+    static constexpr unsigned bytesPerInstruction = 4;
+
+    // Part of a case block to be cloned into a duplicate
+    struct CasePrefix {
+      // Number of instructions, not counting phi nodes and the terminator
+      unsigned length;
+      // Whether the rest of the block is shared instead of being cloned
+      bool partial;
+      // Estimated size of the duplicate in bytes
+      unsigned size;
+    };
+
     // Checks if the switch was annotated by control-flow flattening pass, indicating
     // that it is safe to remap cases to their duplicated versions
     bool checkIfSwitchFlattened(Function &F, SwitchInst *switchInst) const {
@@ -56,8 +110,8 @@ namespace {
     // Changes some part of `store i32 targetCaseValue, ptr %caseVar` instructions
     // to `store i32 duplicateCaseValue, ptr %caseVar` instruction.
     // Here, `caseVar` is a variable used in switch condition. `targetCaseValue` and `duplicateCaseValue` refer to
-    // the original and duplicated switch case blocks respectively
-    void remapCaseVarStoreInstructions(
+    // the original and duplicated switch case blocks respectively. Returns the number of remapped stores
+    unsigned remapCaseVarStoreInstructions(
       Function &F, Value *caseVar, ConstantInt *targetCaseValue, ConstantInt *duplicateCaseValue
     ) const {
       LLVMContext &context = F.getContext();
@@ -79,27 +133,192 @@ namespace {
 
       const int countToRemap = floor(storeInstructions.size() * this->storeInstRemappingPart);
 
-      errs() << ", replacing " << countToRemap << " references";
-
       for (int i = 0; i < countToRemap; i++) {
         auto storeInst = storeInstructions[i];
         storeInst->setOperand(0, duplicateCaseValue);
       }
+
+      return countToRemap;
+    }
+
+    // Estimated size of the instruction in bytes
+    unsigned getSize(const TargetTransformInfo &TTI, const Instruction &instruction) const {
+      InstructionCost cost = TTI.getInstructionCost(&instruction, TargetTransformInfo::TCK_CodeSize);
+      if (!cost.isValid()) {
+        return bytesPerInstruction;
+      }
+
+      return *cost.getValue() * bytesPerInstruction;
+    }
+
+    // Picks the part of `block` to clone into a duplicate. The prefix is shortened until the duplicate
+    // fits into `budget` bytes, nothing is returned if even a single instruction doesn't fit
+    std::optional<CasePrefix> getCasePrefix(
+      const TargetTransformInfo &TTI, BasicBlock *block, unsigned budget
+    ) const {
+      std::vector<Instruction *> body;
+      std::map<Instruction *, unsigned> bodyIdxs;
+      unsigned phiSize = 0;
+
+      for (auto &instruction : *block) {
+        if (isa<PHINode>(instruction)) {
+          phiSize += this->getSize(TTI, instruction);
+        } else if (!instruction.isTerminator()) {
+          bodyIdxs[&instruction] = body.size();
+          body.push_back(&instruction);
+        }
+      }
+
+      std::vector<unsigned> prefixSizes = {phiSize};
+      for (auto *instruction : body) {
+        prefixSizes.push_back(prefixSizes.back() + this->getSize(TTI, *instruction));
+      }
+
+      unsigned fullSize = prefixSizes.back() + this->getSize(TTI, *block->getTerminator());
+
+      unsigned length = body.size();
+      if (BogusSwitchPrefix < 1 && !body.empty()) {
+        length = std::clamp<unsigned>(ceil(body.size() * BogusSwitchPrefix), 1, body.size());
+      }
+
+      // An `invoke` is never cloned: the result is stored to a stack slot on its normal edge, which is shared.
+      // The call stays in the tail
+      bool sharedTerminator = isa<InvokeInst>(block->getTerminator());
+
+      if (length == body.size() && fullSize <= budget && !sharedTerminator) {
+        return CasePrefix{length, false, fullSize};
+      }
+
+      for (length = std::min<unsigned>(length, sharedTerminator ? body.size() : body.size() - 1); length > 0; length--) {
+        // The duplicate ends with a branch to the shared tail, and values of the prefix used in the tail
+        // are merged by phi nodes
+        unsigned sharedValueNum = llvm::count_if(ArrayRef(body).take_front(length), [&](Instruction *instruction) {
+          return llvm::any_of(instruction->users(), [&](User *user) {
+            auto it = bodyIdxs.find(cast<Instruction>(user));
+            return it == bodyIdxs.end() || it->second >= length;
+          });
+        });
+
+        unsigned size = prefixSizes[length] + (1 + sharedValueNum) * bytesPerInstruction;
+        if (size <= budget) {
+          return CasePrefix{length, true, size};
+        }
+      }
+
+      return std::nullopt;
+    }
+
+    // Reorders the instructions of a block randomly. Instructions keep their order relative to their operands,
+    // and instructions that access memory or have other side effects keep their order relative to each other.
+    // Instructions that may trap (e.g. a division by a variable) stay after the side effects before them,
+    // a call that doesn't return would otherwise no longer prevent them
+    void reschedule(BasicBlock *block) const {
+      std::vector<Instruction *> pending;
+      for (auto &instruction : *block) {
+        if (!isa<PHINode>(instruction) && !instruction.isTerminator()) {
+          pending.push_back(&instruction);
+        }
+      }
+
+      Instruction *terminator = block->getTerminator();
+      SmallPtrSet<Instruction *, 32> scheduled;
+
+      while (!pending.empty()) {
+        std::vector<unsigned> ready;
+        bool memoryBlocked = false;
+
+        for (unsigned i = 0; i < pending.size(); i++) {
+          Instruction *instruction = pending[i];
+
+          bool hasSideEffects = instruction->mayReadOrWriteMemory() || instruction->mayHaveSideEffects();
+          if ((hasSideEffects || !isSafeToSpeculativelyExecute(instruction)) && memoryBlocked) {
+            continue;
+          }
+          memoryBlocked |= hasSideEffects;
+
+          bool operandsScheduled = llvm::all_of(instruction->operands(), [&](Value *operand) {
+            auto *operandInst = dyn_cast<Instruction>(operand);
+            return !operandInst || operandInst->getParent() != block || isa<PHINode>(operandInst)
+              || scheduled.contains(operandInst);
+          });
+          if (operandsScheduled) {
+            ready.push_back(i);
+          }
+        }
+
+        // The first pending instruction is always ready
+        unsigned pick = ready[this->random() % ready.size()];
+        pending[pick]->moveBefore(terminator);
+        scheduled.insert(pending[pick]);
+        pending.erase(pending.begin() + pick);
+      }
     }
 
-    // Generates a unique case value for a switch, plausible if possible
-    ConstantInt *generateCaseValue(LLVMContext &context, SwitchInst *switchInst) const {
-      ConstantInt *caseValue = ConstantInt::get(Type::getInt32Ty(context), switchInst->getNumCases());
+    // Clones `block` into a new block. For a partial prefix, only the prefix is cloned and rescheduled.
+    // The rest of the block is split into a tail, which the original block and the duplicate both branch to
+    BasicBlock *duplicateBlock(
+      Function &F, BasicBlock *block, const CasePrefix &prefix, const Provenance &provenance
+    ) const {
+      BasicBlock *tail = nullptr;
+      if (prefix.partial) {
+        auto splitPoint = block->getFirstNonPHIIt();
+        std::advance(splitPoint, prefix.length);
+        tail = block->splitBasicBlock(splitPoint, block->getName() + ".tail");
+      }
 
-      // Check if there exists a case with plausible value (total number of cases)
-      if (switchInst->findCaseValue(caseValue) != switchInst->case_default()) {
-        // Randomize until a unique value is found
-        while (switchInst->findCaseValue(caseValue) != switchInst->case_default()) {
-          caseValue = ConstantInt::get(Type::getInt32Ty(context), rand());
+      ValueToValueMapTy VMap;
+      BasicBlock *duplicateBlock = CloneBasicBlock(block, VMap, ".duplicate", &F);
+
+      for (Instruction &instruction : *duplicateBlock) {
+        RemapInstruction(&instruction, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+
+        // Instructions inserted by other passes keep their tags
+        if (!Provenance::isTagged(instruction)) {
+          provenance.tag(&instruction, "duplicate");
         }
       }
 
-      return caseValue;
+      if (tail == nullptr) {
+        return duplicateBlock;
+      }
+
+      // Values of the prefix used after it come from either the original or the duplicated prefix
+      for (auto &instruction : *block) {
+        if (instruction.isTerminator()) {
+          continue;
+        }
+
+        std::vector<Use *> outsideUses;
+        for (auto &use : instruction.uses()) {
+          if (cast<Instruction>(use.getUser())->getParent() != block) {
+            outsideUses.push_back(&use);
+          }
+        }
+
+        if (outsideUses.empty()) {
+          continue;
+        }
+
+        PHINode *phiNode = PHINode::Create(instruction.getType(), 2, instruction.getName() + ".shared", tail->begin());
+        phiNode->addIncoming(&instruction, block);
+        phiNode->addIncoming(VMap[&instruction], duplicateBlock);
+        provenance.tag(phiNode, "shared-tail", instruction.getDebugLoc());
+
+        for (auto *use : outsideUses) {
+          use->set(phiNode);
+        }
+      }
+
+      this->reschedule(duplicateBlock);
+
+      return duplicateBlock;
+    }
+
+    std::string getConfiguration() const override {
+      return formatv(
+        "{0} {1} {2} {3} prefix={4} budget={5}", this->switchCaseTargetPart, this->storeInstRemappingPart,
+        (bool)BogusSwitchProfile, (bool)BogusSwitchProfileCycles, (double)BogusSwitchPrefix, (unsigned)BogusSwitchBudget
+      ).str();
     }
 
     // Returns switch case variable (condition) for the specific block
@@ -113,9 +332,30 @@ namespace {
       return nullptr;
     }
 
-    PreservedAnalyses applyPass(Function &F) const override {
+    PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const override {
       LLVMContext &context = F.getContext();
 
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+      Provenance provenance(*F.getParent(), BogusSwitchPass::annotationName);
+
+      unsigned duplicatedNum = 0;
+      unsigned partialNum = 0;
+      unsigned overBudgetNum = 0;
+      unsigned remappedNum = 0;
+
+      // Bytes left for duplicated code in the whole function
+      unsigned budget = BogusSwitchBudget ? (unsigned)BogusSwitchBudget : std::numeric_limits<unsigned>::max();
+      unsigned duplicatedBytes = 0;
+
+      // Counters inserted by FlattenPass would be cloned into duplicated cases and attributed to the original ones.
+      // They are removed and the dispatcher is instrumented again once all cases are added
+      DispatcherProfiler profiler(BogusSwitchProfileCycles);
+      std::vector<SwitchInst *> flattenedSwitches;
+      if (BogusSwitchProfile) {
+        profiler.strip(F);
+      }
+
       for (auto &block : F) {
         auto switchInst = dyn_cast<SwitchInst>(block.getTerminator());
         if (!switchInst) {
@@ -127,12 +367,28 @@ namespace {
           continue;
         }
 
+        // A flattened region gets its own dispatcher, which carries the annotations of the region
+        if (!this->isAnnotated(*switchInst)) {
+          continue;
+        }
+
+        flattenedSwitches.push_back(switchInst);
+
         Value *caseVar = this->getSwitchCaseVar(block, switchInst);
         if (caseVar == nullptr) {
-          errs() << "[" << BogusSwitchPass::annotationName << "] Warning: unable to identify switch variable\n";
+          ORE.emit([&]() {
+            return OptimizationRemarkMissed(DEBUG_TYPE, "CaseVarNotFound", switchInst)
+              << "unable to identify switch variable, duplicated cases stay unreachable";
+          });
         }
 
-        unsigned targetCount = ceil(switchInst->getNumCases() * this->switchCaseTargetPart);
+        unsigned targetCount = ceil(switchInst->getNumCases() * this->switchCaseTargetPart * this->getIntensity());
+
+        // Duplicates take free values of the dense range of the dispatcher, so it stays a jump table
+        CaseValueAllocator allocator(switchInst->getNumCases() + targetCount, this->random());
+        for (auto &switchCase : switchInst->cases()) {
+          allocator.reserve(switchCase.getCaseValue()->getZExtValue());
+        }
 
         for (
           auto switchCase = switchInst->case_begin();
@@ -142,29 +398,62 @@ namespace {
           ConstantInt *targetCaseValue = switchCase->getCaseValue();
           BasicBlock *targetBlock = switchCase->getCaseSuccessor();
 
-          ValueToValueMapTy VMap;
-          BasicBlock *duplicateBlock = CloneBasicBlock(targetBlock, VMap, ".duplicate", &F);
-
-          for (Instruction &instruction : *duplicateBlock) {
-            RemapInstruction(&instruction, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+          auto prefix = this->getCasePrefix(TTI, targetBlock, budget - duplicatedBytes);
+          if (!prefix) {
+            LLVM_DEBUG(dbgs() << "[" << BogusSwitchPass::annotationName << "] Case #"
+                              << targetCaseValue->getValue() << " doesn't fit into the size budget\n");
+            overBudgetNum++;
+            continue;
           }
 
+          BasicBlock *duplicateBlock = this->duplicateBlock(F, targetBlock, *prefix, provenance);
+          duplicatedBytes += prefix->size;
+          partialNum += prefix->partial;
+
           // Add duplicated block as a switch case
-          ConstantInt *duplicateCaseValue = this->generateCaseValue(context, switchInst);
+          ConstantInt *duplicateCaseValue = ConstantInt::get(Type::getInt32Ty(context), allocator.allocate());
           switchInst->addCase(duplicateCaseValue, duplicateBlock);
 
-          errs() << "[" << BogusSwitchPass::annotationName << "] Generated duplicate case #"
-                 << duplicateCaseValue->getValue() << " for case #" << targetCaseValue->getValue();
+          LLVM_DEBUG(dbgs() << "[" << BogusSwitchPass::annotationName << "] Generated duplicate case #"
+                            << duplicateCaseValue->getValue() << " for case #" << targetCaseValue->getValue() << "\n");
+
+          duplicatedNum++;
 
           // Make duplicated block reachable
           if (caseVar != nullptr) {
-            this->remapCaseVarStoreInstructions(F, caseVar, targetCaseValue, duplicateCaseValue);
+            remappedNum += this->remapCaseVarStoreInstructions(F, caseVar, targetCaseValue, duplicateCaseValue);
           }
+        }
+      }
 
-          errs() << "\n";
+      if (BogusSwitchProfile) {
+        for (auto *switchInst : flattenedSwitches) {
+          profiler.instrument(F, switchInst);
         }
       }
 
+      NumCasesDuplicated += duplicatedNum;
+      NumCasesPartiallyDuplicated += partialNum;
+      NumCasesOverBudget += overBudgetNum;
+      NumBytesDuplicated += duplicatedBytes;
+      NumStoresRemapped += remappedNum;
+
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "DuplicatedCases", &F)
+          << "duplicated " << ore::NV("Cases", duplicatedNum) << " switch cases ("
+          << ore::NV("PartialCases", partialNum) << " with a shared tail, about "
+          << ore::NV("Bytes", duplicatedBytes) << " bytes), remapped "
+          << ore::NV("Stores", remappedNum) << " case variable stores";
+      });
+
+      if (overBudgetNum > 0) {
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "BudgetExhausted", &F)
+            << ore::NV("Cases", overBudgetNum) << " switch cases not duplicated, the size budget of "
+            << ore::NV("Budget", (unsigned)BogusSwitchBudget) << " bytes is exhausted";
+        });
+      }
+
       return PreservedAnalyses::none();
     }
 
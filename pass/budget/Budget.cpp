@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CompileBudget.cpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "budget"
+
+STATISTIC(NumFunctionsPlanned, "Number of annotated functions planned within the compile-time budget");
+STATISTIC(NumFunctionsReduced, "Number of functions obfuscated with a reduced intensity");
+STATISTIC(NumFunctionsDropped, "Number of functions left as is to stay within the compile-time budget");
+
+static cl::opt<unsigned> BudgetMs(
+  "budget-ms", cl::init(0),
+  cl::desc("Compile-time budget of the obfuscation passes that follow the budget pass, in milliseconds (0 is unlimited)")
+);
+
+static cl::opt<std::string> BudgetReport(
+  "budget-report", cl::init(""),
+  cl::desc("Write the plan and what the passes actually did to every function to a JSON file, "
+           "by the budget-report pass that follows them")
+);
+
+namespace {
+  // Compile time of a pass per annotated instruction and per function (analyses, remarks), in microseconds,
+  // measured with a release build on x86-64. The passes measure their actual time, and stop when the budget runs out,
+  // so the estimate only has to be close
+  struct PassCost {
+    const char *annotation;
+    double perInstruction;
+    double perFunction;
+  };
+
+  static constexpr PassCost passCosts[] = {
+    {"flatten", 0.6, 20},
+    {"bogus-switch", 2.5, 50},
+    {"bogus-branch", 0.8, 30},
+    {"encode", 1.2, 20},
+    {"virtualize", 4.0, 40},
+    {"mba", 2.2, 30},
+  };
+
+  // Intensities the plan chooses from. Flattening, and the bogus cases of its dispatcher, are dropped
+  // below `CompileBudget::flattenIntensity`
+  static constexpr double intensityLevels[] = {1, 0.75, 0.5, 0.25, 0.1, 0};
+
+  // The plan is kept in the module for the report pass that runs after the function passes,
+  // `!obf.budget.plan !{!{ptr @f, !"<annotation>", i64 <instructions>, ...}, ...}` in priority order
+  static constexpr const char *planName = "obf.budget.plan";
+
+  struct FunctionPlan {
+    Function *F;
+    std::vector<std::string> annotations;
+    // Annotated instructions for every entry of `passCosts`, 0 if the pass doesn't apply
+    std::vector<unsigned> instructions;
+    double intensity = 1;
+
+    double estimate(unsigned passIdx, double intensity) const {
+      auto &cost = passCosts[passIdx];
+      unsigned instructionNum = this->instructions[passIdx];
+      if (instructionNum == 0 || intensity <= 0) {
+        return 0;
+      }
+
+      StringRef annotation = cost.annotation;
+      bool flattening = annotation == "flatten" || annotation == "bogus-switch";
+      if (flattening && intensity < CompileBudget::flattenIntensity) {
+        return 0;
+      }
+
+      // Flattening and virtualization restructure the whole function regardless of the intensity
+      double density = annotation == "flatten" || annotation == "virtualize" ? 1 : intensity;
+      return cost.perFunction + instructionNum * cost.perInstruction * density;
+    }
+
+    double estimate(double intensity) const {
+      double total = 0;
+      for (unsigned i = 0; i < std::size(passCosts); i++) {
+        total += this->estimate(i, intensity);
+      }
+      return total;
+    }
+
+    // What the intensity takes away, for remarks and the report
+    std::string describeReduction() const {
+      if (this->intensity <= 0) {
+        return "not obfuscated";
+      }
+
+      std::string reduction = formatv("density {0:F2}", this->intensity).str();
+      if (this->intensity < CompileBudget::flattenIntensity) {
+        for (auto &annotation : this->annotations) {
+          if (annotation == "flatten" || annotation == "bogus-switch") {
+            reduction += ", no " + annotation;
+          }
+        }
+      }
+      return reduction;
+    }
+  };
+
+  // Plans the intensity of every annotated function, so that the obfuscation passes that follow
+  // stay within a compile-time budget (`-budget-ms`).
+  //
+  // The cost of every function is estimated from its annotated instructions. All functions get the highest intensity
+  // at which the whole module fits into the budget, then the rest of the budget raises the intensity of functions
+  // in priority order: functions with more obfuscations requested first, smaller ones first among them.
+  // Annotated functions are also moved into that order, the passes measure the time they spend
+  // and leave the remaining functions as is once the budget runs out. The order only holds if the passes share
+  // one function adaptor (`module(budget),function(flatten,mba),module(budget-report)`): with an adaptor per pass,
+  // an early pass could spend the budget on all functions before a later pass reaches the first one
+  class BudgetPass : public PassInfoMixin<BudgetPass> {
+  private:
+    static std::set<std::string> getInstructionAnnotations(const Instruction &inst) {
+      std::set<std::string> annotations;
+
+      auto *md = inst.getMetadata(LLVMContext::MD_annotation);
+      if (!md) {
+        return annotations;
+      }
+
+      for (auto &mdOperand : md->operands()) {
+        if (auto *mdString = dyn_cast<MDString>(mdOperand)) {
+          annotations.insert(mdString->getString().str());
+        } else if (auto *mdNode = dyn_cast<MDNode>(mdOperand)) {
+          for (auto &nested : mdNode->operands()) {
+            if (auto *nestedString = dyn_cast<MDString>(nested)) {
+              annotations.insert(nestedString->getString().str());
+            }
+          }
+        }
+      }
+
+      return annotations;
+    }
+
+    // Obfuscations requested for `F`, with annotated instructions counted per pass: all of them for an annotated
+    // function, the tagged ones for regions
+    static FunctionPlan analyze(Function &F) {
+      FunctionPlan plan = {&F, {}, std::vector<unsigned>(std::size(passCosts), 0)};
+
+      std::set<std::string> functionAnnotations;
+      if (auto *md = F.getMetadata("annotation")) {
+        for (auto &mdOperand : md->operands()) {
+          auto *mdNode = dyn_cast<MDNode>(mdOperand);
+          if (mdNode && mdNode->getNumOperands() > 0) {
+            if (auto *mdString = dyn_cast<MDString>(mdNode->getOperand(0))) {
+              functionAnnotations.insert(mdString->getString().str());
+            }
+          }
+        }
+      }
+
+      std::set<std::string> annotations;
+      for (auto &inst : instructions(F)) {
+        std::set<std::string> instAnnotations = BudgetPass::getInstructionAnnotations(inst);
+
+        for (unsigned i = 0; i < std::size(passCosts); i++) {
+          std::string annotation = passCosts[i].annotation;
+          if (functionAnnotations.count(annotation) || instAnnotations.count(annotation)) {
+            plan.instructions[i]++;
+            annotations.insert(annotation);
+          }
+        }
+      }
+
+      plan.annotations.assign(annotations.begin(), annotations.end());
+      return plan;
+    }
+
+    static void choose(std::vector<FunctionPlan> &plans, double budget) {
+      // The highest intensity for all functions
+      double uniform = 0;
+      for (double level : intensityLevels) {
+        double total = 0;
+        for (auto &plan : plans) {
+          total += plan.estimate(level);
+        }
+
+        if (total <= budget) {
+          uniform = level;
+          break;
+        }
+      }
+
+      double remaining = budget;
+      for (auto &plan : plans) {
+        plan.intensity = uniform;
+        remaining -= plan.estimate(uniform);
+      }
+
+      // Raised in priority order with what is left
+      for (auto &plan : plans) {
+        for (double level : intensityLevels) {
+          if (level <= plan.intensity) {
+            break;
+          }
+
+          double extra = plan.estimate(level) - plan.estimate(plan.intensity);
+          if (extra <= remaining) {
+            remaining -= extra;
+            plan.intensity = level;
+            break;
+          }
+        }
+      }
+    }
+
+    // Moves the planned functions into priority order, within the positions they take in the module
+    static void reorder(Module &M, const std::vector<FunctionPlan> &plans) {
+      std::set<Function *> planned;
+      for (auto &plan : plans) {
+        planned.insert(plan.F);
+      }
+
+      // Every planned function is inserted back before the next function that stays in place
+      std::vector<Function *> anchors;
+      Function *anchor = nullptr;
+      for (auto it = M.rbegin(); it != M.rend(); it++) {
+        if (planned.count(&*it)) {
+          anchors.push_back(anchor);
+        } else {
+          anchor = &*it;
+        }
+      }
+      std::reverse(anchors.begin(), anchors.end());
+
+      for (auto &plan : plans) {
+        plan.F->removeFromParent();
+      }
+
+      for (unsigned i = 0; i < plans.size(); i++) {
+        M.getFunctionList().insert(anchors[i] ? anchors[i]->getIterator() : M.end(), plans[i].F);
+      }
+    }
+
+    static void storePlans(Module &M, const std::vector<FunctionPlan> &plans) {
+      LLVMContext &context = M.getContext();
+
+      if (auto *md = M.getNamedMetadata(planName)) {
+        M.eraseNamedMetadata(md);
+      }
+      NamedMDNode *md = M.getOrInsertNamedMetadata(planName);
+
+      for (auto &plan : plans) {
+        std::vector<Metadata *> operands = {ConstantAsMetadata::get(plan.F)};
+        for (unsigned passIdx = 0; passIdx < std::size(passCosts); passIdx++) {
+          if (plan.instructions[passIdx] > 0) {
+            operands.push_back(MDString::get(context, passCosts[passIdx].annotation));
+            operands.push_back(ConstantAsMetadata::get(
+              ConstantInt::get(Type::getInt64Ty(context), plan.instructions[passIdx])
+            ));
+          }
+        }
+        md->addOperand(MDNode::get(context, operands));
+      }
+    }
+
+  public:
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) const {
+      if (BudgetMs == 0) {
+        return PreservedAnalyses::all();
+      }
+
+      const double budget = BudgetMs * 1000.0;
+      CompileBudget::start(M, BudgetMs * 1000ll);
+
+      std::vector<FunctionPlan> plans;
+      for (auto &F : M) {
+        if (F.isDeclaration()) {
+          continue;
+        }
+
+        FunctionPlan plan = BudgetPass::analyze(F);
+        if (!plan.annotations.empty()) {
+          plans.push_back(std::move(plan));
+        }
+      }
+
+      std::stable_sort(plans.begin(), plans.end(), [](const FunctionPlan &a, const FunctionPlan &b) {
+        if (a.annotations.size() != b.annotations.size()) {
+          return a.annotations.size() > b.annotations.size();
+        }
+        return a.estimate(1) < b.estimate(1);
+      });
+
+      BudgetPass::choose(plans, budget);
+
+      for (auto &plan : plans) {
+        NumFunctionsPlanned++;
+
+        if (plan.intensity < 1) {
+          CompileBudget::setIntensity(*plan.F, plan.intensity);
+          NumFunctionsReduced += plan.intensity > 0;
+          NumFunctionsDropped += plan.intensity <= 0;
+
+          OptimizationRemarkEmitter ORE(plan.F);
+          ORE.emit([&]() {
+            return OptimizationRemarkAnalysis(DEBUG_TYPE, "Reduced", plan.F)
+              << "intensity " << ore::NV("Intensity", formatv("{0:F2}", plan.intensity).str())
+              << " within the compile-time budget: " << plan.describeReduction() << ", estimated "
+              << ore::NV("EstimatedMs", formatv("{0:F2}", plan.estimate(plan.intensity) / 1000).str()) << " of "
+              << ore::NV("EstimatedFullMs", formatv("{0:F2}", plan.estimate(1) / 1000).str()) << " ms";
+          });
+        }
+
+        LLVM_DEBUG(dbgs() << "[budget] " << plan.F->getName() << ": intensity " << plan.intensity
+                          << ", estimated " << plan.estimate(plan.intensity) << " of " << plan.estimate(1) << " us\n");
+      }
+
+      BudgetPass::reorder(M, plans);
+      BudgetPass::storePlans(M, plans);
+
+      return PreservedAnalyses::none();
+    }
+  };
+
+  // Writes the report of `-budget-report` after the function passes: the plan of the budget pass,
+  // and what every pass actually did to every planned function. Functions the passes reach after the budget
+  // ran out are reported as `exhausted`, whatever intensity was planned for them
+  class BudgetReportPass : public PassInfoMixin<BudgetReportPass> {
+  private:
+    static std::vector<FunctionPlan> loadPlans(const Module &M) {
+      std::vector<FunctionPlan> plans;
+
+      auto *md = M.getNamedMetadata(planName);
+      if (!md) {
+        return plans;
+      }
+
+      for (auto *entry : md->operands()) {
+        // Functions erased by a pass leave null operands
+        auto *F = mdconst::dyn_extract_or_null<Function>(entry->getOperand(0));
+        if (!F) {
+          continue;
+        }
+
+        FunctionPlan plan = {F, {}, std::vector<unsigned>(std::size(passCosts), 0)};
+        for (unsigned i = 1; i + 1 < entry->getNumOperands(); i += 2) {
+          StringRef annotation = cast<MDString>(entry->getOperand(i))->getString();
+          unsigned instructionNum = mdconst::extract<ConstantInt>(entry->getOperand(i + 1))->getZExtValue();
+
+          for (unsigned passIdx = 0; passIdx < std::size(passCosts); passIdx++) {
+            if (annotation == passCosts[passIdx].annotation) {
+              plan.instructions[passIdx] = instructionNum;
+            }
+          }
+          plan.annotations.push_back(annotation.str());
+        }
+
+        plan.intensity = CompileBudget::getIntensity(*F);
+        plans.push_back(std::move(plan));
+      }
+
+      return plans;
+    }
+
+    static void writeReport(const Module &M, const std::vector<FunctionPlan> &plans, double budget) {
+      std::error_code error;
+      raw_fd_ostream os(BudgetReport, error);
+      if (error) {
+        errs() << "[budget] Cannot write " << BudgetReport << ": " << error.message() << "\n";
+        return;
+      }
+
+      double fullEstimate = 0;
+      double plannedEstimate = 0;
+      for (auto &plan : plans) {
+        fullEstimate += plan.estimate(1);
+        plannedEstimate += plan.estimate(plan.intensity);
+      }
+
+      auto outcomes = CompileBudget::getOutcomes(M);
+
+      json::OStream json(os, 2);
+      json.object([&] {
+        json.attribute("budget_ms", budget / 1000);
+        json.attribute("estimated_full_ms", fullEstimate / 1000);
+        json.attribute("estimated_ms", plannedEstimate / 1000);
+        json.attribute("spent_ms", CompileBudget::getSpent(M) / 1000.0);
+        json.attributeObject("spent_ms_by_pass", [&] {
+          for (auto &cost : passCosts) {
+            json.attribute(cost.annotation, CompileBudget::getSpent(M, cost.annotation) / 1000.0);
+          }
+        });
+        json.attributeArray("functions", [&] {
+          for (unsigned i = 0; i < plans.size(); i++) {
+            auto &plan = plans[i];
+            json.object([&] {
+              json.attribute("function", plan.F->getName());
+              json.attribute("priority", i + 1);
+              json.attributeArray("annotations", [&] {
+                for (auto &annotation : plan.annotations) {
+                  json.value(annotation);
+                }
+              });
+              json.attributeObject("instructions", [&] {
+                for (unsigned passIdx = 0; passIdx < std::size(passCosts); passIdx++) {
+                  if (plan.instructions[passIdx] > 0) {
+                    json.attribute(passCosts[passIdx].annotation, plan.instructions[passIdx]);
+                  }
+                }
+              });
+              json.attribute("estimated_full_ms", plan.estimate(1) / 1000);
+              json.attribute("estimated_ms", plan.estimate(plan.intensity) / 1000);
+              json.attribute("intensity", plan.intensity);
+              json.attribute("reduction", plan.intensity < 1 ? plan.describeReduction() : "none");
+              // What the passes did, `not run` for annotations of passes missing from the pipeline
+              json.attributeObject("passes", [&] {
+                auto &functionOutcomes = outcomes[plan.F];
+                for (auto &annotation : plan.annotations) {
+                  auto it = llvm::find_if(functionOutcomes, [&](const CompileBudget::Outcome &outcome) {
+                    return outcome.pass == annotation;
+                  });
+
+                  json.attributeObject(annotation, [&] {
+                    if (it == functionOutcomes.end()) {
+                      json.attribute("outcome", "not run");
+                      return;
+                    }
+                    json.attribute("outcome", it->outcome);
+                    json.attribute("intensity", it->intensity);
+                    json.attribute("spent_ms", it->spent / 1000.0);
+                  });
+                }
+              });
+            });
+          }
+        });
+      });
+      os << "\n";
+    }
+
+  public:
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) const {
+      if (!CompileBudget::isEnabled(M) || BudgetReport.empty()) {
+        return PreservedAnalyses::all();
+      }
+
+      BudgetReportPass::writeReport(M, BudgetReportPass::loadPlans(M), CompileBudget::getBudget(M));
+      return PreservedAnalyses::all();
+    }
+  };
+} // namespace
+
+PassPluginLibraryInfo getBudgetPassPluginInfo() {
+  return {
+    LLVM_PLUGIN_API_VERSION,
+    "BudgetPass",
+    LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          ModulePassManager &MPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "budget") {
+            MPM.addPass(BudgetPass());
+            return true;
+          }
+          if (Name == "budget-report") {
+            MPM.addPass(BudgetReportPass());
+            return true;
+          }
+          return false;
+        }
+      );
+    }
+  };
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getBudgetPassPluginInfo();
+}
@@ -0,0 +1,209 @@
+#include <set>
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSummaryIndex.h"
+#include "llvm/Support/Error.h"
+
+using namespace llvm;
+
+// Materializes only the function bodies that the obfuscation passes work on, for modules read lazily from bitcode.
+//
+// `llvm.global.annotations` is a global variable, so it is available before any function is materialized.
+// Annotated functions are materialized, and, for `function-merge`, also the functions referencing the merged ones,
+// because their calls are redirected to the merged function. The same goes for the functions using variables
+// annotated with `encrypt`, whose uses are redirected to the decrypted copy, and for the functions with region
+// markers, whose calls are removed. A module with markers counts as annotated. Those are found in the module summary
+// (ThinLTO bitcode), without the summary every function is materialized as soon as they are needed.
+// The rest of the bodies are left to the bitcode writer.
+//
+// Bodies that are not materialized look like empty definitions to the passes, so only pipelines of the obfuscation
+// passes that skip them are run this way (`supportsPipeline`). Optimizations, and the policy pass that weighs
+// every function, need the whole module
+class LazyMaterializer {
+private:
+  static constexpr const char *functionMergeAnnotation = "function-merge";
+
+  // Declared by runtime/obf.h, the annotation pass tags the code between their calls and removes them
+  static constexpr const char *regionMarkerNames[] = {"__obf_region_begin", "__obf_region_end"};
+
+  // Passes that only look at annotated functions and at the functions materialized for them
+  static constexpr const char *lazyPasses[] = {
+    "module", "function",
+    "annotation", "encrypt", "function-merge", "virtualize", "flatten", "bogus-switch", "bogus-branch", "encode",
+    "mba", "mba-helpers", "budget", "budget-report",
+  };
+
+  // Annotated functions and global variables with their annotations, the way the annotation pass reads them
+  static MapVector<GlobalObject *, SmallVector<StringRef>> getAnnotatedObjects(Module &M) {
+    MapVector<GlobalObject *, SmallVector<StringRef>> annotatedObjects;
+
+    auto *annotations = M.getNamedGlobal("llvm.global.annotations");
+    if (!annotations || !annotations->hasInitializer()) {
+      return annotatedObjects;
+    }
+
+    auto *initializer = dyn_cast<ConstantArray>(annotations->getInitializer());
+    if (!initializer) {
+      return annotatedObjects;
+    }
+
+    for (auto &operand : initializer->operands()) {
+      auto *annotation = dyn_cast<ConstantStruct>(operand);
+      if (!annotation || annotation->getNumOperands() < 2) {
+        continue;
+      }
+
+      auto *object = dyn_cast<GlobalObject>(annotation->getOperand(0)->stripPointerCasts());
+      auto *string = dyn_cast<GlobalVariable>(annotation->getOperand(1)->stripPointerCasts());
+      if (!object || !string || !string->hasInitializer()) {
+        continue;
+      }
+
+      if (auto *data = dyn_cast<ConstantDataArray>(string->getInitializer())) {
+        annotatedObjects[object].push_back(data->getAsString().rtrim('\0'));
+      }
+    }
+
+    return annotatedObjects;
+  }
+
+  // Functions that call or take the address of one of `targets`, according to the module summary
+  static Expected<std::vector<Function *>> getReferencingFunctions(
+    Module &M, MemoryBufferRef buffer, const std::set<GlobalValue::GUID> &targets
+  ) {
+    Expected<std::unique_ptr<ModuleSummaryIndex>> index = getModuleSummaryIndex(buffer);
+    if (!index) {
+      return index.takeError();
+    }
+
+    std::vector<Function *> referencingFunctions;
+
+    for (Function &F : M) {
+      if (!F.isMaterializable()) {
+        continue;
+      }
+
+      ValueInfo info = (*index)->getValueInfo(F.getGUID());
+      if (!info) {
+        // Not summarized, can't tell
+        referencingFunctions.push_back(&F);
+        continue;
+      }
+
+      bool references = false;
+
+      for (auto &summary : info.getSummaryList()) {
+        auto *functionSummary = dyn_cast<FunctionSummary>(summary->getBaseObject());
+        if (!functionSummary) {
+          continue;
+        }
+
+        for (auto &[callee, _] : functionSummary->calls()) {
+          references |= targets.count(callee.getGUID()) > 0;
+        }
+        for (auto &ref : functionSummary->refs()) {
+          references |= targets.count(ref.getGUID()) > 0;
+        }
+      }
+
+      if (references) {
+        referencingFunctions.push_back(&F);
+      }
+    }
+
+    return referencingFunctions;
+  }
+
+public:
+  // Checks if every pass of a textual pipeline is one of `lazyPasses`
+  static bool supportsPipeline(StringRef pipeline) {
+    SmallVector<StringRef, 16> names;
+    pipeline.split(names, ',');
+
+    for (StringRef name : names) {
+      // `function(flatten` and `mba))` are the adaptor and the pass, parameters (`<...>`) are not allowed
+      SmallVector<StringRef, 4> parts;
+      name.split(parts, '(');
+      for (StringRef part : parts) {
+        part = part.rtrim(')').trim();
+        if (!part.empty() && !llvm::is_contained(lazyPasses, part)) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  // Materializes the functions the passes need. Returns false if nothing is annotated,
+  // so the passes have nothing to do and the module can be passed through as is
+  static Expected<bool> materialize(Module &M, MemoryBufferRef buffer) {
+    auto annotatedObjects = getAnnotatedObjects(M);
+
+    // Merged functions, encrypted variables, and region markers (runtime/obf.h),
+    // the functions referencing them are rewritten
+    std::set<GlobalValue::GUID> rewrittenTargets;
+
+    for (const char *markerName : regionMarkerNames) {
+      if (Function *marker = M.getFunction(markerName)) {
+        rewrittenTargets.insert(marker->getGUID());
+      }
+    }
+
+    if (annotatedObjects.empty() && rewrittenTargets.empty()) {
+      return false;
+    }
+
+    for (auto &[object, annotations] : annotatedObjects) {
+      auto *F = dyn_cast<Function>(object);
+      if (!F) {
+        rewrittenTargets.insert(object->getGUID());
+        continue;
+      }
+
+      if (Error error = F->materialize()) {
+        return std::move(error);
+      }
+
+      if (llvm::is_contained(annotations, functionMergeAnnotation)) {
+        rewrittenTargets.insert(F->getGUID());
+      }
+    }
+
+    if (rewrittenTargets.empty()) {
+      return true;
+    }
+
+    Expected<BitcodeLTOInfo> ltoInfo = getBitcodeLTOInfo(buffer);
+    if (!ltoInfo) {
+      return ltoInfo.takeError();
+    }
+
+    if (!ltoInfo->HasSummary) {
+      if (Error error = M.materializeAll()) {
+        return std::move(error);
+      }
+      return true;
+    }
+
+    Expected<std::vector<Function *>> referencingFunctions = getReferencingFunctions(M, buffer, rewrittenTargets);
+    if (!referencingFunctions) {
+      return referencingFunctions.takeError();
+    }
+
+    for (Function *F : *referencingFunctions) {
+      if (Error error = F->materialize()) {
+        return std::move(error);
+      }
+    }
+
+    return true;
+  }
+};
@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include "ServiceProtocol.cpp"
+
+// Thin client of obf-service that stands in for the `opt` step of a build:
+//
+//   obf-client [-socket=<path>] [-passes=<pipeline>] [-S] [-lazy] -o <output> <input>
+//
+// The socket defaults to $OBF_SERVICE_SOCKET, then to /tmp/obf-service.sock. Without `-passes`,
+// the service runs its default pipeline. With `-lazy`, the service materializes only the annotated functions
+// of bitcode input (and the callers of merged functions) and passes modules without annotations through,
+// unless the pipeline has passes that need every function, e.g. optimizations or `policy`.
+// Doesn't link LLVM, so that starting it costs next to nothing
+
+static int usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [-socket=<path>] [-passes=<pipeline>] [-S] [-lazy] -o <output> <input>\n";
+  return 1;
+}
+
+static bool startsWith(const std::string &s, const std::string &prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+int main(int argc, char **argv) {
+  const char *socketEnv = getenv("OBF_SERVICE_SOCKET");
+  std::string socketPath = socketEnv ? socketEnv : "/tmp/obf-service.sock";
+  std::string passes;
+  std::string inputPath;
+  std::string outputPath;
+  uint32_t flags = 0;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (startsWith(arg, "-socket=")) {
+      socketPath = arg.substr(strlen("-socket="));
+    } else if (startsWith(arg, "-passes=")) {
+      passes = arg.substr(strlen("-passes="));
+    } else if (arg == "-S") {
+      flags |= emitTextFlag;
+    } else if (arg == "-lazy") {
+      flags |= lazyLoadFlag;
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (startsWith(arg, "-o") && arg.size() > 2) {
+      outputPath = arg.substr(2);
+    } else if (!startsWith(arg, "-") && inputPath.empty()) {
+      inputPath = arg;
+    } else {
+      return usage(argv[0]);
+    }
+  }
+
+  if (inputPath.empty() || outputPath.empty()) {
+    return usage(argv[0]);
+  }
+
+  std::ifstream input(inputPath, std::ios::binary);
+  if (!input) {
+    std::cerr << "obf-client: cannot read " << inputPath << "\n";
+    return 1;
+  }
+  std::string module((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+  sockaddr_un address;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || !makeSocketAddress(socketPath, address)
+      || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+    std::cerr << "obf-client: cannot connect to " << socketPath << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  RequestHeader request;
+  memcpy(request.magic, requestMagic, sizeof(request.magic));
+  request.flags = flags;
+  request.nameSize = inputPath.size();
+  request.pipelineSize = passes.size();
+  request.moduleSize = module.size();
+
+  if (!writeAll(fd, &request, sizeof(request))
+      || !writeAll(fd, inputPath.data(), inputPath.size())
+      || !writeAll(fd, passes.data(), passes.size())
+      || !writeAll(fd, module.data(), module.size())) {
+    std::cerr << "obf-client: failed to send request\n";
+    return 1;
+  }
+
+  ResponseHeader response;
+  std::string payload;
+  if (!readAll(fd, &response, sizeof(response))
+      || memcmp(response.magic, responseMagic, sizeof(response.magic)) != 0
+      || response.payloadSize > maxPayloadSize
+      || !readString(fd, payload, response.payloadSize)) {
+    std::cerr << "obf-client: malformed response\n";
+    return 1;
+  }
+  close(fd);
+
+  if (response.status != statusOk) {
+    std::cerr << "obf-client: " << inputPath << ": " << payload << "\n";
+    return 1;
+  }
+
+  // Written next to the output and renamed, so that an interrupted build never sees a partial module
+  std::string temporaryPath = outputPath + ".tmp";
+  std::ofstream output(temporaryPath, std::ios::binary);
+  output.write(payload.data(), payload.size());
+  output.close();
+
+  if (!output || rename(temporaryPath.c_str(), outputPath.c_str()) != 0) {
+    std::cerr << "obf-client: cannot write " << outputPath << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include <map>
+#include <memory>
+#include <string>
+
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include "LazyMaterializer.cpp"
+
+using namespace llvm;
+
+// Defined by the pass sources, which are linked into the driver executables instead of being loaded as plugins
+PassPluginLibraryInfo getAnnotationPassPluginInfo();
+PassPluginLibraryInfo getFlattenPassPluginInfo();
+PassPluginLibraryInfo getBogusSwitchPassPluginInfo();
+PassPluginLibraryInfo getBogusBranchPassPluginInfo();
+PassPluginLibraryInfo getFunctionMergePassPluginInfo();
+PassPluginLibraryInfo getEncryptPassPluginInfo();
+PassPluginLibraryInfo getEncodePassPluginInfo();
+PassPluginLibraryInfo getVirtualizePassPluginInfo();
+PassPluginLibraryInfo getMBAPassPluginInfo();
+PassPluginLibraryInfo getPolicyPassPluginInfo();
+PassPluginLibraryInfo getBudgetPassPluginInfo();
+
+// The obfuscation passes of docker/run.sh that follow the annotation pass and the optimizations,
+// for modules that are already annotated
+static constexpr const char *defaultTransformPipeline =
+  "module(encrypt),module(function-merge),function(virtualize),function(flatten),function(bogus-switch),function(bogus-branch),function(encode),module(mba-helpers),function(mba)";
+
+// The obfuscation passes of docker/run.sh, for optimized modules. It has no optimizations of its own,
+// so it works with lazily loaded modules too
+static const std::string defaultObfuscationPipeline = std::string("module(annotation),") + defaultTransformPipeline;
+
+// Runs obfuscation pipelines on serialized modules, the way `opt` does with the pass plugins loaded.
+//
+// Every module gets its own LLVMContext, so instances may run on different threads concurrently.
+// An instance itself is not thread-safe: it caches target machines, which are expensive to create
+class ObfPipeline {
+private:
+  std::map<std::string, std::unique_ptr<TargetMachine>> targetMachines;
+
+  // Target machine for target-aware analyses (TTI), or nullptr if the target is not compiled in
+  TargetMachine *getTargetMachine(const std::string &triple) {
+    if (triple.empty()) {
+      return nullptr;
+    }
+
+    auto it = this->targetMachines.find(triple);
+    if (it != this->targetMachines.end()) {
+      return it->second.get();
+    }
+
+    std::string error;
+    const Target *target = TargetRegistry::lookupTarget(triple, error);
+    TargetMachine *targetMachine = target
+      ? target->createTargetMachine(triple, "", "", TargetOptions(), std::nullopt)
+      : nullptr;
+
+    this->targetMachines[triple].reset(targetMachine);
+    return targetMachine;
+  }
+
+  static void registerObfuscationPasses(PassBuilder &PB) {
+    for (auto getPluginInfo : {
+      getAnnotationPassPluginInfo,
+      getFlattenPassPluginInfo,
+      getBogusSwitchPassPluginInfo,
+      getBogusBranchPassPluginInfo,
+      getFunctionMergePassPluginInfo,
+      getEncryptPassPluginInfo,
+      getEncodePassPluginInfo,
+      getVirtualizePassPluginInfo,
+      getMBAPassPluginInfo,
+      getPolicyPassPluginInfo,
+      getBudgetPassPluginInfo,
+    }) {
+      getPluginInfo().RegisterPassBuilderCallbacks(PB);
+    }
+  }
+
+public:
+  // Runs `pipeline` (the default obfuscation pipeline if empty) on `M` and verifies the result.
+  // The bodies left out by lazy loading are materialized afterwards, the passes didn't need them but the output does
+  Error run(Module &M, StringRef pipeline) {
+    TargetMachine *targetMachine = this->getTargetMachine(M.getTargetTriple());
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(targetMachine);
+    this->registerObfuscationPasses(PB);
+
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (Error error = PB.parsePassPipeline(MPM, pipeline.empty() ? StringRef(defaultObfuscationPipeline) : pipeline)) {
+      return error;
+    }
+
+    try {
+      MPM.run(M, MAM);
+    } catch (const std::exception &e) {
+      return createStringError(inconvertibleErrorCode(), e.what());
+    }
+
+    if (Error error = M.materializeAll()) {
+      return error;
+    }
+
+    std::string verifierMessage;
+    raw_string_ostream verifierOs(verifierMessage);
+    if (verifyModule(M, &verifierOs)) {
+      return createStringError(inconvertibleErrorCode(), "obfuscated module is broken: " + verifierOs.str());
+    }
+
+    return Error::success();
+  }
+
+  // `M` as bitcode, or as textual IR if `emitText` is set
+  static std::string write(const Module &M, bool emitText) {
+    std::string output;
+    raw_string_ostream os(output);
+    if (emitText) {
+      M.print(os, nullptr);
+    } else {
+      WriteBitcodeToFile(M, os);
+    }
+
+    return std::move(os.str());
+  }
+
+  // Parses a module (bitcode or textual IR), runs `pipeline` on it, and returns the result
+  // as bitcode, or as textual IR if `emitText` is set.
+  //
+  // With `lazyLoad`, bitcode is read lazily and only the functions the passes work on are materialized
+  // before the pipeline runs (see `LazyMaterializer`). A module without annotations is returned as is.
+  // Pipelines with passes that need every body, e.g. optimizations or `policy`, read the whole module anyway
+  Expected<std::string> run(StringRef input, StringRef name, StringRef pipeline, bool emitText, bool lazyLoad) {
+    LLVMContext context;
+    SMDiagnostic diagnostic;
+    MemoryBufferRef buffer(input, name);
+
+    if (pipeline.empty()) {
+      pipeline = defaultObfuscationPipeline;
+    }
+
+    std::unique_ptr<Module> M;
+    if (lazyLoad && identify_magic(input) == file_magic::bitcode && LazyMaterializer::supportsPipeline(pipeline)) {
+      Expected<std::unique_ptr<Module>> lazyModule = getLazyBitcodeModule(buffer, context);
+      if (!lazyModule) {
+        return lazyModule.takeError();
+      }
+      M = std::move(*lazyModule);
+
+      Expected<bool> annotated = LazyMaterializer::materialize(*M, buffer);
+      if (!annotated) {
+        return annotated.takeError();
+      }
+      if (!*annotated && !emitText) {
+        return input.str();
+      }
+    } else {
+      M = parseIR(buffer, diagnostic, context);
+    }
+
+    if (!M) {
+      std::string message;
+      raw_string_ostream os(message);
+      diagnostic.print(nullptr, os, false);
+      return createStringError(inconvertibleErrorCode(), os.str());
+    }
+
+    if (Error error = this->run(*M, pipeline)) {
+      return std::move(error);
+    }
+
+    return ObfPipeline::write(*M, emitText);
+  }
+};
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/WithColor.h"
+
+#include "ObfPipeline.cpp"
+#include "ServiceProtocol.cpp"
+
+using namespace llvm;
+
+// Long-running obfuscation service: keeps the passes and their target machines resident and obfuscates
+// modules sent over a Unix socket (see obf-client), so that build farms don't pay the `opt` startup for every file.
+//
+// Pass options (e.g. `-flatten-profile`, `-annotation-seed`) are given to the service on startup
+// and apply to all requests
+
+static cl::opt<std::string> SocketPath(
+  "socket", cl::init("/tmp/obf-service.sock"),
+  cl::desc("Path of the Unix socket to listen on")
+);
+
+static cl::opt<std::string> DefaultPipeline(
+  "passes", cl::init(defaultObfuscationPipeline),
+  cl::desc("Pipeline for requests that don't specify one")
+);
+
+static cl::opt<unsigned> Jobs(
+  "j", cl::init(0),
+  cl::desc("Number of requests processed concurrently (0 = number of hardware threads)")
+);
+
+// Accepted connections waiting for a worker
+class ConnectionQueue {
+private:
+  std::mutex mutex;
+  std::condition_variable available;
+  std::deque<int> connections;
+
+public:
+  void push(int fd) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->connections.push_back(fd);
+    }
+    this->available.notify_one();
+  }
+
+  int pop() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->available.wait(lock, [this] { return !this->connections.empty(); });
+
+    int fd = this->connections.front();
+    this->connections.pop_front();
+    return fd;
+  }
+};
+
+static void respond(int fd, uint32_t status, const std::string &payload) {
+  ResponseHeader header;
+  memcpy(header.magic, responseMagic, sizeof(header.magic));
+  header.status = status;
+  header.payloadSize = payload.size();
+
+  if (!writeAll(fd, &header, sizeof(header)) || !writeAll(fd, payload.data(), payload.size())) {
+    WithColor::warning() << "failed to send response: client disconnected\n";
+  }
+}
+
+static void handleConnection(int fd, ObfPipeline &pipeline) {
+  RequestHeader header;
+  if (!readAll(fd, &header, sizeof(header)) || memcmp(header.magic, requestMagic, sizeof(header.magic)) != 0) {
+    respond(fd, statusError, "malformed request");
+    return;
+  }
+
+  if (header.moduleSize > maxPayloadSize || header.pipelineSize > maxPayloadSize || header.nameSize > maxPayloadSize) {
+    respond(fd, statusError, "request too large");
+    return;
+  }
+
+  std::string name;
+  std::string passes;
+  std::string module;
+  if (
+    !readString(fd, name, header.nameSize)
+    || !readString(fd, passes, header.pipelineSize)
+    || !readString(fd, module, header.moduleSize)
+  ) {
+    respond(fd, statusError, "truncated request");
+    return;
+  }
+
+  Expected<std::string> result = pipeline.run(
+    module, name, passes.empty() ? StringRef(DefaultPipeline) : StringRef(passes),
+    header.flags & emitTextFlag, header.flags & lazyLoadFlag
+  );
+
+  if (!result) {
+    respond(fd, statusError, toString(result.takeError()));
+    return;
+  }
+
+  respond(fd, statusOk, *result);
+}
+
+static void worker(ConnectionQueue &queue) {
+  ObfPipeline pipeline;
+
+  while (true) {
+    int fd = queue.pop();
+    handleConnection(fd, pipeline);
+    close(fd);
+  }
+}
+
+static void removeSocket(int) {
+  unlink(SocketPath.c_str());
+  _exit(0);
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+
+  cl::ParseCommandLineOptions(argc, argv, "obfuscation service\n");
+
+  sockaddr_un address;
+  if (!makeSocketAddress(SocketPath, address)) {
+    WithColor::error() << "socket path too long: " << SocketPath << "\n";
+    return 1;
+  }
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(SocketPath.c_str());
+
+  // Clients of the build user only. The socket is created without access for others, instead of being
+  // open to them until the chmod. The service has no threads yet, so the process umask is safe to change
+  mode_t previousMask = umask(S_IRWXG | S_IRWXO);
+  bool bound = listenFd >= 0 && bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+  int bindError = errno;
+  umask(previousMask);
+
+  if (!bound || listen(listenFd, SOMAXCONN) != 0) {
+    WithColor::error() << "cannot listen on " << SocketPath << ": " << strerror(bound ? errno : bindError) << "\n";
+    return 1;
+  }
+
+  if (chmod(SocketPath.c_str(), S_IRUSR | S_IWUSR) != 0) {
+    WithColor::error() << "cannot restrict access to " << SocketPath << ": " << strerror(errno) << "\n";
+    unlink(SocketPath.c_str());
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, removeSocket);
+  signal(SIGTERM, removeSocket);
+
+  unsigned jobs = Jobs ? Jobs.getValue() : std::max(std::thread::hardware_concurrency(), 1u);
+
+  ConnectionQueue queue;
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < jobs; i++) {
+    workers.emplace_back(worker, std::ref(queue));
+  }
+
+  errs() << "obf-service: listening on " << SocketPath << " with " << jobs << " workers\n";
+
+  while (true) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        WithColor::warning() << "accept failed: " << strerror(errno) << "\n";
+      }
+      continue;
+    }
+
+    queue.push(fd);
+  }
+}
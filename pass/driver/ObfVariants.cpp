@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/WithColor.h"
+
+#include "ObfPipeline.cpp"
+
+using namespace llvm;
+
+// Diversified builds: obfuscates one module into several variants that differ only in the seed.
+//
+// The input is parsed and prepared (annotated and optimized) once. The prepared module is kept as bitcode
+// and every variant reads it into its own LLVMContext, which is what makes the variants independent:
+// modules of one context can't be transformed concurrently. Reading bitcode costs a fraction of parsing
+// and optimizing the input, so the wall time is one preparation plus the obfuscation of the variants,
+// which run on a pool of threads. Variant `i` gets the seed `-seed` + `i` and is written to `<output>.<i>.bc`
+// (`.ll` with `-S`)
+
+static cl::opt<std::string> InputPath(
+  cl::Positional, cl::Required,
+  cl::desc("<input bitcode or textual IR>")
+);
+
+static cl::opt<std::string> OutputPrefix(
+  "o", cl::Required,
+  cl::desc("Prefix of the output paths, followed by the variant number")
+);
+
+static cl::opt<unsigned> VariantNum(
+  "n", cl::init(2),
+  cl::desc("Number of variants")
+);
+
+static cl::opt<uint64_t> FirstSeed(
+  "seed", cl::init(0),
+  cl::desc("Seed of the first variant, the next ones count up from it")
+);
+
+static cl::opt<std::string> PreparePipeline(
+  "prepare", cl::init("module(annotation),default<O3>"),
+  cl::desc("Pipeline that runs once before the module is copied for the variants (none if empty)")
+);
+
+// The prepared module is already annotated, annotating every variant again would only cost time
+static cl::opt<std::string> VariantPipeline(
+  "passes", cl::init(defaultTransformPipeline),
+  cl::desc("Pipeline that runs on every variant")
+);
+
+static cl::opt<bool> EmitText(
+  "S", cl::init(false),
+  cl::desc("Write textual IR instead of bitcode")
+);
+
+static cl::opt<unsigned> Jobs(
+  "j", cl::init(0),
+  cl::desc("Number of variants obfuscated concurrently (0 = number of hardware threads)")
+);
+
+static double getSecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Parses the input and runs the preparation pipeline, returns the prepared module as bitcode
+static Expected<std::string> prepare(MemoryBufferRef input) {
+  LLVMContext context;
+  SMDiagnostic diagnostic;
+
+  std::unique_ptr<Module> M = parseIR(input, diagnostic, context);
+  if (!M) {
+    std::string message;
+    raw_string_ostream os(message);
+    diagnostic.print(nullptr, os, false);
+    return createStringError(inconvertibleErrorCode(), os.str());
+  }
+
+  if (!PreparePipeline.empty()) {
+    ObfPipeline pipeline;
+    if (Error error = pipeline.run(*M, PreparePipeline)) {
+      return std::move(error);
+    }
+  }
+
+  return ObfPipeline::write(*M, false);
+}
+
+// Obfuscates variant `variantIdx` of the prepared module and writes it
+static Error buildVariant(ObfPipeline &pipeline, StringRef prepared, unsigned variantIdx) {
+  LLVMContext context;
+  Expected<std::unique_ptr<Module>> M = parseBitcodeFile(MemoryBufferRef(prepared, InputPath), context);
+  if (!M) {
+    return M.takeError();
+  }
+
+  // The annotation pass keeps the seed of a module that has one, see `-annotation-seed`
+  (*M)->setModuleFlag(
+    Module::Override, "obf.seed", ConstantInt::get(Type::getInt64Ty(context), FirstSeed + variantIdx)
+  );
+
+  if (Error error = pipeline.run(**M, VariantPipeline)) {
+    return error;
+  }
+
+  std::string output = ObfPipeline::write(**M, EmitText);
+  std::string outputPath = OutputPrefix + "." + std::to_string(variantIdx) + (EmitText ? ".ll" : ".bc");
+
+  // Written next to the output and renamed, so that an interrupted build never sees a partial module
+  std::string temporaryPath = outputPath + ".tmp";
+  std::ofstream file(temporaryPath, std::ios::binary);
+  file.write(output.data(), output.size());
+  file.close();
+
+  if (!file || rename(temporaryPath.c_str(), outputPath.c_str()) != 0) {
+    return createStringError(inconvertibleErrorCode(), "cannot write " + outputPath);
+  }
+
+  return Error::success();
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+
+  cl::ParseCommandLineOptions(argc, argv, "diversified obfuscation variants\n");
+
+  // A single explicit seed would override the seeds of the variants and make them identical
+  auto &options = cl::getRegisteredOptions();
+  auto seedOption = options.find("annotation-seed");
+  if (seedOption != options.end() && seedOption->second->getNumOccurrences() > 0) {
+    WithColor::error() << "-annotation-seed applies to every variant, use -seed instead\n";
+    return 1;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> input = MemoryBuffer::getFileOrSTDIN(InputPath);
+  if (!input) {
+    WithColor::error() << "cannot read " << InputPath << ": " << input.getError().message() << "\n";
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  Expected<std::string> prepared = prepare((*input)->getMemBufferRef());
+  if (!prepared) {
+    WithColor::error() << InputPath << ": " << toString(prepared.takeError()) << "\n";
+    return 1;
+  }
+
+  double prepareSeconds = getSecondsSince(start);
+
+  unsigned jobs = Jobs ? Jobs.getValue() : std::max(std::thread::hardware_concurrency(), 1u);
+  jobs = std::max(std::min(jobs, VariantNum.getValue()), 1u);
+
+  std::atomic<unsigned> nextVariantIdx = 0;
+  std::atomic<bool> failed = false;
+  std::mutex errorMutex;
+
+  // Every worker keeps its own pipeline, which caches the target machines
+  auto worker = [&]() {
+    ObfPipeline pipeline;
+
+    for (unsigned variantIdx = nextVariantIdx++; variantIdx < VariantNum; variantIdx = nextVariantIdx++) {
+      if (Error error = buildVariant(pipeline, *prepared, variantIdx)) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        WithColor::error() << InputPath << ": variant " << variantIdx << ": " << toString(std::move(error)) << "\n";
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < jobs; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  errs() << formatv(
+    "obf-variants: prepared in {0:f2}s, {1} variants in {2:f2}s with {3} workers\n",
+    prepareSeconds, VariantNum.getValue(), getSecondsSince(start) - prepareSeconds, jobs
+  );
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Wire format of obf-service, one request per connection, integers in host byte order (the socket is local):
+//
+//   request:  "OBFQ" u32 flags, u32 name length, u32 pipeline length, u64 module length,
+//             name, pipeline, module (bitcode or textual IR)
+//   response: "OBFR" u32 status, u64 payload length, payload (the obfuscated module, or an error message)
+//
+// The name is the input file name, which becomes the module identifier of textual IR, as with `opt`.
+// An empty pipeline selects the default pipeline of the service
+
+static constexpr char requestMagic[4] = {'O', 'B', 'F', 'Q'};
+static constexpr char responseMagic[4] = {'O', 'B', 'F', 'R'};
+
+// Request flags
+static constexpr uint32_t emitTextFlag = 1;
+static constexpr uint32_t lazyLoadFlag = 2;
+
+// Response status
+static constexpr uint32_t statusOk = 0;
+static constexpr uint32_t statusError = 1;
+
+// Upper bound of a module accepted by the service, guards against allocating for garbage headers
+static constexpr uint64_t maxPayloadSize = 1ull << 32;
+
+struct RequestHeader {
+  char magic[4];
+  uint32_t flags;
+  uint32_t nameSize;
+  uint32_t pipelineSize;
+  uint64_t moduleSize;
+};
+
+struct ResponseHeader {
+  char magic[4];
+  uint32_t status;
+  uint64_t payloadSize;
+};
+
+static bool readAll(int fd, void *data, size_t size) {
+  char *p = static_cast<char *>(data);
+
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+
+    p += n;
+    size -= n;
+  }
+
+  return true;
+}
+
+static bool writeAll(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+
+    p += n;
+    size -= n;
+  }
+
+  return true;
+}
+
+static bool readString(int fd, std::string &s, uint64_t size) {
+  s.resize(size);
+  return readAll(fd, s.data(), size);
+}
+
+static bool makeSocketAddress(const std::string &path, sockaddr_un &address) {
+  if (path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
@@ -0,0 +1,292 @@
+#include <map>
+#include <vector>
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+#include "BaseAnnotatedPass.cpp"
+#include "DispatcherProfile.cpp"
+#include "OpaqueValue.cpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "encode"
+
+STATISTIC(NumConstantsEncoded, "Number of constant operands replaced with decoded values");
+STATISTIC(NumDecodings, "Number of inserted decoding expressions");
+STATISTIC(NumDecodingsHoisted, "Number of decoding expressions placed in front of loops");
+
+namespace {
+  struct EncodedOperand {
+    Instruction *user;
+    unsigned operandIdx;
+  };
+
+  // Encoding of integer constants.
+  //
+  // Constant operands of annotated instructions are replaced with MBA expressions over `obf.opaque`
+  // (see `OpaqueValue`), which evaluate to the constant whatever the opaque value is, e.g. `c` becomes
+  // `(r | a) + (r & a) - r + (c - a)` for a random `a`. The compiler can't fold them, so the constants
+  // don't appear in the binary. A function loads the opaque value once in the entry block, and the constants
+  // used in a loop are decoded in front of it, once per entry into the loop, so the iterations only pay
+  // for the registers that hold the decoded values
+  class EncodePass : public BaseAnnotatedPass<EncodePass> {
+  private:
+    static constexpr const char *annotationName = "encode";
+
+    // Constants this small are everywhere (loop steps, null checks) and give nothing away
+    bool isEncodable(Value *value) const {
+      auto *constant = dyn_cast<ConstantInt>(value);
+      if (!constant) {
+        return false;
+      }
+
+      unsigned bitWidth = constant->getBitWidth();
+      return bitWidth >= 8 && bitWidth <= 64
+        && !constant->isZero() && !constant->isOne() && !constant->isMinusOne();
+    }
+
+    // Constant operands of `inst` that may be replaced with values computed at run time
+    std::vector<unsigned> getEncodableOperands(Instruction &inst) const {
+      std::vector<unsigned> operandIdxs;
+
+      // Case values, static allocation sizes, and immediate arguments of intrinsics and inline assembly
+      // must stay constants, and nothing can be inserted in front of an exception handling pad
+      if (isa<SwitchInst>(inst) || isa<AllocaInst>(inst) || inst.isEHPad()) {
+        return operandIdxs;
+      }
+
+      if (auto *call = dyn_cast<CallBase>(&inst)) {
+        Function *callee = call->getCalledFunction();
+        if (call->isInlineAsm() || (callee && callee->isIntrinsic())) {
+          return operandIdxs;
+        }
+      }
+
+      // Struct field indices select the types of the results
+      if (auto *gep = dyn_cast<GetElementPtrInst>(&inst)) {
+        unsigned operandIdx = 1;
+        for (auto it = gep_type_begin(gep); it != gep_type_end(gep); it++, operandIdx++) {
+          if (!it.isStruct() && this->isEncodable(gep->getOperand(operandIdx))) {
+            operandIdxs.push_back(operandIdx);
+          }
+        }
+        return operandIdxs;
+      }
+
+      // Constant divisors, shift amounts, and multipliers are strength-reduced by the backend into shifts, adds,
+      // and multiplications by a magic number. Computed at run time, they would cost a division or a variable
+      // shift or multiplication on every iteration even after the decoding is hoisted out of the loop
+      if (inst.getOpcode() == Instruction::Mul) {
+        return operandIdxs;
+      }
+      const bool keepsSecond = inst.isShift() || inst.isIntDivRem();
+
+      for (unsigned operandIdx = 0; operandIdx < inst.getNumOperands(); operandIdx++) {
+        if (keepsSecond && operandIdx == 1) {
+          continue;
+        }
+
+        if (this->isEncodable(inst.getOperand(operandIdx))) {
+          operandIdxs.push_back(operandIdx);
+        }
+      }
+
+      return operandIdxs;
+    }
+
+    // The block in front of the outermost loop around `block`, or nullptr if `block` is not in a loop
+    BasicBlock *getLoopFront(BasicBlock *block, DominatorTree &DT, LoopInfo &LI) const {
+      if (!LI.getLoopFor(block)) {
+        return nullptr;
+      }
+
+      // The immediate dominator of a header may be in a loop before it
+      BasicBlock *front = block;
+      while (Loop *loop = LI.getLoopFor(front)) {
+        while (loop->getParentLoop()) {
+          loop = loop->getParentLoop();
+        }
+        front = DT.getNode(loop->getHeader())->getIDom()->getBlock();
+      }
+
+      return front;
+    }
+
+    // Inserts an expression over the opaque value `r` that evaluates to `constant`
+    Value *insertDecoding(IRBuilder<> &builder, Value *opaque, ConstantInt *constant) const {
+      IntegerType *type = constant->getType();
+      Value *r = type == opaque->getType() ? opaque : builder.CreateTrunc(opaque, type);
+
+      const APInt &c = constant->getValue();
+      APInt a = APInt(64, this->random()).zextOrTrunc(type->getBitWidth());
+
+      switch (this->random() % 4) {
+        case 0: {
+          // r + a == (r ^ a) + 2 * (r & a)
+          Value *sum = builder.CreateAdd(
+            builder.CreateXor(r, ConstantInt::get(type, a)),
+            builder.CreateShl(builder.CreateAnd(r, ConstantInt::get(type, a)), 1)
+          );
+          return builder.CreateAdd(builder.CreateSub(sum, r), ConstantInt::get(type, c - a));
+        }
+        case 1: {
+          // r + a == (r | a) + (r & a)
+          Value *sum = builder.CreateAdd(
+            builder.CreateOr(r, ConstantInt::get(type, a)),
+            builder.CreateAnd(r, ConstantInt::get(type, a))
+          );
+          return builder.CreateAdd(builder.CreateSub(sum, r), ConstantInt::get(type, c - a));
+        }
+        case 2: {
+          // a == (r | a) - (r & ~a)
+          Value *difference = builder.CreateSub(
+            builder.CreateOr(r, ConstantInt::get(type, a)),
+            builder.CreateAnd(r, ConstantInt::get(type, ~a))
+          );
+          return builder.CreateAdd(difference, ConstantInt::get(type, c - a));
+        }
+        default:
+          // c == (r ^ a) ^ (r ^ (a ^ c))
+          return builder.CreateXor(
+            builder.CreateXor(r, ConstantInt::get(type, a)),
+            builder.CreateXor(r, ConstantInt::get(type, a ^ c))
+          );
+      }
+    }
+
+    PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const override {
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+      Provenance provenance(*F.getParent(), EncodePass::annotationName);
+
+      std::vector<EncodedOperand> operands;
+
+      for (auto &block : F) {
+        if (!DT.isReachableFromEntry(&block)) {
+          continue;
+        }
+
+        for (auto &inst : block) {
+          // Profiling counters must stay cheap and exact
+          if (!this->isAnnotated(inst) || DispatcherProfiler::isInstrumentation(inst)) {
+            continue;
+          }
+
+          for (unsigned operandIdx : this->getEncodableOperands(inst)) {
+            // Fewer constants within a compile-time budget, see `getIntensity`
+            if (this->getIntensity() < 1 && (this->random() >> 11) * 0x1.0p-53 >= this->getIntensity()) {
+              continue;
+            }
+            operands.push_back({&inst, operandIdx});
+          }
+        }
+      }
+
+      if (operands.empty()) {
+        return PreservedAnalyses::all();
+      }
+
+      // Defined by the annotation pass or the policy pass, which attach the annotation
+      if (!OpaqueValue::getGlobal(*F.getParent())) {
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "NoOpaqueValue", &F)
+            << "constants are not encoded, the module has no opaque value (run the annotation pass first)";
+        });
+        return PreservedAnalyses::all();
+      }
+
+      Instruction *opaque = OpaqueValue::load(F);
+      provenance.tag(opaque, "opaque-value");
+
+      // Decoded values by constant and insertion point, shared by the uses of a constant in a loop
+      std::map<std::pair<Constant *, Instruction *>, Value *> decoded;
+      unsigned encodedNum = 0;
+      unsigned hoistedNum = 0;
+
+      for (auto &[user, operandIdx] : operands) {
+        auto *constant = cast<ConstantInt>(user->getOperand(operandIdx));
+
+        // A value of a phi node is needed at the end of the incoming block
+        auto *phiNode = dyn_cast<PHINode>(user);
+        BasicBlock *block = phiNode ? phiNode->getIncomingBlock(operandIdx) : user->getParent();
+        Instruction *point = phiNode ? block->getTerminator() : user;
+
+        BasicBlock *front = this->getLoopFront(block, DT, LI);
+        bool hoisted = front && !front->getTerminator()->isEHPad();
+        if (hoisted) {
+          point = front->getTerminator();
+        } else if (point->isEHPad()) {
+          continue;
+        }
+
+        Value *&value = decoded[{constant, point}];
+        if (!value) {
+          IRBuilder<> builder(point);
+          Instruction *previous = point->getPrevNode();
+
+          value = this->insertDecoding(builder, opaque, constant);
+          provenance.tag(
+            previous ? std::next(previous->getIterator()) : point->getParent()->begin(), point->getIterator(),
+            "decoding", user->getDebugLoc()
+          );
+
+          NumDecodings++;
+          hoistedNum += hoisted;
+        }
+
+        user->setOperand(operandIdx, value);
+        encodedNum++;
+      }
+
+      NumConstantsEncoded += encodedNum;
+      NumDecodingsHoisted += hoistedNum;
+
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Encoded", &F)
+          << "encoded " << ore::NV("Constants", encodedNum) << " constant operands with "
+          << ore::NV("Decodings", (unsigned)decoded.size()) << " decoding expressions, "
+          << ore::NV("Hoisted", hoistedNum) << " of them in front of loops";
+      });
+
+      return PreservedAnalyses::none();
+    }
+
+  public:
+    EncodePass() : BaseAnnotatedPass(EncodePass::annotationName) {}
+  };
+} // namespace
+
+PassPluginLibraryInfo getEncodePassPluginInfo() {
+  return {
+    LLVM_PLUGIN_API_VERSION,
+    "EncodePass",
+    LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          FunctionPassManager &FPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "encode") {
+            FPM.addPass(EncodePass());
+            return true;
+          }
+          return false;
+        }
+      );
+    }
+  };
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getEncodePassPluginInfo();
+}
@@ -0,0 +1,492 @@
+#include <optional>
+#include <vector>
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ReplaceConstant.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/SwapByteOrder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "BaseAnnotatedPass.cpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "encrypt"
+
+STATISTIC(NumGlobalsEncrypted, "Number of encrypted global variables");
+STATISTIC(NumGlobalsSkipped, "Number of annotated global variables left unencrypted");
+STATISTIC(NumBytesEncrypted, "Number of encrypted bytes");
+STATISTIC(NumCacheChecks, "Number of inserted checks of decrypted copies");
+
+namespace {
+  // Encrypts the initializers of annotated global variables (strings and other constant data).
+  //
+  // The ciphertext replaces the variable, and a decrypted copy is created on the first use at run time, so nothing
+  // is decrypted at startup. Every function using the variable loads the pointer to the copy from a cache slot
+  // once (`load acquire`, a plain load on x86-64), and calls the decryption only while the slot is empty.
+  // Threads that miss the cache concurrently decrypt into their own buffers and race to publish them with
+  // `cmpxchg`; the losers free their buffers and take the published one. No thread ever waits for another.
+  // The copies are allocated with `malloc` and live until the program exits
+  class EncryptPass : public PassInfoMixin<EncryptPass> {
+  private:
+    static constexpr const char *annotationName = "encrypt";
+    static constexpr const char *decryptFuncName = "obf.decrypt";
+
+    // Alignment of `malloc` on the supported targets, variables with a larger alignment are not encrypted
+    static constexpr uint64_t maxAlignment = 16;
+
+    bool hasAnnotation(GlobalVariable &G) const {
+      auto *md = G.getMetadata("annotation");
+      if (!md) {
+        return false;
+      }
+
+      for (auto &mdOperand : md->operands()) {
+        auto *mdNode = dyn_cast<MDNode>(mdOperand);
+        if (!mdNode) {
+          continue;
+        }
+
+        auto *mdString = dyn_cast<MDString>(mdNode->getOperand(0));
+        if (mdString && mdString->getString() == this->annotationName) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    // Removes the annotations of the variables, `llvm.global.annotations` would keep the plaintext alive
+    void removeAnnotations(Module &M, const SmallPtrSetImpl<GlobalVariable *> &globals) const {
+      GlobalVariable *annotations = M.getNamedGlobal("llvm.global.annotations");
+      if (!annotations) {
+        return;
+      }
+
+      auto *initializer = dyn_cast<ConstantArray>(annotations->getInitializer());
+      if (!initializer) {
+        return;
+      }
+
+      std::vector<Constant *> annotationsToSave;
+
+      for (unsigned i = 0; i < initializer->getNumOperands(); ++i) {
+        auto *operand = dyn_cast<ConstantStruct>(initializer->getOperand(i));
+        auto *value = operand ? dyn_cast<GlobalVariable>(operand->getOperand(0)->stripPointerCasts()) : nullptr;
+        if (!value || !globals.contains(value)) {
+          annotationsToSave.push_back(initializer->getOperand(i));
+        }
+      }
+
+      ArrayType *annotationType = ArrayType::get(
+        initializer->getType()->getArrayElementType(),
+        annotationsToSave.size()
+      );
+
+      GlobalVariable *newAnnotations = new GlobalVariable(
+        M, annotationType, annotations->isConstant(), annotations->getLinkage(),
+        ConstantArray::get(annotationType, annotationsToSave), ""
+      );
+
+      newAnnotations->copyAttributesFrom(annotations);
+
+      annotations->replaceAllUsesWith(newAnnotations);
+      annotations->eraseFromParent();
+
+      newAnnotations->setName("llvm.global.annotations");
+
+      for (auto *G : globals) {
+        G->removeDeadConstantUsers();
+      }
+    }
+
+    // Checks that a value is only used by instructions, directly or through constant expressions
+    bool isOnlyUsedByInstructions(Constant *value) const {
+      return llvm::all_of(value->users(), [&](User *user) {
+        if (isa<Instruction>(user)) {
+          return true;
+        }
+
+        auto *expression = dyn_cast<ConstantExpr>(user);
+        return expression && this->isOnlyUsedByInstructions(expression);
+      });
+    }
+
+    // Bytes of the initializer as they are laid out in memory, nothing if it's not plain data.
+    // Sets `reason` to the reason why the variable can't be encrypted
+    std::optional<std::vector<uint8_t>> getPlaintext(GlobalVariable &G, const DataLayout &DL, StringRef &reason) const {
+      if (!G.hasLocalLinkage()) {
+        reason = "has external linkage";
+        return std::nullopt;
+      }
+
+      if (!G.hasDefinitiveInitializer() || G.isExternallyInitialized() || G.isThreadLocal()) {
+        reason = "has no definitive initializer";
+        return std::nullopt;
+      }
+
+      if (G.getAlign().valueOrOne().value() > EncryptPass::maxAlignment) {
+        reason = "is overaligned";
+        return std::nullopt;
+      }
+
+      if (!this->isOnlyUsedByInstructions(&G)) {
+        reason = "is referenced by other globals";
+        return std::nullopt;
+      }
+
+      // The raw data of constants is stored in the byte order of the host
+      if (DL.isLittleEndian() != sys::IsLittleEndianHost) {
+        reason = "has a different byte order on the host";
+        return std::nullopt;
+      }
+
+      std::vector<uint8_t> bytes;
+      Constant *initializer = G.getInitializer();
+
+      if (auto *data = dyn_cast<ConstantDataSequential>(initializer)) {
+        StringRef raw = data->getRawDataValues();
+        bytes.assign(raw.bytes_begin(), raw.bytes_end());
+      } else if (auto *integer = dyn_cast<ConstantInt>(initializer); integer && integer->getBitWidth() % 8 == 0) {
+        APInt value = integer->getValue();
+        for (unsigned i = 0; i < value.getBitWidth() / 8; i++) {
+          bytes.push_back(value.extractBitsAsZExtValue(8, i * 8));
+        }
+        if (DL.isBigEndian()) {
+          std::reverse(bytes.begin(), bytes.end());
+        }
+      } else {
+        reason = "is not an array of numbers, a string, or a number";
+        return std::nullopt;
+      }
+
+      // Padding of the allocation
+      bytes.resize(DL.getTypeAllocSize(G.getValueType()), 0);
+
+      if (bytes.empty()) {
+        reason = "is empty";
+        return std::nullopt;
+      }
+
+      return bytes;
+    }
+
+    // xorshift64, the key stream of the cipher. Every byte is XOR-ed with the low byte of the next state
+    static uint64_t nextKey(uint64_t state) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      return state;
+    }
+
+    Value *emitNextKey(IRBuilder<> &builder, Value *state) const {
+      state = builder.CreateXor(state, builder.CreateShl(state, 13));
+      state = builder.CreateXor(state, builder.CreateLShr(state, 7));
+      state = builder.CreateXor(state, builder.CreateShl(state, 17));
+      return state;
+    }
+
+    // `ptr obf.decrypt(ptr cache, ptr data, iN size, i64 key)` decrypts `data` into a new buffer,
+    // publishes the buffer in `cache` unless another thread was faster, and returns the published buffer
+    Function *getDecryptFunction(Module &M) const {
+      if (Function *decryptFunc = M.getFunction(EncryptPass::decryptFuncName)) {
+        return decryptFunc;
+      }
+
+      LLVMContext &context = M.getContext();
+      const DataLayout &DL = M.getDataLayout();
+
+      Type *ptrTy = PointerType::get(context, 0);
+      Type *sizeTy = DL.getIntPtrType(context);
+      Type *int8Ty = Type::getInt8Ty(context);
+      Type *int64Ty = Type::getInt64Ty(context);
+
+      FunctionCallee mallocFunc = M.getOrInsertFunction("malloc", ptrTy, sizeTy);
+      FunctionCallee freeFunc = M.getOrInsertFunction("free", Type::getVoidTy(context), ptrTy);
+
+      Function *decryptFunc = Function::Create(
+        FunctionType::get(ptrTy, {ptrTy, ptrTy, sizeTy, int64Ty}, false),
+        GlobalValue::LinkageTypes::InternalLinkage, EncryptPass::decryptFuncName, M
+      );
+      decryptFunc->addFnAttr(Attribute::NoInline);
+      decryptFunc->addFnAttr(Attribute::Cold);
+
+      Value *cache = decryptFunc->getArg(0);
+      Value *data = decryptFunc->getArg(1);
+      Value *size = decryptFunc->getArg(2);
+      Value *key = decryptFunc->getArg(3);
+
+      BasicBlock *entryBlock = BasicBlock::Create(context, "entry", decryptFunc);
+      BasicBlock *failedBlock = BasicBlock::Create(context, "failed", decryptFunc);
+      BasicBlock *loopBlock = BasicBlock::Create(context, "loop", decryptFunc);
+      BasicBlock *publishBlock = BasicBlock::Create(context, "publish", decryptFunc);
+      BasicBlock *wonBlock = BasicBlock::Create(context, "won", decryptFunc);
+      BasicBlock *lostBlock = BasicBlock::Create(context, "lost", decryptFunc);
+
+      IRBuilder<> builder(entryBlock);
+      Value *buffer = builder.CreateCall(mallocFunc, {size}, "buffer");
+      builder.CreateCondBr(builder.CreateIsNull(buffer), failedBlock, loopBlock);
+
+      builder.SetInsertPoint(failedBlock);
+      builder.CreateIntrinsic(Intrinsic::trap, {}, {});
+      builder.CreateUnreachable();
+
+      builder.SetInsertPoint(loopBlock);
+      PHINode *idx = builder.CreatePHI(sizeTy, 2, "idx");
+      PHINode *state = builder.CreatePHI(int64Ty, 2, "state");
+
+      Value *nextState = this->emitNextKey(builder, state);
+      Value *encrypted = builder.CreateLoad(int8Ty, builder.CreateInBoundsGEP(int8Ty, data, idx));
+      Value *decrypted = builder.CreateXor(encrypted, builder.CreateTrunc(nextState, int8Ty));
+      builder.CreateStore(decrypted, builder.CreateInBoundsGEP(int8Ty, buffer, idx));
+
+      Value *nextIdx = builder.CreateAdd(idx, ConstantInt::get(sizeTy, 1));
+      builder.CreateCondBr(builder.CreateICmpEQ(nextIdx, size), publishBlock, loopBlock);
+
+      idx->addIncoming(ConstantInt::get(sizeTy, 0), entryBlock);
+      idx->addIncoming(nextIdx, loopBlock);
+      state->addIncoming(key, entryBlock);
+      state->addIncoming(nextState, loopBlock);
+
+      // Release makes the decrypted bytes visible to the threads that acquire the pointer
+      builder.SetInsertPoint(publishBlock);
+      AtomicCmpXchgInst *exchange = builder.CreateAtomicCmpXchg(
+        cache, ConstantPointerNull::get(cast<PointerType>(ptrTy)), buffer, MaybeAlign(),
+        AtomicOrdering::AcquireRelease, AtomicOrdering::Acquire
+      );
+      builder.CreateCondBr(builder.CreateExtractValue(exchange, 1), wonBlock, lostBlock);
+
+      builder.SetInsertPoint(wonBlock);
+      builder.CreateRet(buffer);
+
+      builder.SetInsertPoint(lostBlock);
+      builder.CreateCall(freeFunc, {buffer});
+      builder.CreateRet(builder.CreateExtractValue(exchange, 0));
+
+      return decryptFunc;
+    }
+
+    // The point that dominates all uses in a function: the first use in the nearest common dominator of the uses.
+    // The check is hoisted out of loops, so that it runs once per call rather than once per iteration
+    Instruction *getCheckInsertPoint(Function &F, const std::vector<Use *> &uses) const {
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+
+      BasicBlock *commonBlock = nullptr;
+      for (auto *use : uses) {
+        auto *user = cast<Instruction>(use->getUser());
+        auto *phiNode = dyn_cast<PHINode>(user);
+        BasicBlock *block = phiNode ? phiNode->getIncomingBlock(*use) : user->getParent();
+
+        // Uses in unreachable code don't need to be dominated
+        if (!DT.isReachableFromEntry(block)) {
+          continue;
+        }
+
+        commonBlock = commonBlock ? DT.findNearestCommonDominator(commonBlock, block) : block;
+      }
+
+      if (!commonBlock) {
+        return &*F.getEntryBlock().getFirstInsertionPt();
+      }
+
+      while (Loop *loop = LI.getLoopFor(commonBlock)) {
+        commonBlock = DT.getNode(loop->getHeader())->getIDom()->getBlock();
+      }
+
+      for (auto &instruction : *commonBlock) {
+        if (isa<PHINode>(instruction)) {
+          continue;
+        }
+
+        bool isUser = llvm::any_of(uses, [&](Use *use) { return use->getUser() == &instruction; });
+        if (isUser) {
+          return &instruction;
+        }
+      }
+
+      return commonBlock->getTerminator();
+    }
+
+    // Inserts the lookup of the decrypted copy before `insertPoint`:
+    //   %copy = load atomic ptr, ptr %cache acquire
+    //   br (%copy == null), %decrypt, %tail (unlikely)
+    // and returns the pointer to the copy, which dominates `insertPoint`
+    Value *insertCacheCheck(
+      Instruction *insertPoint, GlobalVariable *cache, GlobalVariable *data, uint64_t key,
+      Function *decryptFunc, const Provenance &provenance
+    ) const {
+      LLVMContext &context = insertPoint->getContext();
+      const DataLayout &DL = insertPoint->getModule()->getDataLayout();
+      Type *ptrTy = PointerType::get(context, 0);
+      Type *sizeTy = DL.getIntPtrType(context);
+
+      IRBuilder<> builder(insertPoint);
+
+      LoadInst *copy = builder.CreateAlignedLoad(ptrTy, cache, DL.getPointerABIAlignment(0), "copy");
+      copy->setAtomic(AtomicOrdering::Acquire);
+      Value *isMissing = builder.CreateIsNull(copy);
+
+      Instruction *decryptTerminator = SplitBlockAndInsertIfThen(
+        isMissing, insertPoint, false, MDBuilder(context).createUnlikelyBranchWeights()
+      );
+      BasicBlock *checkBlock = copy->getParent();
+      BasicBlock *decryptBlock = decryptTerminator->getParent();
+
+      builder.SetInsertPoint(decryptTerminator);
+      Value *decrypted = builder.CreateCall(decryptFunc, {
+        cache, data, ConstantInt::get(sizeTy, DL.getTypeAllocSize(data->getValueType())),
+        ConstantInt::get(Type::getInt64Ty(context), key),
+      });
+
+      builder.SetInsertPoint(insertPoint);
+      PHINode *plaintext = builder.CreatePHI(ptrTy, 2, "plaintext");
+      plaintext->addIncoming(copy, checkBlock);
+      plaintext->addIncoming(decrypted, decryptBlock);
+
+      SmallVector<Value *> cacheCheck = {copy, isMissing, checkBlock->getTerminator(), decryptTerminator, plaintext};
+      for (auto *value : cacheCheck) {
+        provenance.tag(value, "cache-check");
+      }
+      provenance.tag(decrypted, "decrypt");
+
+      return plaintext;
+    }
+
+    // Replaces the variable with its ciphertext, and its uses with the decrypted copy.
+    // Returns the number of functions the copy is looked up in
+    unsigned encrypt(
+      Module &M, GlobalVariable *G, const std::vector<uint8_t> &plaintext, uint64_t key, const Provenance &provenance
+    ) const {
+      LLVMContext &context = M.getContext();
+      Type *ptrTy = PointerType::get(context, 0);
+
+      std::vector<uint8_t> ciphertext = plaintext;
+      uint64_t state = key;
+      for (auto &byte : ciphertext) {
+        state = EncryptPass::nextKey(state);
+        byte ^= (uint8_t)state;
+      }
+
+      Constant *dataInit = ConstantDataArray::get(context, ciphertext);
+      auto *data = new GlobalVariable(
+        M, dataInit->getType(), true, GlobalValue::PrivateLinkage, dataInit, "obf.data"
+      );
+      auto *cache = new GlobalVariable(
+        M, ptrTy, false, GlobalValue::PrivateLinkage, ConstantPointerNull::get(cast<PointerType>(ptrTy)), "obf.cache"
+      );
+
+      Function *decryptFunc = this->getDecryptFunction(M);
+
+      // Constant expressions (e.g. `getelementptr` into a string) become instructions, which can use the copy
+      convertUsersOfConstantsToInstructions({G});
+
+      MapVector<Function *, std::vector<Use *>> functionUses;
+      for (auto &use : G->uses()) {
+        functionUses[cast<Instruction>(use.getUser())->getFunction()].push_back(&use);
+      }
+
+      for (auto &[F, uses] : functionUses) {
+        Instruction *insertPoint = this->getCheckInsertPoint(*F, uses);
+        Value *copy = this->insertCacheCheck(insertPoint, cache, data, key, decryptFunc, provenance);
+
+        for (auto *use : uses) {
+          use->set(copy);
+        }
+
+        OptimizationRemarkEmitter ORE(F);
+        ORE.emit([&]() {
+          return OptimizationRemark(DEBUG_TYPE, "Encrypted", insertPoint)
+            << "encrypted " << ore::NV("Global", G->getName()) << " ("
+            << ore::NV("Bytes", (unsigned)plaintext.size()) << " bytes), decrypted on the first use";
+        });
+      }
+
+      G->eraseFromParent();
+
+      return functionUses.size();
+    }
+
+  public:
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) const {
+      SmallPtrSet<GlobalVariable *, 16> targetGlobals;
+      std::vector<GlobalVariable *> orderedTargetGlobals;
+
+      for (auto &G : M.globals()) {
+        if (this->hasAnnotation(G)) {
+          targetGlobals.insert(&G);
+          orderedTargetGlobals.push_back(&G);
+        }
+      }
+
+      if (orderedTargetGlobals.empty()) {
+        return PreservedAnalyses::all();
+      }
+
+      this->removeAnnotations(M, targetGlobals);
+
+      Provenance provenance(M, EncryptPass::annotationName);
+
+      auto *seedFlag = mdconst::extract_or_null<ConstantInt>(M.getModuleFlag("obf.seed"));
+      const uint64_t seed = seedFlag ? seedFlag->getZExtValue() : 0;
+
+      for (auto *G : orderedTargetGlobals) {
+        StringRef reason;
+        auto plaintext = this->getPlaintext(*G, M.getDataLayout(), reason);
+        if (!plaintext) {
+          LLVM_DEBUG(dbgs() << "[" << EncryptPass::annotationName << "] Not encrypted: " << G->getName()
+                            << " " << reason << "\n");
+          NumGlobalsSkipped++;
+          continue;
+        }
+
+        // The key stream must not get stuck at zero
+        const uint64_t key = xxh3_64bits(std::to_string(seed) + "/" + EncryptPass::annotationName + "/" + G->getName().str()) | 1;
+
+        LLVM_DEBUG(dbgs() << "[" << EncryptPass::annotationName << "] Applying to: " << G->getName() << "\n");
+
+        NumBytesEncrypted += plaintext->size();
+        NumCacheChecks += this->encrypt(M, G, *plaintext, key, provenance);
+        NumGlobalsEncrypted++;
+      }
+
+      return PreservedAnalyses::none();
+    }
+  };
+} // namespace
+
+PassPluginLibraryInfo getEncryptPassPluginInfo() {
+  return {
+    LLVM_PLUGIN_API_VERSION,
+    "EncryptPass",
+    LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          ModulePassManager &MPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "encrypt") {
+            MPM.addPass(EncryptPass());
+            return true;
+          }
+          return false;
+        }
+      );
+    }
+  };
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getEncryptPassPluginInfo();
+}
@@ -1,14 +1,42 @@
-#include <vector>
 #include <map>
+#include <vector>
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Transforms/Utils/Local.h"
 
 #include "BaseAnnotatedPass.cpp"
+#include "CaseValueAllocator.cpp"
+#include "DispatcherProfile.cpp"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "flatten"
+
+STATISTIC(NumFunctionsFlattened, "Number of flattened functions");
+STATISTIC(NumRegionsFlattened, "Number of functions with flattened regions");
+STATISTIC(NumDispatchersFused, "Number of unified functions whose dispatcher became the flattened one");
+STATISTIC(NumBlocksFlattened, "Number of blocks turned into dispatcher cases");
+STATISTIC(NumSlotsDemoted, "Number of registers and phi nodes demoted to stack slots");
+STATISTIC(NumInvokesFlattened, "Number of `invoke` instructions whose normal edges go through the dispatcher");
+
+static cl::opt<bool> FlattenProfile(
+  "flatten-profile", cl::init(false),
+  cl::desc("Instrument flattened dispatchers with per-thread case and transition counters (link with runtime/obfprof.c)")
+);
+
+static cl::opt<bool> FlattenProfileCycles(
+  "flatten-profile-cycles", cl::init(false),
+  cl::desc("Additionally count cycles spent in the dispatcher (requires -flatten-profile)")
+);
+
 namespace {
   struct SwitchLoop {
     SwitchInst *switchInst;
@@ -21,6 +49,9 @@ namespace {
 
     const std::string flattenedSwitchAnnotation = "flatten-case-var";
 
+    // Set by FunctionMergePass on the dispatcher of a unified function
+    const std::string mergeDispatchAnnotation = "function-merge-dispatch";
+
     // Splits basic block by the last two instructions and returns a new block (the second part)
     void splitBlockByConditionalBranch(BasicBlock &block) const {
       // Move `icmp` instruction that preceeds terminating instruction
@@ -33,23 +64,69 @@ namespace {
     }
 
     // Generates a map of function blocks and unique integers (will be used as switch case values).
-    // Skips `entryBlock`, `loopStart`, `loopEnd`, and `defaultSwitchBlock`
-    std::map<BasicBlock *, int> generateCaseBlockIdxs(Function &F) const {
+    // Values are a permutation of a dense range, see `CaseValueAllocator`, except for the `fixedIdxs` of some blocks.
+    // Skips `entryBlock`, `loopStart`, `loopEnd`, `defaultSwitchBlock`, and the `directBlocks`
+    MapVector<BasicBlock *, int> generateCaseBlockIdxs(
+      Function &F, const std::map<BasicBlock *, int> &fixedIdxs = {}, const SetVector<BasicBlock *> &directBlocks = {}
+    ) const {
       const int generatedBlocksNum = 4;
 
-      std::map<BasicBlock *, int> caseBlockIdxs;
+      MapVector<BasicBlock *, int> caseBlockIdxs;
 
-      int i = 0;
       auto blockIt = F.begin();
       std::advance(blockIt, generatedBlocksNum);
 
-      for (; blockIt != F.end(); blockIt++, i++) {
-        caseBlockIdxs[&*blockIt] = i;
+      CaseValueAllocator allocator(F.size() - generatedBlocksNum - directBlocks.size(), this->random());
+      for (auto [block, caseIdx] : fixedIdxs) {
+        allocator.reserve(caseIdx);
+      }
+
+      for (; blockIt != F.end(); blockIt++) {
+        if (directBlocks.contains(&*blockIt)) {
+          continue;
+        }
+
+        auto fixedIdx = fixedIdxs.find(&*blockIt);
+        caseBlockIdxs[&*blockIt] = fixedIdx != fixedIdxs.end() ? fixedIdx->second : allocator.allocate();
       }
 
       return caseBlockIdxs;
     }
 
+    // Gives the normal destination of every `invoke` a block of its own, which is reached directly and goes on
+    // through the dispatcher. The unwind edges stay direct as well, a landing pad can't be a dispatcher case.
+    // Returns these blocks and the landing pads
+    SetVector<BasicBlock *> splitInvokeEdges(Function &F) const {
+      LLVMContext &context = F.getContext();
+      SetVector<BasicBlock *> directBlocks;
+
+      for (auto &block : F) {
+        if (block.isLandingPad()) {
+          directBlocks.insert(&block);
+        }
+      }
+
+      std::vector<InvokeInst *> invokes;
+      for (auto &block : F) {
+        if (auto *invoke = dyn_cast<InvokeInst>(block.getTerminator())) {
+          invokes.push_back(invoke);
+        }
+      }
+
+      // The results of the calls are only available on the normal edges, and are stored to stack slots there
+      for (auto *invoke : invokes) {
+        BasicBlock *normalDest = invoke->getNormalDest();
+        BasicBlock *invokeCont = BasicBlock::Create(context, normalDest->getName() + ".invokeCont", &F, normalDest);
+        BranchInst::Create(normalDest, invokeCont);
+
+        normalDest->replacePhiUsesWith(invoke->getParent(), invokeCont);
+        invoke->setNormalDest(invokeCont);
+        directBlocks.insert(invokeCont);
+      }
+
+      return directBlocks;
+    }
+
     // Allocates a switch case variable (`caseVar`) for an infinite loop
     AllocaInst* allocateSwitchCaseVar(Function &F, IRBuilder<> &builder) const {
       LLVMContext &context = F.getContext();
@@ -70,12 +147,35 @@ namespace {
     }
 
     // Stores `initValue` in `caseVar` switch variable in an entry block
-    void initSwitchCaseVar(Function &F, IRBuilder<> &builder, AllocaInst *caseVar, int initValue) const {
-      LLVMContext &context = F.getContext();
+    void initSwitchCaseVar(Function &F, IRBuilder<> &builder, AllocaInst *caseVar, Value *initValue) const {
       BasicBlock &entryBlock = F.front();
 
       builder.SetInsertPoint(entryBlock.getTerminator());
-      builder.CreateStore(ConstantInt::get(Type::getInt32Ty(context), initValue), caseVar);
+      builder.CreateStore(initValue, caseVar);
+    }
+
+    // Returns the dispatcher of a function unified by FunctionMergePass: a `switch` on the selector argument
+    // that ends the entry block
+    SwitchInst *getMergeDispatch(Function &F) const {
+      auto *switchInst = dyn_cast<SwitchInst>(F.front().getTerminator());
+      if (!switchInst || !isa<Argument>(switchInst->getCondition()) || !switchInst->getCondition()->getType()->isIntegerTy(32)) {
+        return nullptr;
+      }
+
+      auto *md = switchInst->getMetadata("annotation");
+      if (!md) {
+        return nullptr;
+      }
+
+      for (auto &mdOperand : md->operands()) {
+        auto *mdNode = dyn_cast<MDNode>(mdOperand);
+        auto *mdString = mdNode ? dyn_cast<MDString>(mdNode->getOperand(0)) : nullptr;
+        if (mdString && mdString->getString() == this->mergeDispatchAnnotation) {
+          return switchInst;
+        }
+      }
+
+      return nullptr;
     }
 
     // Generates an infinite loop with a switch statement inside.
@@ -118,11 +218,14 @@ namespace {
     // and stores the corresponding switch case index of the successor in `caseVar` variable under the same condition
     void storeBlockSuccessorInCaseVar(
       LLVMContext &context, IRBuilder<> &builder,
-      AllocaInst *caseVar, BasicBlock *block, std::map<BasicBlock *, int> blockCaseIdxs
+      AllocaInst *caseVar, BasicBlock *block, const MapVector<BasicBlock *, int> &blockCaseIdxs
     ) const {
+      // The successors of an `invoke` are reached directly, see `splitInvokeEdges`
       if (
         dyn_cast<ReturnInst>(block->getTerminator())
         || dyn_cast<UnreachableInst>(block->getTerminator())
+        || dyn_cast<ResumeInst>(block->getTerminator())
+        || dyn_cast<InvokeInst>(block->getTerminator())
       ) {
         return;
       }
@@ -132,15 +235,15 @@ namespace {
       if (auto branch = dyn_cast<BranchInst>(block->getTerminator())) {
         if (branch->isUnconditional()) {
           auto successor = branch->getSuccessor(0);
-          auto caseIdx = blockCaseIdxs[successor];
+          auto caseIdx = blockCaseIdxs.lookup(successor);
 
           builder.CreateStore(ConstantInt::get(Type::getInt32Ty(context), caseIdx), caseVar);
         } else {
           auto successorTrue = branch->getSuccessor(0);
           auto successorFalse = branch->getSuccessor(1);
 
-          auto trueCaseIdx = blockCaseIdxs[successorTrue];
-          auto falseCaseIdx = blockCaseIdxs[successorFalse];
+          auto trueCaseIdx = blockCaseIdxs.lookup(successorTrue);
+          auto falseCaseIdx = blockCaseIdxs.lookup(successorFalse);
 
           Value *selectInst = builder.CreateSelect(
             branch->getCondition(),
@@ -158,13 +261,13 @@ namespace {
 
         // In LLVM switch representation, the default switch case points to the next block
         // in condition if no case is matched, even if there os no explicit default case
-        auto defaultBlockIdx = blockCaseIdxs[blockSwitchInst->case_default()->getCaseSuccessor()];
+        auto defaultBlockIdx = blockCaseIdxs.lookup(blockSwitchInst->case_default()->getCaseSuccessor());
         builder.CreateStore(ConstantInt::get(Type::getInt32Ty(context), defaultBlockIdx), caseVar);
 
         for (auto &switchCase : blockSwitchInst->cases()) {
           ConstantInt *caseValue = switchCase.getCaseValue();
           BasicBlock *caseBlock = switchCase.getCaseSuccessor();
-          int caseIdx = blockCaseIdxs[caseBlock];
+          int caseIdx = blockCaseIdxs.lookup(caseBlock);
 
           // If condition value equals case value: update caseVar, otherwise don't change caseVar (load previous value)
           LoadInst *varLoad = builder.CreateLoad(caseVar->getAllocatedType(), caseVar, "caseVar");
@@ -184,10 +287,8 @@ namespace {
       throw std::runtime_error("Unknown terminating instruction type");
     }
 
-    // Adds a block as a switch case with particular `caseIdx`
-    void addBlockCase(
-      LLVMContext &context, IRBuilder<> &builder, BasicBlock *block, int caseIdx, SwitchLoop switchLoop
-    ) const {
+    // Replaces the branch or switch that ends a block with a branch back to the dispatcher
+    void branchToDispatcher(IRBuilder<> &builder, BasicBlock *block, SwitchLoop switchLoop) const {
       if (
         dyn_cast<BranchInst>(block->getTerminator()) ||
         dyn_cast<SwitchInst>(block->getTerminator())
@@ -196,7 +297,13 @@ namespace {
         builder.SetInsertPoint(block);
         builder.CreateBr(switchLoop.loopEnd);
       }
+    }
 
+    // Adds a block as a switch case with particular `caseIdx`
+    void addBlockCase(
+      LLVMContext &context, IRBuilder<> &builder, BasicBlock *block, int caseIdx, SwitchLoop switchLoop
+    ) const {
+      this->branchToDispatcher(builder, block, switchLoop);
       switchLoop.switchInst->addCase(ConstantInt::get(Type::getInt32Ty(context), caseIdx), block);
     }
 
@@ -236,32 +343,365 @@ namespace {
       return usedOutside;
     }
 
-    PreservedAnalyses applyPass(Function &F) const override {
+    // Tags the dispatcher loop and the updates of `caseVar` at the end of the cases
+    void tagDispatcher(
+      const Provenance &provenance, Function &F, AllocaInst *caseVar, SwitchLoop switchLoop
+    ) const {
+      BasicBlock *loopStart = switchLoop.switchInst->getParent();
+
+      provenance.tag(caseVar, "dispatcher");
+
+      for (User *user : caseVar->users()) {
+        auto *inst = cast<Instruction>(user);
+        if (inst->getParent() == loopStart) {
+          provenance.tag(inst, "dispatcher");
+          continue;
+        }
+
+        provenance.tag(inst, "state-update");
+
+        auto *store = dyn_cast<StoreInst>(inst);
+        auto *selectInst = store ? dyn_cast<SelectInst>(store->getValueOperand()) : nullptr;
+        if (!selectInst) {
+          continue;
+        }
+
+        provenance.tag(selectInst, "state-update");
+
+        // Comparisons of a lowered `switch` are generated, a conditional branch keeps its own condition
+        if (isa<LoadInst>(selectInst->getFalseValue())) {
+          provenance.tag(selectInst->getCondition(), "state-update");
+        }
+      }
+
+      for (auto &block : F) {
+        auto *branch = dyn_cast<BranchInst>(block.getTerminator());
+        bool toDispatcher = branch && branch->isUnconditional() && (
+          branch->getSuccessor(0) == loopStart || branch->getSuccessor(0) == switchLoop.loopEnd
+        );
+
+        if (toDispatcher || block.getTerminator() == switchLoop.switchInst) {
+          provenance.tag(block.getTerminator(), "dispatcher");
+        }
+      }
+    }
+
+    // Tags a stack slot created by demotion with its loads and stores
+    void tagDemotedSlot(const Provenance &provenance, AllocaInst *slot, DebugLoc origin) const {
+      provenance.tag(slot, "demoted-slot", origin);
+
+      for (User *user : slot->users()) {
+        provenance.tag(user, "demoted-slot", origin);
+      }
+    }
+
+    // Annotations of the instructions of a region, which are passed on to the instructions of its dispatcher
+    SmallVector<StringRef> getRegionAnnotations(const SetVector<BasicBlock *> &region) const {
+      SmallVector<StringRef> annotations;
+
+      for (auto *block : region) {
+        for (auto &inst : *block) {
+          auto *md = inst.getMetadata(LLVMContext::MD_annotation);
+          if (!md) {
+            continue;
+          }
+
+          for (auto &mdOperand : md->operands()) {
+            auto *mdString = dyn_cast<MDString>(mdOperand);
+            if (mdString && !llvm::is_contained(annotations, mdString->getString())) {
+              annotations.push_back(mdString->getString());
+            }
+          }
+        }
+      }
+
+      return annotations;
+    }
+
+    // Flattens the annotated regions of a function into a dispatcher of their own.
+    // Edges into a region go through stubs that select the case of the target block, and edges out of it
+    // through cases that branch to the blocks after the region. Values whose definitions no longer dominate
+    // their uses are demoted to stack slots, the same way as for whole functions
+    PreservedAnalyses flattenRegion(Function &F, FunctionAnalysisManager &FAM) const {
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+      LLVMContext &context = F.getContext();
+      IRBuilder<> builder(context);
+      Provenance provenance(*F.getParent(), FlattenPass::annotationName);
+
+      SetVector<BasicBlock *> region;
+      for (auto &block : F) {
+        if (this->isAnnotated(block)) {
+          region.insert(&block);
+        }
+      }
+
+      for (auto *block : region) {
+        Instruction *terminator = block->getTerminator();
+        bool supported = isa<BranchInst>(terminator) || isa<SwitchInst>(terminator)
+          || isa<ReturnInst>(terminator) || isa<UnreachableInst>(terminator);
+
+        if (!supported || block->isEHPad() || block->hasAddressTaken()) {
+          ORE.emit([&]() {
+            return OptimizationRemarkMissed(DEBUG_TYPE, "UnsupportedRegion", terminator)
+              << "region not flattened: exception handling or indirect branches";
+          });
+          return PreservedAnalyses::all();
+        }
+      }
+
+      // The static allocas stay in the entry block, which can't be a case
+      BasicBlock &entryBlock = F.front();
+      if (region.remove(&entryBlock)) {
+        auto splitPoint = entryBlock.getFirstInsertionPt();
+        while (isa<AllocaInst>(*splitPoint)) {
+          splitPoint++;
+        }
+        region.insert(entryBlock.splitBasicBlock(splitPoint, "entryBlockSplit"));
+      }
+
+      if (region.size() < 2) {
+        return PreservedAnalyses::all();
+      }
+
+      SmallVector<StringRef> annotations = this->getRegionAnnotations(region);
+      BasicBlock *firstBlock = region.front();
+
+      auto caseVar = this->allocateSwitchCaseVar(F, builder);
+
+      // The dispatcher of the region, in front of its first block
+      BasicBlock *loopStart = BasicBlock::Create(context, "regionStart", &F, firstBlock);
+      BasicBlock *defaultSwitchBlock = BasicBlock::Create(context, "regionDefault", &F, firstBlock);
+      BasicBlock *loopEnd = BasicBlock::Create(context, "regionEnd", &F, firstBlock);
+
+      builder.SetInsertPoint(loopStart);
+      LoadInst *varLoad = builder.CreateLoad(caseVar->getAllocatedType(), caseVar, "caseVar");
+      SwitchInst *switchInst = builder.CreateSwitch(varLoad, defaultSwitchBlock);
+
+      builder.SetInsertPoint(defaultSwitchBlock);
+      builder.CreateBr(loopEnd);
+
+      builder.SetInsertPoint(loopEnd);
+      builder.CreateBr(loopStart);
+
+      SwitchLoop switchLoop = {switchInst, loopEnd};
+
+      // Blocks after the region are reached through exit cases
+      MapVector<BasicBlock *, BasicBlock *> exitBlocks;
+      for (auto *block : region) {
+        for (auto *successor : successors(block)) {
+          if (!region.contains(successor) && !exitBlocks.count(successor)) {
+            BasicBlock *exitBlock = BasicBlock::Create(context, successor->getName() + ".regionExit", &F, successor);
+            BranchInst::Create(successor, exitBlock);
+            exitBlocks[successor] = exitBlock;
+          }
+        }
+      }
+
+      // Case values of the blocks of the region, and of the exit cases by the blocks they lead to
+      MapVector<BasicBlock *, int> blockCaseIdxs;
+      CaseValueAllocator allocator(region.size() + exitBlocks.size(), this->random());
+      for (auto *block : region) {
+        blockCaseIdxs[block] = allocator.allocate();
+      }
+      for (auto &[successor, exitBlock] : exitBlocks) {
+        blockCaseIdxs[successor] = allocator.allocate();
+      }
+
+      // Edges into the region select the case of their target
+      std::vector<BasicBlock *> entryStubs;
+      for (auto *block : region) {
+        SmallSetVector<BasicBlock *, 4> outsidePredecessors;
+        for (auto *predecessor : predecessors(block)) {
+          if (!region.contains(predecessor)) {
+            outsidePredecessors.insert(predecessor);
+          }
+        }
+
+        if (outsidePredecessors.empty()) {
+          continue;
+        }
+
+        BasicBlock *entryStub = BasicBlock::Create(context, block->getName() + ".regionEntry", &F, loopStart);
+        builder.SetInsertPoint(entryStub);
+        builder.CreateStore(ConstantInt::get(Type::getInt32Ty(context), blockCaseIdxs[block]), caseVar);
+        builder.CreateBr(loopStart);
+        entryStubs.push_back(entryStub);
+
+        for (auto *predecessor : outsidePredecessors) {
+          predecessor->getTerminator()->replaceSuccessorWith(block, entryStub);
+        }
+      }
+
+      // phi nodes of the region and after it lose their predecessors
+      std::vector<PHINode *> phiNodes;
+      for (auto *block : region) {
+        for (auto &phiNode : block->phis()) {
+          phiNodes.push_back(&phiNode);
+        }
+      }
+      for (auto &[successor, exitBlock] : exitBlocks) {
+        for (auto &phiNode : successor->phis()) {
+          phiNodes.push_back(&phiNode);
+        }
+      }
+
+      for (auto *block : region) {
+        this->storeBlockSuccessorInCaseVar(context, builder, caseVar, block, blockCaseIdxs);
+      }
+
+      for (auto *block : region) {
+        this->addBlockCase(context, builder, block, blockCaseIdxs[block], switchLoop);
+      }
+
+      for (auto &[successor, exitBlock] : exitBlocks) {
+        switchInst->addCase(ConstantInt::get(Type::getInt32Ty(context), blockCaseIdxs[successor]), exitBlock);
+      }
+
+      unsigned demotedNum = 0;
+      for (auto *phiNode : phiNodes) {
+        DebugLoc origin = phiNode->getDebugLoc();
+        this->tagDemotedSlot(provenance, DemotePHIToStack(phiNode), origin);
+        demotedNum++;
+      }
+
+      // The dispatcher changes the dominators of the region and of the blocks after it
+      DominatorTree DT(F);
+      std::vector<Instruction *> nonDominating;
+      for (auto &inst : instructions(F)) {
+        if (isa<AllocaInst>(inst) && inst.getParent() == &F.front()) {
+          continue;
+        }
+
+        bool dominatesUses = llvm::all_of(inst.uses(), [&](const Use &use) { return DT.dominates(&inst, use); });
+        if (!dominatesUses) {
+          nonDominating.push_back(&inst);
+        }
+      }
+
+      for (auto *inst : nonDominating) {
+        DebugLoc origin = inst->getDebugLoc();
+        this->tagDemotedSlot(provenance, DemoteRegToStack(*inst), origin);
+        demotedNum++;
+      }
+
+      this->tagDispatcher(provenance, F, caseVar, switchLoop);
+      this->annotateSwitchInst(F, switchInst);
+
+      // The other passes of the region apply to its dispatcher, too
+      std::vector<BasicBlock *> dispatcherBlocks = {loopStart, defaultSwitchBlock, loopEnd};
+      for (auto &[successor, exitBlock] : exitBlocks) {
+        dispatcherBlocks.push_back(exitBlock);
+      }
+      dispatcherBlocks.insert(dispatcherBlocks.end(), entryStubs.begin(), entryStubs.end());
+      dispatcherBlocks.insert(dispatcherBlocks.end(), region.begin(), region.end());
+
+      for (auto *block : dispatcherBlocks) {
+        for (auto &inst : *block) {
+          for (auto annotation : annotations) {
+            inst.addAnnotationMetadata(annotation);
+          }
+        }
+      }
+
+      if (FlattenProfile) {
+        DispatcherProfiler(FlattenProfileCycles).instrument(F, switchInst);
+      }
+
+      NumRegionsFlattened++;
+      NumBlocksFlattened += region.size();
+      NumSlotsDemoted += demotedNum;
+
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "FlattenedRegion", &F)
+          << "flattened " << ore::NV("Blocks", (unsigned)region.size()) << " blocks of annotated regions with "
+          << ore::NV("Exits", (unsigned)exitBlocks.size()) << " exits, demoted "
+          << ore::NV("DemotedSlots", demotedNum) << " values to stack slots";
+      });
+
+      return PreservedAnalyses::none();
+    }
+
+    std::string getConfiguration() const override {
+      return formatv("{0} {1}", (bool)FlattenProfile, (bool)FlattenProfileCycles).str();
+    }
+
+    PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const override {
       if (F.size() == 1) {
         return PreservedAnalyses::all();
       }
 
+      // The budget pass drops flattening first, it costs the most compile time
+      if (this->getIntensity() < CompileBudget::flattenIntensity) {
+        return PreservedAnalyses::all();
+      }
+
+      if (!this->isWholeFunction()) {
+        return this->flattenRegion(F, FAM);
+      }
+
+      // Landing pads are kept, while the pads of funclet-based exception handling (MSVC) are not supported
       for (auto &block : F) {
-        if (block.isLandingPad() || isa<InvokeInst>(block.getTerminator())) {
-          throw std::runtime_error("Exception invocation found. Unable to apply the pass");
+        if (block.isEHPad() && !block.isLandingPad()) {
+          throw std::runtime_error("Funclet-based exception handling found. Unable to apply the pass");
+        }
+      }
+
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+      // Blocks reached through their addresses (e.g. the handlers of a virtualized function) can't become cases
+      for (auto &block : F) {
+        if (block.hasAddressTaken()) {
+          ORE.emit([&]() {
+            return OptimizationRemarkMissed(DEBUG_TYPE, "UnsupportedFunction", &F)
+              << "not flattened: taken block addresses";
+          });
+          return PreservedAnalyses::all();
         }
       }
 
       LLVMContext &context = F.getContext();
       IRBuilder<> builder(context);
+      Provenance provenance(*F.getParent(), FlattenPass::annotationName);
 
       BasicBlock &entryBlock = F.front();
       entryBlock.setName("entryBlock");
 
+      // The dispatcher of a unified function is fused with the flattened one: the target functions keep
+      // the selector values as their case values, and the selector is the initial state.
+      // A call then reaches the first case of its target with a single dispatch
+      SwitchInst *mergeDispatch = this->getMergeDispatch(F);
+      Value *selector = nullptr;
+      BasicBlock *selectorDefault = nullptr;
+      std::map<BasicBlock *, int> selectorIdxs;
+
+      if (mergeDispatch) {
+        selector = mergeDispatch->getCondition();
+        selectorDefault = mergeDispatch->getDefaultDest();
+        for (auto &switchCase : mergeDispatch->cases()) {
+          selectorIdxs[switchCase.getCaseSuccessor()] = switchCase.getCaseValue()->getZExtValue();
+        }
+      }
+
       // If entry block ends with a switch or conditional branch, split the block in two
       auto entryTerminator = entryBlock.getTerminator();
       if (
-        dyn_cast<SwitchInst>(entryTerminator) ||
-        dyn_cast<BranchInst>(entryTerminator) && dyn_cast<BranchInst>(entryTerminator)->isConditional()
+        !mergeDispatch && (
+          dyn_cast<SwitchInst>(entryTerminator) ||
+          dyn_cast<BranchInst>(entryTerminator) && dyn_cast<BranchInst>(entryTerminator)->isConditional()
+        )
       ) {
         this->splitBlockByConditionalBranch(entryBlock);
       }
 
+      // An `invoke` moves to a block of its own, the static allocas its arguments may point to stay in the entry block
+      if (isa<InvokeInst>(entryTerminator)) {
+        entryBlock.splitBasicBlock(entryTerminator, "entryBlockSplit");
+      }
+
+      SetVector<BasicBlock *> directBlocks = this->splitInvokeEdges(F);
+      const unsigned invokeNum = llvm::count_if(directBlocks, [](BasicBlock *block) { return !block->isLandingPad(); });
+
       // Entry block terminator will be deleted when creating an infinite loop.
       // Save the entry block successor beforehand to make it a default switch case
       BasicBlock *entryBlockSuccessor = entryBlock.getTerminator()->getSuccessor(0);
@@ -271,10 +711,22 @@ namespace {
 
       // ! At this point, all blocks except for the entry block are not reachable
 
-      auto blockCaseIdxs = this->generateCaseBlockIdxs(F);
-
-      // Initially, caseVar points to entry block successor (default case)
-      this->initSwitchCaseVar(F, builder, caseVar, blockCaseIdxs[entryBlockSuccessor]);
+      auto blockCaseIdxs = this->generateCaseBlockIdxs(F, selectorIdxs, directBlocks);
+
+      if (selector) {
+        // Unknown selectors return right away, as they did from the dispatcher of the unified function
+        BasicBlock *defaultSwitchBlock = switchLoop.switchInst->getDefaultDest();
+        switchLoop.switchInst->setDefaultDest(selectorDefault);
+        defaultSwitchBlock->eraseFromParent();
+        blockCaseIdxs.erase(selectorDefault);
+
+        this->initSwitchCaseVar(F, builder, caseVar, selector);
+      } else {
+        // Initially, caseVar points to entry block successor (default case)
+        this->initSwitchCaseVar(
+          F, builder, caseVar, ConstantInt::get(Type::getInt32Ty(context), blockCaseIdxs[entryBlockSuccessor])
+        );
+      }
 
       // Update caseVar in the end of every block based on terminating instruction
       for (auto it = blockCaseIdxs.begin(); it != blockCaseIdxs.end(); it++) {
@@ -282,29 +734,62 @@ namespace {
         this->storeBlockSuccessorInCaseVar(context, builder, caseVar, block, blockCaseIdxs);
       }
 
-      // Make each block a case inside a switch (except for the entry block).
-      // Note: iterating a map of pointers leads to indeterministic order of case statements in the switch
+      // Make each block a case inside a switch (except for the entry block), in the layout order
       for (auto it = blockCaseIdxs.begin(); it != blockCaseIdxs.end(); it++) {
         auto block = it->first;
         auto caseIdx = it->second;
         this->addBlockCase(context, builder, block, caseIdx, switchLoop);
       }
 
+      // Landing pads and the normal destinations of `invoke` are entered directly and leave through the dispatcher.
+      // The unwinder still finds the landing pads in the tables, so exceptions cost as much as before
+      for (auto *block : directBlocks) {
+        this->storeBlockSuccessorInCaseVar(context, builder, caseVar, block, blockCaseIdxs);
+        this->branchToDispatcher(builder, block, switchLoop);
+      }
+
       // Remove instructions referenced in multiple blocks.
       // `DemoteRegToStack` replaces them with a slot in the stack frame
+      unsigned demotedNum = 0;
       for (auto &inst: getInstructionReferencedInMultipleBlocks(F)) {
-        DemoteRegToStack(*inst);
+        DebugLoc origin = inst->getDebugLoc();
+        this->tagDemotedSlot(provenance, DemoteRegToStack(*inst), origin);
+        demotedNum++;
       }
 
       // phi nodes are dependent on predecessors and their parent nodes cannot be simply replaced.
       // `DemotePHIToStack` replaces `phi` instruction with a slot in the stack frame
       for (auto &phiNode: getPHINodes(F)) {
-        DemotePHIToStack(phiNode);
+        DebugLoc origin = phiNode->getDebugLoc();
+        this->tagDemotedSlot(provenance, DemotePHIToStack(phiNode), origin);
+        demotedNum++;
       }
-      
+
+      this->tagDispatcher(provenance, F, caseVar, switchLoop);
+
       // Annotate switch for bogus flow pass
       this->annotateSwitchInst(F, switchLoop.switchInst);
 
+      if (FlattenProfile) {
+        DispatcherProfiler(FlattenProfileCycles).instrument(F, switchLoop.switchInst);
+      }
+
+      NumFunctionsFlattened++;
+      NumDispatchersFused += selector != nullptr;
+      NumInvokesFlattened += invokeNum;
+      NumBlocksFlattened += blockCaseIdxs.size();
+      NumSlotsDemoted += demotedNum;
+
+      ORE.emit([&]() {
+        OptimizationRemark remark(DEBUG_TYPE, "Flattened", &F);
+        remark << "flattened " << ore::NV("Blocks", (unsigned)blockCaseIdxs.size())
+          << " blocks, demoted " << ore::NV("DemotedSlots", demotedNum) << " values to stack slots";
+        if (invokeNum > 0) {
+          remark << ", dispatched the normal edges of " << ore::NV("Invokes", invokeNum) << " invokes";
+        }
+        return remark << (selector ? ", fused with the dispatcher of merged functions" : "");
+      });
+
       return PreservedAnalyses::none();
     }
 
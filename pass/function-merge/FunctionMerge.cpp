@@ -1,9 +1,13 @@
 #include <vector>
-#include <map>
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -12,6 +16,12 @@
 
 using namespace llvm;
 
+#define DEBUG_TYPE "function-merge"
+
+STATISTIC(NumFunctionsMerged, "Number of functions merged into a unified function");
+STATISTIC(NumCallsRewritten, "Number of calls redirected to a unified function");
+STATISTIC(NumFunctionsDeleted, "Number of merged functions deleted after redirecting their calls");
+
 namespace {
   struct FunctionInfo {
     int caseIdx;
@@ -22,13 +32,17 @@ namespace {
 
   struct MergedFunction {
     Function *mergedFunc;
-    std::map<Function *, FunctionInfo> targetFuncs;
+    MapVector<Function *, FunctionInfo> targetFuncs;
   };
 
   class FunctionMergePass : public PassInfoMixin<FunctionMergePass> {
   private:
     static constexpr const char *annotationName = "function-merge";
 
+    // Marks the dispatcher of a unified function, so that FlattenPass can start its own dispatcher
+    // from the selector argument instead of adding a second layer
+    const std::string mergeDispatchAnnotation = "function-merge-dispatch";
+
     // Parses annotated target functions
     std::vector<Function *> getTargetFunctions(Module &M) const {
       std::vector<Function *> annotatedFunctions;
@@ -71,7 +85,7 @@ namespace {
           continue;
         }
 
-        errs() << "[" << this->annotationName << "] Applying to: " << F.getName() << "\n";
+        LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] Applying to: " << F.getName() << "\n");
         annotatedFunctions.push_back(&F);
       }
 
@@ -89,8 +103,53 @@ namespace {
       return newFunc;
     }
 
+    // Creates a subprogram for the unified function if all target functions have debug info,
+    // the bodies of the targets are then inlined into it from the point of view of debug info
+    DISubprogram *createSubprogram(Module &M, Function *mergedFunc, std::vector<Function *> &targetFuncs) const {
+      bool hasDebugInfo = llvm::all_of(targetFuncs, [](Function *f) { return f->getSubprogram() != nullptr; });
+      if (!hasDebugInfo) {
+        return nullptr;
+      }
+
+      DISubprogram *targetSubprogram = targetFuncs.front()->getSubprogram();
+      DIFile *file = targetSubprogram->getFile();
+
+      DIBuilder builder(M, false, targetSubprogram->getUnit());
+      DISubprogram *subprogram = builder.createFunction(
+        file, mergedFunc->getName(), StringRef(), file, 0,
+        builder.createSubroutineType(builder.getOrCreateTypeArray(ArrayRef<Metadata *>())), 0,
+        DINode::FlagArtificial, DISubprogram::SPFlagDefinition | DISubprogram::SPFlagLocalToUnit
+      );
+
+      mergedFunc->setSubprogram(subprogram);
+      builder.finalizeSubprogram(subprogram);
+
+      return subprogram;
+    }
+
+    // Makes the debug locations of a cloned target body inlined into the unified function.
+    // They still point to the subprogram of the target, which is not the function they are in anymore
+    void inlineDebugLocations(Function *mergedFunc, Function::iterator begin, DISubprogram *subprogram) const {
+      LLVMContext &context = mergedFunc->getContext();
+
+      DILocation *inlinedAt = DILocation::get(context, 0, 0, subprogram);
+      DenseMap<const MDNode *, MDNode *> cache;
+
+      for (auto block = begin; block != mergedFunc->end(); block++) {
+        for (auto &instruction : *block) {
+          if (DebugLoc location = instruction.getDebugLoc()) {
+            instruction.setDebugLoc(DebugLoc::appendInlinedAt(location, inlinedAt, context, cache));
+          }
+
+          for (DbgRecord &record : instruction.getDbgRecordRange()) {
+            record.setDebugLoc(DebugLoc::appendInlinedAt(record.getDebugLoc(), inlinedAt, context, cache));
+          }
+        }
+      }
+    }
+
     // Creates a switch, which acts as a dispatcher component
-    SwitchInst* createSwitchCase(Function *mergedFunc) const {
+    SwitchInst* createSwitchCase(Function *mergedFunc, const Provenance &provenance) const {
       LLVMContext &context = mergedFunc->getContext();
 
       BasicBlock *entryBlock = BasicBlock::Create(context, "entry", mergedFunc);
@@ -99,10 +158,16 @@ namespace {
 
       SwitchInst *switchInst = builder.CreateSwitch(mergedFunc->getArg(0), nullptr);
 
+      MDNode *mdNode = MDNode::get(context, MDString::get(context, this->mergeDispatchAnnotation));
+      switchInst->setMetadata("annotation", MDNode::get(context, mdNode));
+
       BasicBlock *defaultBlock = BasicBlock::Create(context, "defaultSwitchBlock", mergedFunc);
-      ReturnInst::Create(context, defaultBlock);
+      ReturnInst *defaultReturn = ReturnInst::Create(context, defaultBlock);
       switchInst->setDefaultDest(defaultBlock);
 
+      provenance.tag(switchInst, "dispatch");
+      provenance.tag(defaultReturn, "dispatch");
+
       return switchInst;
     }
 
@@ -112,7 +177,8 @@ namespace {
       Function *mergedFunc,
       SwitchInst *switchInst,
       Function *func,
-      FunctionInfo &funcInfo
+      FunctionInfo &funcInfo,
+      const Provenance &provenance
     ) const {
       LLVMContext &context = mergedFunc->getContext();
 
@@ -133,12 +199,22 @@ namespace {
       AttributeList funcAttrs = func->getAttributes();
       func->setAttributes(AttributeList());
 
+      DISubprogram *subprogram = mergedFunc->getSubprogram();
+
       SmallVector<ReturnInst *, 8> returns;
       CloneFunctionInto(mergedFunc, func, vMap, CloneFunctionChangeType::LocalChangesOnly, returns);
 
       // Restore function attributes
       func->setAttributes(funcAttrs);
 
+      // Cloning also attaches the subprogram of the target
+      if (subprogram) {
+        mergedFunc->setSubprogram(subprogram);
+        this->inlineDebugLocations(mergedFunc, std::next(lastBlock->getIterator()), subprogram);
+      } else {
+        stripDebugInfo(*mergedFunc);
+      }
+
       auto clonedEntryBlock = lastBlock->getIterator()++;
       while (clonedEntryBlock != mergedFunc->end() && !clonedEntryBlock->hasNPredecessors(0)) {
         clonedEntryBlock++;
@@ -163,18 +239,49 @@ namespace {
 
         // Copy return value to the argument with a result pointer
         builder.SetInsertPoint(returnInst);
-        builder.CreateStore(returnValue, mergedFunc->getArg(funcInfo.argOffset));
-        builder.CreateRetVoid();
+        Value *returnStore = builder.CreateStore(returnValue, mergedFunc->getArg(funcInfo.argOffset));
+        Value *returnVoid = builder.CreateRetVoid();
+
+        provenance.tag(returnStore, "return-value", returnInst->getDebugLoc());
+        provenance.tag(returnVoid, "return-value", returnInst->getDebugLoc());
 
         returnInst->eraseFromParent();
       }
     }
 
+    // Annotates a unified function with the obfuscations all target functions share. `CloneFunctionInto` copies
+    // the annotations of every target, and only the first copy would count. The other annotations stay
+    // on the instructions of the targets, which the annotation pass tagged, and are applied as regions
+    void annotateMergedFunction(Function *mergedFunc, std::vector<Function *> &targetFuncs) const {
+      std::vector<Metadata *> shared;
+
+      if (auto *md = targetFuncs.front()->getMetadata("annotation")) {
+        for (auto &mdOperand : md->operands()) {
+          auto *mdNode = dyn_cast<MDNode>(mdOperand);
+          auto *mdString = mdNode ? dyn_cast<MDString>(mdNode->getOperand(0)) : nullptr;
+          if (!mdString || mdString->getString() == this->annotationName) {
+            continue;
+          }
+
+          bool isShared = llvm::all_of(targetFuncs, [&](Function *f) {
+            auto *targetMd = f->getMetadata("annotation");
+            return targetMd && llvm::is_contained(targetMd->operands(), mdNode);
+          });
+
+          if (isShared) {
+            shared.push_back(mdNode);
+          }
+        }
+      }
+
+      mergedFunc->setMetadata("annotation", shared.empty() ? nullptr : MDNode::get(mergedFunc->getContext(), shared));
+    }
+
     // A main function: merges target functions
-    MergedFunction merge(Module &M, std::vector<Function *> targetFuncs) const {
+    MergedFunction merge(Module &M, std::vector<Function *> targetFuncs, const Provenance &provenance) const {
       LLVMContext &context = M.getContext();
 
-      std::map<Function *, FunctionInfo> targetFuncsInfo;
+      MapVector<Function *, FunctionInfo> targetFuncsInfo;
 
       // Merged function args start with an integer (switch case variable)
       std::vector<Type *> argTypes = {Type::getInt32Ty(context)};
@@ -197,13 +304,16 @@ namespace {
       }
 
       auto mergedFunc = this->createVoidFunction(M, argTypes);
-      auto switchInst = this->createSwitchCase(mergedFunc);
+      this->createSubprogram(M, mergedFunc, targetFuncs);
+      auto switchInst = this->createSwitchCase(mergedFunc, provenance);
 
       for (auto &f : targetFuncs) {
         auto info = targetFuncsInfo[f];
-        this->addCase(mergedFunc, switchInst, f, info);
+        this->addCase(mergedFunc, switchInst, f, info, provenance);
       }
 
+      this->annotateMergedFunction(mergedFunc, targetFuncs);
+
       return {mergedFunc, targetFuncsInfo};
     }
 
@@ -248,8 +358,11 @@ namespace {
       func->removeDeadConstantUsers();
     }
 
-    // Replaces function uses to the calls of a unified function with corresponding arguments
-    void replaceFunctionUses(Function *mergedFunc, Function *func, FunctionInfo &funcInfo) const {
+    // Replaces function uses to the calls of a unified function with corresponding arguments.
+    // Returns the number of replaced calls
+    unsigned replaceFunctionUses(
+      Function *mergedFunc, Function *func, FunctionInfo &funcInfo, const Provenance &provenance
+    ) const {
       LLVMContext &context = mergedFunc->getContext();
       IRBuilder<> builder(context);
 
@@ -293,10 +406,17 @@ namespace {
           }
         }
 
-        builder.CreateCall(mergedFunc, args);
+        Value *mergedCall = builder.CreateCall(mergedFunc, args);
+        Value *resultLoad = !returnType->isVoidTy()
+          ? builder.CreateLoad(returnType, resultVar)
+          : nullptr;
+
+        for (auto *inst : {resultVar, mergedCall, resultLoad}) {
+          provenance.tag(inst, "argument-setup", callInst->getDebugLoc());
+        }
 
-        if (!returnType->isVoidTy()) {
-          callInst->replaceAllUsesWith(builder.CreateLoad(returnType, resultVar));
+        if (resultLoad) {
+          callInst->replaceAllUsesWith(resultLoad);
         }
 
         // Delete later to avoid modifying `uses()` iterator in the loop
@@ -306,6 +426,8 @@ namespace {
       for (auto &callInst : callInstToDelete) {
         callInst->eraseFromParent();
       }
+
+      return callInstToDelete.size();
     }
 
     // Verifies that function is not referenced and deleted it
@@ -323,6 +445,7 @@ namespace {
       }
 
       func->eraseFromParent();
+      NumFunctionsDeleted++;
     }
 
   public:
@@ -333,13 +456,27 @@ namespace {
         return PreservedAnalyses::all();
       }
 
-      auto [mergedFunc, targetFuncsInfoMap] = this->merge(M, targetFuncs);
+      Provenance provenance(M, FunctionMergePass::annotationName);
+
+      auto [mergedFunc, targetFuncsInfoMap] = this->merge(M, targetFuncs, provenance);
+
+      OptimizationRemarkEmitter ORE(mergedFunc);
 
       for (auto &[func, funcInfo] : targetFuncsInfoMap) {
-        this->replaceFunctionUses(mergedFunc, func, funcInfo);
+        unsigned callNum = this->replaceFunctionUses(mergedFunc, func, funcInfo, provenance);
+
+        ORE.emit([&]() {
+          return OptimizationRemark(DEBUG_TYPE, "Merged", mergedFunc)
+            << "merged " << ore::NV("Function", func) << " as case " << ore::NV("Case", funcInfo.caseIdx)
+            << ", redirected " << ore::NV("Calls", callNum) << " calls";
+        });
+
+        NumCallsRewritten += callNum;
         this->deleteFunctionIfNoUses(M, func);
       }
 
+      NumFunctionsMerged += targetFuncsInfoMap.size();
+
       return PreservedAnalyses::none();
     }
   };
@@ -1,21 +1,86 @@
+#include <cmath>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <set>
+#include <tuple>
 #include <vector>
-#include <cstdlib>
 
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/TargetParser/Triple.h"
 
 #include "BaseAnnotatedPass.cpp"
+#include "DispatcherProfile.cpp"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "mba"
+
+STATISTIC(NumAddsSubstituted, "Number of `x + y` instructions substituted");
+STATISTIC(NumComparisonsSubstituted, "Number of `x > 0` and `x == 0` comparisons substituted");
+STATISTIC(NumLoopInstsPreserved, "Number of induction, address, and loop exit instructions left intact");
+STATISTIC(NumSitesOutlined, "Number of substitutions that call an outlined expression");
+STATISTIC(NumOutlinedFunctions, "Number of outlined expressions defined");
+
+static cl::opt<bool> MBAPreserveLoops(
+  "mba-preserve-loops", cl::init(false),
+  cl::desc("Skip add-recurrences, address arithmetic, and loop exit conditions, so that loop optimizations still apply")
+);
+
+static cl::opt<double> MBACostExponent(
+  "mba-cost-exponent", cl::init(2.0),
+  cl::desc("Variants are chosen with probability proportional to cost^-exponent on the target, 0 chooses uniformly")
+);
+
+static cl::opt<bool> MBABalance(
+  "mba-balance", cl::init(true),
+  cl::desc("Emit the chains of associative operations in the expressions as depth-balanced trees")
+);
+
+static cl::opt<bool> MBAOutline(
+  "mba-outline", cl::init(false),
+  cl::desc("Call the expressions of cold instructions from internal functions, one per variant and type in a module, "
+           "instead of inlining every expression")
+);
+
+static cl::opt<double> MBAOutlineHot(
+  "mba-outline-hot", cl::init(8.0),
+  cl::desc("With -mba-outline, expressions stay inline in blocks that run at least this many times per call "
+           "of the function, or in the hot blocks of the profile if there is one")
+);
+
 namespace {
   class MBAPass : public BaseAnnotatedPass<MBAPass> {
   private:
     static constexpr const char *annotationName = "mba";
 
+    std::string getConfiguration() const override {
+      return formatv(
+        "cost-exponent={0}{1}{2}{3}", MBACostExponent, MBAPreserveLoops ? ",preserve-loops" : "",
+        MBABalance ? ",balance" : "",
+        MBAOutline ? formatv(",outline-hot={0}", MBAOutlineHot).str() : ""
+      );
+    }
+
     // x > 0 => (3 - ((x >> 31) ^ 1) ^ 2 == 0) && x != 0
     Value *insertXsgtZero_v1(IRBuilder<> &builder, Value* x) const {
-      errs() << "[" << this->annotationName << "] x > 0: v1\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x > 0: v1\n");
 
       Type *xType = x->getType();
       int shift;
@@ -24,7 +89,7 @@ namespace {
       } else if (xType->isIntegerTy(64)) {
         shift = 63;
       } else {
-        errs() << "[" << this->annotationName << "] Unknown operand type: " << xType << "\n";
+        LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] Unknown operand type: " << *xType << "\n");
         return nullptr;
       }
 
@@ -42,7 +107,7 @@ namespace {
 
     // x > 0 => (((x >> 16) ^ 0xCFD00FAA >> 14) & (1 << 1)) == 0) && x != 0
     Value *insertXsgtZero_v2(IRBuilder<> &builder, Value* x) const {
-      errs() << "[" << this->annotationName << "] x > 0: v2\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x > 0: v2\n");
 
       Type *xType = x->getType();
       int shift;
@@ -51,7 +116,7 @@ namespace {
       } else if (xType->isIntegerTy(64)) {
         shift = 48;
       } else {
-        errs() << "[" << this->annotationName << "] Unknown operand type: " << xType << "\n";
+        LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] Unknown operand type: " << *xType << "\n");
         return nullptr;
       }
 
@@ -71,7 +136,7 @@ namespace {
 
     // x == 0 => 56 ^ x ^ 72 = 112
     Value *insertXeqZero_v1(IRBuilder<> &builder, Value* x) const {
-      errs() << "[" << this->annotationName << "] x = 0: v1\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x = 0: v1\n");
 
       Type *xType = x->getType();
 
@@ -88,7 +153,7 @@ namespace {
 
     // x == 0 => 76 ^ ~(x ^ ~x) ^ 40 ^ x == 100
     Value *insertXeqZero_v2(IRBuilder<> &builder, Value* x) const {
-      errs() << "[" << this->annotationName << "] x = 0: v2\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x = 0: v2\n");
 
       Type *xType = x->getType();
 
@@ -109,7 +174,7 @@ namespace {
 
     // x == 0 => ((x >> 6) < 5001) && (x >= 0) && (((x << 2) ^ 3) - 3 == 0)
     Value *insertXeqZero_v3(IRBuilder<> &builder, Value* x) const {
-      errs() << "[" << this->annotationName << "] x = 0: v3\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x = 0: v3\n");
 
       Type *xType = x->getType();
 
@@ -135,7 +200,7 @@ namespace {
 
     // x == 0 => (x << 1) ^ x == 0
     Value *insertXeqZero_v4(IRBuilder<> &builder, Value* x) const {
-      errs() << "[" << this->annotationName << "] x = 0: v4\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x = 0: v4\n");
 
       Type *xType = x->getType();
 
@@ -150,7 +215,7 @@ namespace {
 
     // x + y => (x & y) + (y | x)
     Value *insertXaddY_v1(IRBuilder<> &builder, Value* x, Value* y) const {
-      errs() << "[" << this->annotationName << "] x + y: v1\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x + y: v1\n");
 
       Value *andXY = builder.CreateAnd(x, y);
       Value *orXY = builder.CreateOr(y, x);
@@ -161,7 +226,7 @@ namespace {
 
     // x + y => ((y | x) & (y | y)) + x
     Value *insertXaddY_v2(IRBuilder<> &builder, Value* x, Value* y) const {
-      errs() << "[" << this->annotationName << "] x + y: v2\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x + y: v2\n");
 
       Value *orYX = builder.CreateOr(y, x);
       Value *orYY = builder.CreateOr(y, y);
@@ -173,7 +238,7 @@ namespace {
 
     // x + y => (~(y | y) ^ y ^ ~x) + y
     Value *insertXaddY_v3(IRBuilder<> &builder, Value* x, Value* y) const {
-      errs() << "[" << this->annotationName << "] x + y: v3\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x + y: v3\n");
 
       Value *orYY = builder.CreateOr(y, y);
       Value *notOrYY = builder.CreateNot(orYY);
@@ -187,7 +252,7 @@ namespace {
 
     // x + y => y + ((y & x ^ ~y) & (x ^ y ^ y))
     Value *insertXaddY_v4(IRBuilder<> &builder, Value* x, Value* y) const {
-      errs() << "[" << this->annotationName << "] x + y: v4\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x + y: v4\n");
 
       Value *notY = builder.CreateNot(y);
       Value *andYX = builder.CreateAnd(y, x);
@@ -202,7 +267,7 @@ namespace {
 
     // x + y => (~y ^ x ^ y & y ^ (x | x) ^ ~(y & x | x ^ x)) + (~x ^ ~x | y | x | x | x)
     Value *insertXaddY_v5(IRBuilder<> &builder, Value* x, Value* y) const {
-      errs() << "[" << this->annotationName << "] x + y: v5\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x + y: v5\n");
 
       Value *notY = builder.CreateNot(y);
       Value *notX = builder.CreateNot(x);
@@ -233,7 +298,7 @@ namespace {
 
     // x + y => (x | (~x | ~x) & (y ^ y | y ^ y) ^ x & (~x ^ (y | x))) + y
     Value *insertXaddY_v6(IRBuilder<> &builder, Value* x, Value* y) const {
-      errs() << "[" << this->annotationName << "] x + y: v6\n";
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] x + y: v6\n");
 
       Value *notX = builder.CreateNot(x);
       Value *notX_or = builder.CreateOr(notX, notX);
@@ -255,19 +320,23 @@ namespace {
       return sum;
     }
 
-    // Randomizes MBA for `x > 0` (SGT, Signed Greater Than)
-    Value *pickAndInsertXsgtZero(IRBuilder<> &builder, Value *x) const {
-      switch (rand() % 2) {
+    // Number of variants of every operation, `insert*_v1` to `insert*_vN`
+    static constexpr unsigned xsgtZeroVariantNum = 2;
+    static constexpr unsigned xeqZeroVariantNum = 4;
+    static constexpr unsigned xaddYVariantNum = 6;
+
+    Value *insertXsgtZero(unsigned variant, IRBuilder<> &builder, Value *x) const {
+      switch (variant) {
         case 0:
           return this->insertXsgtZero_v1(builder, x);
         case 1:
           return this->insertXsgtZero_v2(builder, x);
       }
+      llvm_unreachable("unknown `x > 0` variant");
     }
 
-    // Randomizes MBA for `x == 0`
-    Value *pickAndInsertXeqZero(IRBuilder<> &builder, Value *x) const {
-      switch (rand() % 4) {
+    Value *insertXeqZero(unsigned variant, IRBuilder<> &builder, Value *x) const {
+      switch (variant) {
         case 0:
           return this->insertXeqZero_v1(builder, x);
         case 1:
@@ -277,11 +346,11 @@ namespace {
         case 3:
           return this->insertXeqZero_v4(builder, x);
       }
+      llvm_unreachable("unknown `x == 0` variant");
     }
 
-    // Randomizes MBA for `x + y`
-    Value *pickAndInsertXaddY(IRBuilder<> &builder, Value *x, Value *y) const {
-      switch (rand() % 6) {
+    Value *insertXaddY(unsigned variant, IRBuilder<> &builder, Value *x, Value *y) const {
+      switch (variant) {
         case 0:
           return this->insertXaddY_v1(builder, x, y);
         case 1:
@@ -295,6 +364,436 @@ namespace {
         case 5:
           return this->insertXaddY_v6(builder, x, y);
       }
+      llvm_unreachable("unknown `x + y` variant");
+    }
+
+    // Checks if the backend folds a `~x` into its users: `bic`, `orn`, and `eon` on AArch64,
+    // `andn` on x86 with BMI, and `pandn` for x86 vectors. TargetTransformInfo costs every instruction alone
+    bool isFusedNot(Instruction &inst) const {
+      if (!PatternMatch::match(&inst, PatternMatch::m_Not(PatternMatch::m_Value())) || inst.use_empty()) {
+        return false;
+      }
+
+      Function &F = *inst.getFunction();
+      Triple triple(F.getParent()->getTargetTriple());
+
+      bool andNot = triple.isAArch64() || (
+        triple.isX86() && (
+          inst.getType()->isVectorTy()
+          || F.getFnAttribute("target-features").getValueAsString().contains("+bmi")
+        )
+      );
+      bool orNot = triple.isAArch64();
+
+      for (User *user : inst.users()) {
+        auto *userInst = dyn_cast<Instruction>(user);
+        if (!userInst) {
+          return false;
+        }
+
+        unsigned opcode = userInst->getOpcode();
+        bool fused = (opcode == Instruction::And && andNot)
+          || ((opcode == Instruction::Or || opcode == Instruction::Xor) && orNot);
+        if (!fused) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    // Cost of a variant on the target of `F`: the latency of its critical path plus its reciprocal throughput,
+    // measured with TargetTransformInfo on a scratch copy after the simplifications the backend also does
+    // (e.g. `y | y` and `x ^ x`). Infinite if the variant doesn't support the type
+    double getVariantCost(
+      Function &F, const TargetTransformInfo &TTI, Type *type, unsigned operandNum,
+      function_ref<Value *(IRBuilder<> &, ArrayRef<Value *>)> insertVariant
+    ) const {
+      LLVMContext &context = F.getContext();
+      const DataLayout &DL = F.getParent()->getDataLayout();
+
+      BasicBlock *scratch = BasicBlock::Create(context, "mba.cost", &F);
+      IRBuilder<> builder(scratch);
+
+      // Opaque operands, so that the builder doesn't fold the variant into a constant
+      std::vector<Value *> operands;
+      for (unsigned i = 0; i < operandNum; i++) {
+        operands.push_back(builder.CreateFreeze(PoisonValue::get(type)));
+      }
+
+      WeakTrackingVH result = insertVariant(builder, operands);
+      double cost = std::numeric_limits<double>::infinity();
+
+      if (result) {
+        for (auto it = std::next(scratch->begin(), operandNum); it != scratch->end();) {
+          Instruction &inst = *it++;
+          if (Value *simplified = simplifyInstruction(&inst, SimplifyQuery(DL))) {
+            inst.replaceAllUsesWith(simplified);
+            inst.eraseFromParent();
+          }
+        }
+
+        std::map<Value *, double> depth;
+        double latency = 0;
+        double throughput = 0;
+
+        for (auto it = std::next(scratch->begin(), operandNum); it != scratch->end(); it++) {
+          Instruction &inst = *it;
+
+          double instLatency = 0;
+          double instThroughput = 0;
+          if (!this->isFusedNot(inst)) {
+            InstructionCost latencyCost = TTI.getInstructionCost(&inst, TargetTransformInfo::TCK_Latency);
+            InstructionCost throughputCost = TTI.getInstructionCost(&inst, TargetTransformInfo::TCK_RecipThroughput);
+            instLatency = latencyCost.isValid() ? *latencyCost.getValue() : 1;
+            instThroughput = throughputCost.isValid() ? *throughputCost.getValue() : 1;
+          }
+
+          double operandDepth = 0;
+          for (Value *operand : inst.operands()) {
+            auto found = depth.find(operand);
+            if (found != depth.end()) {
+              operandDepth = std::max(operandDepth, found->second);
+            }
+          }
+
+          depth[&inst] = operandDepth + instLatency;
+          latency = std::max(latency, depth[&inst]);
+          throughput += instThroughput;
+        }
+
+        // A variant that folds away entirely still costs the instruction it replaces
+        cost = std::max(latency + throughput, 1.0);
+      }
+
+      scratch->dropAllReferences();
+      scratch->eraseFromParent();
+
+      return cost;
+    }
+
+    // Relative probabilities of the variants of an operation on `type`, `cost ^ -exponent` (`-mba-cost-exponent`)
+    std::vector<double> getVariantWeights(
+      Function &F, const TargetTransformInfo &TTI, Type *type, unsigned variantNum, unsigned operandNum,
+      function_ref<Value *(unsigned, IRBuilder<> &, ArrayRef<Value *>)> insertVariant
+    ) const {
+      std::vector<double> weights;
+
+      for (unsigned variant = 0; variant < variantNum; variant++) {
+        double cost = this->getVariantCost(F, TTI, type, operandNum, [&](IRBuilder<> &builder, ArrayRef<Value *> operands) {
+          return insertVariant(variant, builder, operands);
+        });
+
+        weights.push_back(std::isinf(cost) ? 0 : std::pow(cost, -MBACostExponent));
+
+        LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] " << *type << " variant " << variant + 1
+          << ": cost " << cost << ", weight " << weights.back() << "\n");
+      }
+
+      return weights;
+    }
+
+    enum class Operation { XsgtZero, XeqZero, XaddY };
+
+    // Variant weights of every operation and type, computed once per function
+    using VariantWeights = std::map<std::pair<Operation, Type *>, std::vector<double>>;
+
+    const std::vector<double> &getWeights(
+      Function &F, const TargetTransformInfo &TTI, Operation operation, Type *type, VariantWeights &cache
+    ) const {
+      auto key = std::make_pair(operation, type);
+      auto it = cache.find(key);
+      if (it != cache.end()) {
+        return it->second;
+      }
+
+      unsigned variantNum = 0;
+      switch (operation) {
+        case Operation::XsgtZero:
+          variantNum = xsgtZeroVariantNum;
+          break;
+        case Operation::XeqZero:
+          variantNum = xeqZeroVariantNum;
+          break;
+        case Operation::XaddY:
+          variantNum = xaddYVariantNum;
+          break;
+      }
+
+      // Measured as emitted, balanced or not
+      std::vector<double> weights = this->getVariantWeights(F, TTI, type, variantNum, operation == Operation::XaddY ? 2 : 1,
+        [&](unsigned variant, IRBuilder<> &builder, ArrayRef<Value *> operands) {
+          return this->insertOperation(operation, variant, builder, operands);
+        });
+
+      return cache[key] = weights;
+    }
+
+    // Picks a variant with probability proportional to its weight, or returns the number of variants if none applies
+    unsigned pickVariant(const std::vector<double> &weights) const {
+      double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+      if (total <= 0) {
+        return weights.size();
+      }
+
+      // Uniform in [0, total), from the top 53 bits
+      double point = (this->random() >> 11) * 0x1.0p-53 * total;
+
+      for (unsigned variant = 0; variant < weights.size(); variant++) {
+        if (point < weights[variant]) {
+          return variant;
+        }
+        point -= weights[variant];
+      }
+
+      // Rounding, the last variant with a weight
+      unsigned variant = weights.size() - 1;
+      while (weights[variant] <= 0) {
+        variant--;
+      }
+      return variant;
+    }
+
+    // Name of an operation in provenance tags and outlined function names
+    static StringRef getOperationName(Operation operation) {
+      switch (operation) {
+        case Operation::XsgtZero:
+          return "x-sgt-zero";
+        case Operation::XeqZero:
+          return "x-eq-zero";
+        case Operation::XaddY:
+          return "x-add-y";
+      }
+      llvm_unreachable("unknown operation");
+    }
+
+    static std::optional<Operation> parseOperation(StringRef name) {
+      for (Operation operation : {Operation::XsgtZero, Operation::XeqZero, Operation::XaddY}) {
+        if (MBAPass::getOperationName(operation) == name) {
+          return operation;
+        }
+      }
+      return std::nullopt;
+    }
+
+    // Rebuilds the chains of an associative and commutative operation among the instructions in `[begin, end)`
+    // as depth-balanced trees (tree-height reduction): the two shallowest operands of a chain are combined first,
+    // so `((a | b) | c) | d` becomes `(a | b) | (c | d)`. The instructions of a variant are as many as before,
+    // while its critical path is shorter, and out-of-order cores overlap the rest
+    void balanceChains(BasicBlock::iterator begin, BasicBlock::iterator end) const {
+      std::vector<Instruction *> instructions;
+      for (auto it = begin; it != end; it++) {
+        instructions.push_back(&*it);
+      }
+
+      std::set<Instruction *> inserted(instructions.begin(), instructions.end());
+      std::map<Value *, unsigned> depth;
+
+      auto getDepth = [&](Value *value) {
+        auto it = depth.find(value);
+        return it != depth.end() ? it->second : 0;
+      };
+
+      // A link of the chain of `opcode`: an inserted instruction used only by the next link
+      auto isLink = [&](Value *value, unsigned opcode) {
+        auto *inst = dyn_cast<BinaryOperator>(value);
+        return inst && inserted.count(inst) && inst->getOpcode() == opcode && inst->hasOneUse();
+      };
+
+      for (auto *inst : instructions) {
+        unsigned instDepth = 0;
+        for (Value *operand : inst->operands()) {
+          instDepth = std::max(instDepth, getDepth(operand) + 1);
+        }
+        depth[inst] = instDepth;
+
+        // The last link of a chain is used by something else, or more than once
+        unsigned opcode = inst->getOpcode();
+        auto *user = inst->hasOneUse() ? dyn_cast<BinaryOperator>(inst->user_back()) : nullptr;
+        bool isRoot = isa<BinaryOperator>(inst) && inst->isAssociative() && inst->isCommutative() && !(
+          user && inserted.count(user) && user->getOpcode() == opcode
+        );
+        if (!isRoot) {
+          continue;
+        }
+
+        std::vector<Value *> leaves;
+        std::vector<Instruction *> links;
+        std::vector<Instruction *> worklist = {inst};
+
+        while (!worklist.empty()) {
+          Instruction *link = worklist.back();
+          worklist.pop_back();
+
+          for (Value *operand : link->operands()) {
+            if (isLink(operand, opcode)) {
+              links.push_back(cast<Instruction>(operand));
+              worklist.push_back(cast<Instruction>(operand));
+            } else {
+              leaves.push_back(operand);
+            }
+          }
+        }
+
+        if (leaves.size() < 3) {
+          continue;
+        }
+
+        // Shallowest first, in the order of the chain among equals
+        std::stable_sort(leaves.begin(), leaves.end(), [&](Value *a, Value *b) {
+          return getDepth(a) < getDepth(b);
+        });
+
+        IRBuilder<> builder(inst);
+        while (leaves.size() > 1) {
+          // Constants stay on the right, like in canonical IR
+          if (isa<Constant>(leaves[0])) {
+            std::swap(leaves[0], leaves[1]);
+          }
+
+          Value *combined = builder.CreateBinOp((Instruction::BinaryOps)opcode, leaves[0], leaves[1]);
+          depth[combined] = std::max(getDepth(leaves[0]), getDepth(leaves[1])) + 1;
+          if (auto *combinedInst = dyn_cast<Instruction>(combined)) {
+            inserted.insert(combinedInst);
+          }
+
+          leaves.erase(leaves.begin(), leaves.begin() + 2);
+          auto position = std::upper_bound(leaves.begin(), leaves.end(), combined, [&](Value *a, Value *b) {
+            return getDepth(a) < getDepth(b);
+          });
+          leaves.insert(position, combined);
+        }
+
+        inst->replaceAllUsesWith(leaves[0]);
+        inserted.erase(inst);
+        inst->eraseFromParent();
+
+        // Every link is used by the one before it
+        for (auto *link : links) {
+          inserted.erase(link);
+          link->eraseFromParent();
+        }
+      }
+    }
+
+    // Inserts a variant of `operation`, nullptr if there is no such variant or it doesn't support the operand type
+    Value *insertOperation(Operation operation, unsigned variant, IRBuilder<> &builder, ArrayRef<Value *> operands) const {
+      BasicBlock *block = builder.GetInsertBlock();
+      BasicBlock::iterator end = builder.GetInsertPoint();
+      Instruction *previous = end != block->begin() ? &*std::prev(end) : nullptr;
+
+      WeakTrackingVH result;
+      switch (operation) {
+        case Operation::XsgtZero:
+          result = variant < xsgtZeroVariantNum ? this->insertXsgtZero(variant, builder, operands[0]) : nullptr;
+          break;
+        case Operation::XeqZero:
+          result = variant < xeqZeroVariantNum ? this->insertXeqZero(variant, builder, operands[0]) : nullptr;
+          break;
+        case Operation::XaddY:
+          result = variant < xaddYVariantNum ? this->insertXaddY(variant, builder, operands[0], operands[1]) : nullptr;
+          break;
+      }
+
+      if (result && MBABalance) {
+        this->balanceChains(previous ? std::next(previous->getIterator()) : block->begin(), end);
+      }
+
+      return result;
+    }
+
+    // Outlined expressions are named `obf.mba.<operation>.v<variant>.<type>`
+    static constexpr const char *outlinedPrefix = "obf.mba.";
+
+    // Defines an outlined expression: a small internal function with the fast calling convention,
+    // shared by the cold sites of a module. Returns false if the variant doesn't support the type
+    bool defineOutlinedFunction(Function &func, Operation operation, unsigned variant) const {
+      func.setLinkage(GlobalValue::InternalLinkage);
+      func.setCallingConv(CallingConv::Fast);
+      func.setDoesNotAccessMemory();
+      func.addFnAttr(Attribute::NoInline);
+      func.addFnAttr(Attribute::NoUnwind);
+      func.addFnAttr(Attribute::WillReturn);
+      func.addFnAttr(Attribute::OptimizeForSize);
+      func.addFnAttr(Attribute::MinSize);
+
+      BasicBlock *entry = BasicBlock::Create(func.getContext(), "entry", &func);
+      IRBuilder<> builder(entry);
+
+      std::vector<Value *> operands;
+      for (auto &arg : func.args()) {
+        operands.push_back(&arg);
+      }
+
+      Value *result = this->insertOperation(operation, variant, builder, operands);
+      if (!result) {
+        entry->eraseFromParent();
+        return false;
+      }
+
+      Instruction *ret = builder.CreateRet(result);
+      Provenance(*func.getParent(), MBAPass::annotationName).tag(
+        entry->begin(), ret->getIterator(), MBAPass::getOperationName(operation)
+      );
+
+      NumOutlinedFunctions++;
+      LLVM_DEBUG(dbgs() << "[" << this->annotationName << "] Outlined: " << func.getName() << "\n");
+      return true;
+    }
+
+    // Name of the outlined expression of a variant on `type`
+    static std::string getOutlinedName(Operation operation, unsigned variant, Type *type) {
+      std::string typeName;
+      raw_string_ostream(typeName) << *type;
+
+      return formatv(
+        "{0}{1}.v{2}.{3}", MBAPass::outlinedPrefix, MBAPass::getOperationName(operation), variant + 1, typeName
+      );
+    }
+
+    // Outlined expression of a variant on `type`, or nullptr if the module doesn't define it.
+    // Function passes must not add functions to the module, the helpers are defined by `defineOutlinedFunctions`
+    Function *getOutlinedFunction(Module &M, Operation operation, unsigned variant, Type *type) const {
+      Function *func = M.getFunction(MBAPass::getOutlinedName(operation, variant, type));
+      return func && !func->isDeclaration() ? func : nullptr;
+    }
+
+    // A function from the cache calls outlined expressions of the module it was obfuscated in.
+    // Their names are all it takes to define them again
+    void restoreCachedFunction(Function &F) const override {
+      for (auto &inst : instructions(F)) {
+        auto *call = dyn_cast<CallBase>(&inst);
+        Function *callee = call ? call->getCalledFunction() : nullptr;
+
+        StringRef name = callee ? callee->getName() : "";
+        if (!callee || !callee->isDeclaration() || !name.consume_front(MBAPass::outlinedPrefix)) {
+          continue;
+        }
+
+        auto [operationName, rest] = name.split('.');
+        StringRef variantName = rest.split('.').first;
+        auto operation = MBAPass::parseOperation(operationName);
+
+        unsigned variant = 0;
+        if (!operation || !variantName.consume_front("v") || variantName.getAsInteger(10, variant) || variant == 0) {
+          errs() << "[" << this->annotationName << "] ERROR: Unknown outlined expression: " << callee->getName() << "\n";
+          throw std::runtime_error("Unknown outlined expression");
+        }
+
+        if (!this->defineOutlinedFunction(*callee, *operation, variant - 1)) {
+          errs() << "[" << this->annotationName << "] ERROR: Variant doesn't support the type: " << callee->getName() << "\n";
+          throw std::runtime_error("Outlined MBA variant doesn't support the type");
+        }
+      }
+    }
+
+    // Checks if the expressions of a block stay inline with `-mba-outline`: the hot blocks of the profile,
+    // or blocks that run at least `-mba-outline-hot` times per call without one
+    bool isHotBlock(BasicBlock &block, BlockFrequencyInfo &BFI, ProfileSummaryInfo *PSI) const {
+      if (PSI && PSI->hasProfileSummary()) {
+        return PSI->isHotBlock(&block, &BFI);
+      }
+      return BFI.getBlockFreqRelativeToEntryBlock(&block) >= MBAOutlineHot;
     }
 
     // Checks if instruction is `x > 0` (SGT)
@@ -322,31 +821,202 @@ namespace {
       return inst.getOpcode() == Instruction::Add;
     }
 
-    PreservedAnalyses applyPass(Function &F) const override {
+    // Operation that an instruction computes, if MBA substitutes it
+    std::optional<Operation> getOperation(Instruction &inst) const {
+      if (auto icmpInst = dyn_cast<ICmpInst>(&inst)) {
+        if (this->isXsgtZero(icmpInst)) {
+          return Operation::XsgtZero;
+        }
+        if (this->isXeqZero(icmpInst)) {
+          return Operation::XeqZero;
+        }
+        return std::nullopt;
+      }
+
+      if (this->isXaddY(inst)) {
+        return Operation::XaddY;
+      }
+      return std::nullopt;
+    }
+
+    // Checks if the value is used as a GEP index, possibly through casts and other index arithmetic
+    bool feedsAddress(Instruction &inst) const {
+      const unsigned maxDepth = 4;
+
+      std::vector<std::pair<Instruction *, unsigned>> worklist = {{&inst, 0}};
+      std::set<Instruction *> visited;
+
+      while (!worklist.empty()) {
+        auto [current, depth] = worklist.back();
+        worklist.pop_back();
+
+        if (!visited.insert(current).second) {
+          continue;
+        }
+
+        for (User *user : current->users()) {
+          auto *userInst = dyn_cast<Instruction>(user);
+          if (!userInst) {
+            continue;
+          }
+
+          if (isa<GetElementPtrInst>(userInst)) {
+            return true;
+          }
+
+          bool isIndexArithmetic = isa<CastInst>(userInst) || (
+            userInst->getType()->isIntegerTy() && (
+              userInst->getOpcode() == Instruction::Add
+              || userInst->getOpcode() == Instruction::Sub
+              || userInst->getOpcode() == Instruction::Mul
+              || userInst->getOpcode() == Instruction::Shl
+              || userInst->getOpcode() == Instruction::And
+            )
+          );
+
+          if (isIndexArithmetic && depth < maxDepth) {
+            worklist.push_back({userInst, depth + 1});
+          }
+        }
+      }
+
+      return false;
+    }
+
+    // Collects instructions that ScalarEvolution relies on: add-recurrences (induction variables and values
+    // derived from them), address arithmetic, and comparisons that control loop exits.
+    // Computed before any rewriting, while the analyses are still valid
+    std::set<Instruction *> getLoopInstructions(Function &F, ScalarEvolution &SE, LoopInfo &LI) const {
+      std::set<Instruction *> loopInstructions;
+
+      for (auto &block : F) {
+        Loop *loop = LI.getLoopFor(&block);
+
+        if (loop && loop->isLoopExiting(&block)) {
+          if (auto *branch = dyn_cast<BranchInst>(block.getTerminator())) {
+            if (branch->isConditional()) {
+              if (auto *condition = dyn_cast<ICmpInst>(branch->getCondition())) {
+                loopInstructions.insert(condition);
+              }
+            }
+          }
+        }
+
+        for (auto &instruction : block) {
+          if (!this->isXaddY(instruction)) {
+            continue;
+          }
+
+          if (SE.isSCEVable(instruction.getType()) && isa<SCEVAddRecExpr>(SE.getSCEV(&instruction))) {
+            loopInstructions.insert(&instruction);
+          } else if (this->feedsAddress(instruction)) {
+            loopInstructions.insert(&instruction);
+          }
+        }
+      }
+
+      return loopInstructions;
+    }
+
+    PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const override {
       LLVMContext &context = F.getContext();
       IRBuilder<> builder(context);
 
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+      VariantWeights weights;
+      Provenance provenance(*F.getParent(), MBAPass::annotationName);
+
       std::vector<Instruction *> instToDelete;
+      unsigned addNum = 0;
+      unsigned comparisonNum = 0;
+      unsigned outlinedNum = 0;
+      unsigned missingNum = 0;
+
+      // Block frequencies select the sites that stay inline with `-mba-outline`
+      BlockFrequencyInfo *BFI = MBAOutline ? &FAM.getResult<BlockFrequencyAnalysis>(F) : nullptr;
+      ProfileSummaryInfo *PSI = FAM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+        .getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+
+      std::set<Instruction *> loopInstructions;
+      if (MBAPreserveLoops) {
+        loopInstructions = this->getLoopInstructions(
+          F, FAM.getResult<ScalarEvolutionAnalysis>(F), FAM.getResult<LoopAnalysis>(F)
+        );
+        NumLoopInstsPreserved += loopInstructions.size();
+      }
 
       for (auto &block : F) {
         for (auto &instruction : block) {
+          // Profiling counters must stay cheap and exact
+          if (DispatcherProfiler::isInstrumentation(instruction)) {
+            continue;
+          }
+
+          if (loopInstructions.count(&instruction)) {
+            continue;
+          }
+
+          // Only the annotated regions of a function that is not annotated itself
+          if (!this->isAnnotated(instruction)) {
+            continue;
+          }
+
+          // Fewer substitutions within a compile-time budget, see `getIntensity`
+          if (this->getIntensity() < 1 && (this->random() >> 11) * 0x1.0p-53 >= this->getIntensity()) {
+            continue;
+          }
+
           builder.SetInsertPoint(&instruction);
+          Instruction *previous = instruction.getPrevNode();
+
+          std::optional<Operation> operation = this->getOperation(instruction);
+          if (!operation) {
+            continue;
+          }
+
+          std::vector<Value *> operands = {instruction.getOperand(0)};
+          if (*operation == Operation::XaddY) {
+            operands.push_back(instruction.getOperand(1));
+          }
 
+          Type *type = operands[0]->getType();
+          const std::vector<double> &variantWeights = this->getWeights(F, TTI, *operation, type, weights);
+          unsigned variant = this->pickVariant(variantWeights);
           Value *mba = nullptr;
-          
-          if (auto icmpInst = dyn_cast<ICmpInst>(&instruction)) {
-            if (this->isXsgtZero(icmpInst)) {
-              mba = this->pickAndInsertXsgtZero(builder, icmpInst->getOperand(0));
-            } else if (this->isXeqZero(icmpInst)) {
-              mba = this->pickAndInsertXeqZero(builder, icmpInst->getOperand(0));
+
+          // Cold sites call the expression, shared by the whole module
+          Function *outlined = nullptr;
+          if (BFI && variant < variantWeights.size() && !this->isHotBlock(block, *BFI, PSI)) {
+            outlined = this->getOutlinedFunction(*F.getParent(), *operation, variant, type);
+            if (!outlined) {
+              missingNum++;
             }
-          } else if (this->isXaddY(instruction)) {
-            mba = this->pickAndInsertXaddY(builder, instruction.getOperand(0), instruction.getOperand(1));
+          }
+
+          if (outlined) {
+            CallInst *call = builder.CreateCall(outlined, operands);
+            call->setCallingConv(CallingConv::Fast);
+            mba = call;
+            outlinedNum++;
+          } else {
+            mba = this->insertOperation(*operation, variant, builder, operands);
           }
 
           if (mba != nullptr) {
+            provenance.tag(
+              previous ? std::next(previous->getIterator()) : block.begin(), instruction.getIterator(),
+              MBAPass::getOperationName(*operation), instruction.getDebugLoc()
+            );
+
             instruction.replaceAllUsesWith(mba);
             instToDelete.push_back(&instruction);
+
+            if (isa<ICmpInst>(&instruction)) {
+              comparisonNum++;
+            } else {
+              addNum++;
+            }
           }
         }
       }
@@ -355,11 +1025,117 @@ namespace {
         inst->eraseFromParent();
       }
 
+      NumAddsSubstituted += addNum;
+      NumComparisonsSubstituted += comparisonNum;
+      NumSitesOutlined += outlinedNum;
+
+      ORE.emit([&]() {
+        OptimizationRemark remark(DEBUG_TYPE, "Substituted", &F);
+        remark << "substituted " << ore::NV("Adds", addNum) << " additions and "
+          << ore::NV("Comparisons", comparisonNum) << " comparisons with MBA expressions, ";
+        if (MBAOutline) {
+          remark << "called " << ore::NV("Outlined", outlinedNum) << " of them from outlined functions, ";
+        }
+        return remark << "left " << ore::NV("LoopInstructions", (unsigned)loopInstructions.size())
+          << " loop instructions intact";
+      });
+
+      if (missingNum > 0) {
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "NoOutlinedExpression", &F)
+            << "inlined " << ore::NV("Sites", missingNum) << " cold expressions, the module doesn't define "
+            << "their outlined functions (run module(mba-helpers) before the function passes)";
+        });
+      }
+
       return PreservedAnalyses::none();
     }
 
   public:
     MBAPass() : BaseAnnotatedPass(MBAPass::annotationName) {}
+
+    // Defines the outlined expressions that `-mba-outline` calls: every variant that may be picked on the target,
+    // for each operation and type in the annotated code of the module. Unused ones are left to `globaldce`
+    bool defineOutlinedFunctions(Module &M, FunctionAnalysisManager &FAM) const {
+      // First function with each operation and type, in module order
+      std::vector<std::tuple<Function *, Operation, Type *>> uses;
+      std::set<std::pair<Operation, Type *>> seen;
+
+      for (auto &F : M) {
+        if (F.isDeclaration()) {
+          continue;
+        }
+
+        bool wholeFunction = BaseAnnotatedPass::hasFunctionAnnotation(F, MBAPass::annotationName);
+
+        for (auto &inst : instructions(F)) {
+          if (!wholeFunction && !BaseAnnotatedPass::hasAnnotation(inst, MBAPass::annotationName)) {
+            continue;
+          }
+
+          std::optional<Operation> operation = this->getOperation(inst);
+          if (!operation) {
+            continue;
+          }
+
+          Type *type = inst.getOperand(0)->getType();
+          if (seen.insert({*operation, type}).second) {
+            uses.push_back({&F, *operation, type});
+          }
+        }
+      }
+
+      bool changed = false;
+
+      for (auto &[F, operation, type] : uses) {
+        VariantWeights weights;
+        const std::vector<double> &variantWeights = this->getWeights(
+          *F, FAM.getResult<TargetIRAnalysis>(*F), operation, type, weights
+        );
+
+        for (unsigned variant = 0; variant < variantWeights.size(); variant++) {
+          std::string name = MBAPass::getOutlinedName(operation, variant, type);
+          if (variantWeights[variant] <= 0 || M.getFunction(name)) {
+            continue;
+          }
+
+          Type *resultType = operation == Operation::XaddY ? type : CmpInst::makeCmpResultType(type);
+          std::vector<Type *> paramTypes(operation == Operation::XaddY ? 2 : 1, type);
+
+          Function *func = Function::Create(
+            FunctionType::get(resultType, paramTypes, false), GlobalValue::InternalLinkage, name, M
+          );
+
+          if (!this->defineOutlinedFunction(*func, operation, variant)) {
+            func->eraseFromParent();
+            continue;
+          }
+          changed = true;
+        }
+      }
+
+      return changed;
+    }
+  };
+
+  // Defines the outlined expressions of `-mba-outline` before the function passes run,
+  // since a function pass must not add functions to the module
+  class MBAHelpersPass : public PassInfoMixin<MBAHelpersPass> {
+  public:
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) const {
+      if (!MBAOutline) {
+        return PreservedAnalyses::all();
+      }
+
+      auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+      if (!MBAPass().defineOutlinedFunctions(M, FAM)) {
+        return PreservedAnalyses::all();
+      }
+
+      PreservedAnalyses PA;
+      PA.preserveSet<AllAnalysesOn<Function>>();
+      return PA;
+    }
   };
 } // namespace
 
@@ -382,6 +1158,19 @@ PassPluginLibraryInfo getMBAPassPluginInfo() {
           return false;
         }
       );
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          ModulePassManager &MPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "mba-helpers") {
+            MPM.addPass(MBAHelpersPass());
+            return true;
+          }
+          return false;
+        }
+      );
     }
   };
 }
@@ -0,0 +1,619 @@
+#include <cstdlib>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "OpaqueValue.cpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "policy"
+
+STATISTIC(NumFunctionsSelected, "Number of functions annotated by the policy");
+STATISTIC(NumSensitiveFunctions, "Number of functions matched as security-relevant");
+STATISTIC(NumHotFunctions, "Number of functions classified as hot");
+
+static cl::opt<std::string> PolicyFile(
+  "policy-file", cl::init(""),
+  cl::desc("JSON rules of the selection policy, the built-in policy if not set")
+);
+
+static cl::opt<std::string> PolicyReport(
+  "policy-report", cl::init(""),
+  cl::desc("Write the tier chosen for every function and the reasons to a JSON file")
+);
+
+// Built-in policy: security-relevant functions, recognized by the words of their names, get every obfuscation
+// unless they are hot, then only the cheap ones (bogus branches outside of innermost loops and MBA).
+// Inline functions and template instances (`linkonce_odr`, `weak_odr`), most of them from libraries, and other
+// functions are left to the source annotations
+static constexpr const char *defaultPolicy = R"({
+  "tiers": {
+    "full": ["flatten", "bogus-switch", "mba"],
+    "cheap": ["bogus-branch", "mba"],
+    "none": []
+  },
+  "hot": 256,
+  "cold": 16,
+  "sensitive": {"cold": "full", "warm": "full", "hot": "cheap"},
+  "other": {"cold": "none", "warm": "none", "hot": "none"},
+  "rules": [
+    {"linkage": "^(linkonce|weak)_odr$", "tier": "none"},
+    {"word": "auth(n|z|enticat[a-z]*|ori[sz][a-z]*)?|check|verif[a-z]*|valid(at[a-z]*)?|licen[cs][a-z]*|passw[a-z]*|secrets?|keys?|(en|de)?crypt[a-z]*|tokens?|sign(ed|ature|atures)?|serial|integrity"}
+  ]
+})";
+
+namespace {
+  // Functions matching all given patterns either get a fixed tier or are classified as (in)sensitive
+  struct PolicyRule {
+    std::string description;
+    std::optional<Regex> name;
+    std::optional<Regex> word;
+    std::optional<Regex> section;
+    std::optional<Regex> linkage;
+    std::optional<std::string> tier;
+    bool sensitive;
+
+    // Words of the base name of a function, lowercase: `_ZN3app12checkLicenseEv` has "check" and "license".
+    // Names are split at underscores, digits, and case changes
+    static std::vector<std::string> getWords(const Function &F) {
+      std::string name = F.getName().str();
+
+      ItaniumPartialDemangler demangler;
+      if (!demangler.partialDemangle(name.c_str())) {
+        if (char *baseName = demangler.getFunctionBaseName(nullptr, nullptr)) {
+          name = baseName;
+          std::free(baseName);
+        }
+      }
+
+      std::vector<std::string> words;
+      std::string word;
+
+      for (size_t i = 0; i < name.size(); i++) {
+        char c = name[i];
+        if (!isAlpha(c)) {
+          if (!word.empty()) {
+            words.push_back(word);
+          }
+          word.clear();
+          continue;
+        }
+
+        // `camelCase` and `AESKey`: an uppercase letter after a lowercase one, or before one in a run of capitals
+        bool nextLower = i + 1 < name.size() && isLower(name[i + 1]);
+        if (isUpper(c) && !word.empty() && (isLower(name[i - 1]) || nextLower)) {
+          words.push_back(word);
+          word.clear();
+        }
+        word += toLower(c);
+      }
+
+      if (!word.empty()) {
+        words.push_back(word);
+      }
+      return words;
+    }
+
+    static StringRef getLinkageName(const Function &F) {
+      switch (F.getLinkage()) {
+        case GlobalValue::ExternalLinkage: return "external";
+        case GlobalValue::AvailableExternallyLinkage: return "available_externally";
+        case GlobalValue::LinkOnceAnyLinkage: return "linkonce";
+        case GlobalValue::LinkOnceODRLinkage: return "linkonce_odr";
+        case GlobalValue::WeakAnyLinkage: return "weak";
+        case GlobalValue::WeakODRLinkage: return "weak_odr";
+        case GlobalValue::AppendingLinkage: return "appending";
+        case GlobalValue::InternalLinkage: return "internal";
+        case GlobalValue::PrivateLinkage: return "private";
+        case GlobalValue::ExternalWeakLinkage: return "extern_weak";
+        case GlobalValue::CommonLinkage: return "common";
+      }
+      llvm_unreachable("unknown linkage");
+    }
+
+    bool matches(const Function &F) const {
+      if (this->name && !this->name->match(F.getName())) {
+        return false;
+      }
+      if (this->word && llvm::none_of(getWords(F), [&](const std::string &word) { return this->word->match(word); })) {
+        return false;
+      }
+      if (this->section && !this->section->match(F.hasSection() ? F.getSection() : "")) {
+        return false;
+      }
+      if (this->linkage && !this->linkage->match(getLinkageName(F))) {
+        return false;
+      }
+      return true;
+    }
+  };
+
+  enum class Hotness { Cold, Warm, Hot };
+
+  struct Selection {
+    std::string tier;
+    std::vector<std::string> annotations;
+    Hotness hotness;
+    double executions;
+    bool sensitive;
+    std::string reason;
+  };
+
+  class Policy {
+  private:
+    std::map<std::string, std::vector<std::string>> tiers;
+    std::map<std::string, std::string> sensitiveTiers;
+    std::map<std::string, std::string> otherTiers;
+    std::vector<PolicyRule> rules;
+    double hotThreshold = 0;
+    double coldThreshold = 0;
+
+    [[noreturn]] static void fail(const Twine &message) {
+      errs() << "[policy] ERROR: " << message << "\n";
+      throw std::runtime_error(message.str());
+    }
+
+    static Regex compile(StringRef pattern) {
+      Regex regex(pattern, Regex::IgnoreCase);
+
+      std::string error;
+      if (!regex.isValid(error)) {
+        fail("invalid pattern '" + pattern + "': " + error);
+      }
+
+      return regex;
+    }
+
+    void checkTier(StringRef tier) const {
+      if (!this->tiers.count(tier.str())) {
+        fail("unknown tier '" + tier + "'");
+      }
+    }
+
+    // Fills the settings present in `object`, the others keep their values
+    void merge(const json::Object &object) {
+      if (auto *tiers = object.getObject("tiers")) {
+        for (auto &[name, annotations] : *tiers) {
+          auto *array = annotations.getAsArray();
+          if (!array) {
+            fail("tier '" + name.str() + "' must be an array of annotations");
+          }
+
+          auto &tier = this->tiers[name.str()];
+          tier.clear();
+          for (auto &annotation : *array) {
+            if (auto string = annotation.getAsString()) {
+              tier.push_back(string->str());
+            }
+          }
+        }
+      }
+
+      if (auto hot = object.getNumber("hot")) {
+        this->hotThreshold = *hot;
+      }
+      if (auto cold = object.getNumber("cold")) {
+        this->coldThreshold = *cold;
+      }
+
+      for (auto [key, tiers] : {
+        std::pair{"sensitive", &this->sensitiveTiers},
+        std::pair{"other", &this->otherTiers},
+      }) {
+        if (auto *byHotness = object.getObject(key)) {
+          for (auto &[hotness, tier] : *byHotness) {
+            if (auto string = tier.getAsString()) {
+              (*tiers)[hotness.str()] = string->str();
+            }
+          }
+        }
+      }
+
+      if (auto *rules = object.getArray("rules")) {
+        this->rules.clear();
+
+        for (auto &value : *rules) {
+          auto *rule = value.getAsObject();
+          if (!rule) {
+            fail("rules must be objects");
+          }
+
+          PolicyRule parsed;
+          std::string description;
+          raw_string_ostream os(description);
+
+          ListSeparator separator;
+          if (auto name = rule->getString("name")) {
+            parsed.name = compile(*name);
+            os << separator << "name ~ " << *name;
+          }
+          // A whole word of the name, the pattern is anchored
+          if (auto word = rule->getString("word")) {
+            parsed.word = compile(("^(" + *word + ")$").str());
+            os << separator << "word ~ " << *word;
+          }
+          if (auto section = rule->getString("section")) {
+            parsed.section = compile(*section);
+            os << separator << "section ~ " << *section;
+          }
+          if (auto linkage = rule->getString("linkage")) {
+            parsed.linkage = compile(*linkage);
+            os << separator << "linkage ~ " << *linkage;
+          }
+          if (auto tier = rule->getString("tier")) {
+            parsed.tier = tier->str();
+          }
+          parsed.sensitive = rule->getBoolean("sensitive").value_or(true);
+          parsed.description = os.str();
+
+          this->rules.push_back(std::move(parsed));
+        }
+      }
+    }
+
+    static void mergeText(Policy &policy, StringRef text, StringRef source) {
+      Expected<json::Value> value = json::parse(text);
+      if (!value) {
+        fail(source + ": " + toString(value.takeError()));
+      }
+
+      auto *object = value->getAsObject();
+      if (!object) {
+        fail(source + ": the policy must be a JSON object");
+      }
+
+      policy.merge(*object);
+    }
+
+  public:
+    // The built-in policy, with the settings of `path` on top of it
+    static Policy load(StringRef path) {
+      Policy policy;
+      mergeText(policy, defaultPolicy, "built-in policy");
+
+      if (!path.empty()) {
+        auto buffer = MemoryBuffer::getFile(path);
+        if (!buffer) {
+          fail("cannot read " + path + ": " + buffer.getError().message());
+        }
+        mergeText(policy, (*buffer)->getBuffer(), path);
+      }
+
+      for (auto *tiers : {&policy.sensitiveTiers, &policy.otherTiers}) {
+        for (auto &[hotness, tier] : *tiers) {
+          policy.checkTier(tier);
+        }
+      }
+      for (auto &rule : policy.rules) {
+        if (rule.tier) {
+          policy.checkTier(*rule.tier);
+        }
+      }
+
+      return policy;
+    }
+
+    Hotness classify(double executions) const {
+      if (executions >= this->hotThreshold) {
+        return Hotness::Hot;
+      }
+      return executions <= this->coldThreshold ? Hotness::Cold : Hotness::Warm;
+    }
+
+    static StringRef getName(Hotness hotness) {
+      switch (hotness) {
+        case Hotness::Cold: return "cold";
+        case Hotness::Warm: return "warm";
+        case Hotness::Hot: return "hot";
+      }
+      llvm_unreachable("unknown hotness");
+    }
+
+    Selection select(const Function &F, Hotness hotness, double executions) const {
+      Selection selection = {"", {}, hotness, executions, false, ""};
+      std::string matchedRule = "no rule matched";
+
+      for (unsigned i = 0; i < this->rules.size(); i++) {
+        auto &rule = this->rules[i];
+        if (!rule.matches(F)) {
+          continue;
+        }
+
+        if (rule.tier) {
+          selection.tier = *rule.tier;
+          selection.reason = formatv("tier set by rule {0}: {1}", i + 1, rule.description);
+          selection.annotations = this->tiers.at(selection.tier);
+          return selection;
+        }
+
+        selection.sensitive = rule.sensitive;
+        matchedRule = formatv("rule {0}: {1}", i + 1, rule.description);
+        break;
+      }
+
+      auto &byHotness = selection.sensitive ? this->sensitiveTiers : this->otherTiers;
+      auto it = byHotness.find(getName(hotness).str());
+      selection.tier = it != byHotness.end() ? it->second : "none";
+      selection.annotations = this->tiers.count(selection.tier) ? this->tiers.at(selection.tier) : std::vector<std::string>();
+      selection.reason = formatv(
+        "{0} ({1}), {2}", selection.sensitive ? "security-relevant" : "not security-relevant",
+        matchedRule, getName(hotness)
+      );
+
+      return selection;
+    }
+  };
+
+  class PolicyPass : public PassInfoMixin<PolicyPass> {
+  private:
+    // Estimated executions of the hottest block of every function, per execution of the program entry points.
+    //
+    // Without a profile, invocation counts are propagated top-down through the call graph: a call site
+    // contributes the invocations of its caller multiplied by the static frequency of its block
+    // (loops count as several iterations). Calls within a recursive cycle are counted once
+    DenseMap<const Function *, double> estimateExecutions(Module &M, ModuleAnalysisManager &MAM) const {
+      auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+      auto &CG = MAM.getResult<CallGraphAnalysis>(M);
+
+      std::vector<std::vector<CallGraphNode *>> sccs;
+      for (auto it = scc_begin(&CG); !it.isAtEnd(); ++it) {
+        sccs.push_back(*it);
+      }
+
+      DenseMap<const Function *, double> invocations;
+      DenseMap<const Function *, double> executions;
+
+      // Bottom-up order reversed, callers come before callees
+      for (auto scc = sccs.rbegin(); scc != sccs.rend(); scc++) {
+        std::set<const Function *> sccFunctions;
+        for (auto *node : *scc) {
+          sccFunctions.insert(node->getFunction());
+        }
+
+        for (auto *node : *scc) {
+          Function *F = node->getFunction();
+          if (!F || F->isDeclaration()) {
+            continue;
+          }
+
+          // Entry points and functions called through pointers run at least once
+          double calls = invocations.lookup(F);
+          if (!F->hasLocalLinkage() || F->hasAddressTaken()) {
+            calls = std::max(calls, 1.0);
+          }
+
+          auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(*F);
+          double hottestBlock = 1;
+
+          for (auto &block : *F) {
+            double frequency = BFI.getBlockFreqRelativeToEntryBlock(&block);
+            hottestBlock = std::max(hottestBlock, frequency);
+
+            for (auto &inst : block) {
+              auto *call = dyn_cast<CallBase>(&inst);
+              Function *callee = call ? call->getCalledFunction() : nullptr;
+              if (!callee || callee->isDeclaration() || sccFunctions.count(callee)) {
+                continue;
+              }
+
+              invocations[callee] += calls * frequency;
+            }
+          }
+
+          executions[F] = calls * hottestBlock;
+        }
+      }
+
+      return executions;
+    }
+
+    static bool hasExplicitAnnotations(const Function &F) {
+      return F.getMetadata("annotation") != nullptr;
+    }
+
+    // Drops the obfuscations the passes can't apply to `F`, so that a broad rule doesn't break the build
+    static void dropInapplicable(const Function &F, Selection &selection) {
+      // `invoke` and landing pads are flattened, the pads of funclet-based exception handling (MSVC) are not
+      // `virtualize` supports no exception handling at all
+      bool hasFunclets = false;
+      bool hasExceptionHandling = false;
+      for (auto &block : F) {
+        hasFunclets |= block.isEHPad() && !block.isLandingPad();
+        hasExceptionHandling |= block.isEHPad() || isa<InvokeInst>(block.getTerminator());
+      }
+
+      std::vector<std::string> applicable;
+      for (auto &annotation : selection.annotations) {
+        if (hasFunclets && (annotation == "flatten" || annotation == "bogus-switch")) {
+          selection.reason += ", no " + annotation + " (funclet-based exception handling)";
+          continue;
+        }
+        if (hasExceptionHandling && annotation == "virtualize") {
+          selection.reason += ", no virtualize (exception handling)";
+          continue;
+        }
+        if (annotation == "function-merge" && !F.hasLocalLinkage()) {
+          selection.reason += ", no function-merge (external linkage)";
+          continue;
+        }
+        applicable.push_back(annotation);
+      }
+
+      selection.annotations = applicable;
+    }
+
+    static void annotate(Function &F, const std::vector<std::string> &annotations) {
+      LLVMContext &context = F.getContext();
+
+      SmallVector<Metadata *> nodes;
+      for (auto &annotation : annotations) {
+        nodes.push_back(MDNode::get(context, MDString::get(context, annotation)));
+      }
+
+      F.setMetadata("annotation", MDNode::get(context, nodes));
+    }
+
+    static void writeReport(const std::vector<std::pair<const Function *, Selection>> &selections) {
+      std::error_code error;
+      raw_fd_ostream os(PolicyReport, error);
+      if (error) {
+        errs() << "[policy] Cannot write " << PolicyReport << ": " << error.message() << "\n";
+        return;
+      }
+
+      json::OStream json(os, 2);
+      json.array([&] {
+        for (auto &[F, selection] : selections) {
+          json.object([&] {
+            json.attribute("function", F->getName());
+            json.attribute("tier", selection.tier);
+            json.attributeArray("annotations", [&] {
+              for (auto &annotation : selection.annotations) {
+                json.value(annotation);
+              }
+            });
+            json.attribute("hotness", Policy::getName(selection.hotness));
+            json.attribute("executions", selection.executions);
+            json.attribute("sensitive", selection.sensitive);
+            json.attribute("reason", selection.reason);
+          });
+        }
+      });
+      os << "\n";
+    }
+
+  public:
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) const {
+      Policy policy = Policy::load(PolicyFile);
+
+      auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+      auto &PSI = MAM.getResult<ProfileSummaryAnalysis>(M);
+      bool hasProfile = PSI.hasProfileSummary();
+
+      DenseMap<const Function *, double> executions;
+      if (!hasProfile) {
+        executions = this->estimateExecutions(M, MAM);
+      }
+
+      std::vector<std::pair<const Function *, Selection>> selections;
+      bool changed = false;
+      bool usesOpaqueValue = false;
+
+      for (Function &F : M) {
+        if (F.isDeclaration()) {
+          continue;
+        }
+
+        Selection selection;
+
+        if (hasExplicitAnnotations(F)) {
+          selection = {"source", {}, Hotness::Warm, 0, false, "annotated in source, left as is"};
+          selections.emplace_back(&F, selection);
+          continue;
+        }
+
+        if (hasProfile) {
+          auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+          Hotness hotness = PSI.isFunctionHotInCallGraph(&F, BFI) ? Hotness::Hot
+            : PSI.isFunctionColdInCallGraph(&F, BFI) ? Hotness::Cold
+            : Hotness::Warm;
+          auto entryCount = F.getEntryCount();
+
+          selection = policy.select(F, hotness, entryCount ? entryCount->getCount() : 0);
+          selection.reason += " (profile)";
+        } else {
+          double estimate = executions.lookup(&F);
+          selection = policy.select(F, policy.classify(estimate), estimate);
+          selection.reason += formatv(" (estimated {0:F1} executions of the hottest block)", estimate).str();
+        }
+
+        this->dropInapplicable(F, selection);
+
+        NumSensitiveFunctions += selection.sensitive;
+        NumHotFunctions += selection.hotness == Hotness::Hot;
+
+        LLVM_DEBUG(dbgs() << "[policy] " << F.getName() << ": " << selection.tier << ", " << selection.reason << "\n");
+
+        OptimizationRemarkEmitter ORE(&F);
+        ORE.emit([&]() {
+          return OptimizationRemarkAnalysis(DEBUG_TYPE, "Selected", &F)
+            << "tier " << ore::NV("Tier", selection.tier) << ": " << selection.reason;
+        });
+
+        if (!selection.annotations.empty()) {
+          this->annotate(F, selection.annotations);
+          usesOpaqueValue |= llvm::any_of(selection.annotations, [](const std::string &name) {
+            return OpaqueValue::isUsedBy(name);
+          });
+          NumFunctionsSelected++;
+          changed = true;
+        }
+
+        selections.emplace_back(&F, selection);
+      }
+
+      // After the functions are walked, it adds a constructor. The function passes can't define it themselves
+      if (usesOpaqueValue) {
+        OpaqueValue::define(M);
+      }
+
+      if (!PolicyReport.empty()) {
+        this->writeReport(selections);
+      }
+
+      return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+  };
+} // namespace
+
+PassPluginLibraryInfo getPolicyPassPluginInfo() {
+  return {
+    LLVM_PLUGIN_API_VERSION,
+    "PolicyPass",
+    LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          ModulePassManager &MPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "policy") {
+            MPM.addPass(PolicyPass());
+            return true;
+          }
+          return false;
+        }
+      );
+    }
+  };
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getPolicyPassPluginInfo();
+}
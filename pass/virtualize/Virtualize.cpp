@@ -0,0 +1,1128 @@
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MathExtras.h"
+
+#include "BaseAnnotatedPass.cpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "virtualize"
+
+static cl::opt<bool> VirtualizeSuperinstructions(
+  "virtualize-superinstructions", cl::init(true),
+  cl::desc("Fuse short sequences of IR instructions and phi copies into single bytecode instructions")
+);
+
+STATISTIC(NumFunctionsVirtualized, "Number of functions compiled to bytecode");
+STATISTIC(NumFunctionsUnsupported, "Number of annotated functions left native");
+STATISTIC(NumBytecodeInsts, "Number of bytecode instructions");
+STATISTIC(NumSuperinstructions, "Number of bytecode instructions that execute several IR instructions or copies");
+STATISTIC(NumHandlers, "Number of interpreter handlers");
+
+namespace {
+  // Where a handler takes an operand of an IR instruction from
+  struct OperandSource {
+    enum Kind { Register, Immediate, Chained, Embedded, Target };
+
+    Kind kind;
+    // Field of a register, an immediate, or a jump target, or the position of an instruction in the chain
+    unsigned index = 0;
+    // Operand that stays in the handler: a constant that must not be replaced, metadata, or inline assembly
+    Value *embedded = nullptr;
+
+    bool operator==(const OperandSource &other) const {
+      return this->kind == other.kind && this->index == other.index && this->embedded == other.embedded;
+    }
+  };
+
+  // A 16-bit field of a bytecode instruction
+  struct Field {
+    enum Kind { Register, Shadow, Immediate, Label };
+
+    Kind kind;
+    // Value of a register, or the phi node of a shadow register
+    Value *value = nullptr;
+    // Bits of an immediate, or a label (a block, or an edge with copies), resolved to an instruction index
+    unsigned number = 0;
+  };
+
+  // A copy into the register of a phi node on an edge
+  struct Copy {
+    Type *type;
+    Field destination;
+    Field source;
+  };
+
+  // A bytecode instruction: a chain of IR instructions executed by a single handler (a superinstruction
+  // if there are several), or copies into the registers of phi nodes, optionally followed by a jump
+  struct VirtualInst {
+    // Every instruction of the chain is only used by a later one, the last one is the root
+    std::vector<Instruction *> chain;
+    // For every instruction of the chain, for every operand
+    std::vector<std::vector<OperandSource>> sources;
+    // Field 0 is the register the root writes
+    bool storesResult = false;
+
+    // Types of the copied values, and whether their sources are immediates
+    std::vector<std::pair<Type *, bool>> copies;
+    bool jumps = false;
+
+    std::vector<Field> fields;
+    unsigned handlerIdx = 0;
+  };
+
+  // A function compiled to bytecode
+  struct Bytecode {
+    std::vector<VirtualInst> insts;
+    // Instruction index of every label
+    std::vector<unsigned> labelInsts;
+    // Instruction that every handler is built from
+    std::vector<unsigned> handlerInsts;
+
+    // Registers in 8-byte units by value, and by phi node for shadow registers. The constants come first,
+    // in one piece, which is copied from the constant pool on entry
+    std::map<std::pair<Value *, bool>, unsigned> registers;
+    // Values that are kept in the registers of phi nodes, see `coalesce`
+    DenseMap<Value *, Value *> registerOwners;
+    std::vector<Constant *> constants;
+    unsigned constantUnits = 0;
+    unsigned registerUnits = 0;
+    unsigned slotNum = 0;
+  };
+
+  // The interpreter while it is built
+  struct Interpreter {
+    Value *registers;
+    GlobalVariable *code;
+    DebugLoc location;
+    // Indirect branches to the next handler, with the address of the next instruction
+    std::vector<std::pair<IndirectBrInst *, Value *>> dispatches;
+    // Instructions of the handlers that execute the original code
+    std::vector<Instruction *> executed;
+  };
+
+  // Code virtualization.
+  //
+  // An annotated function is compiled to a register-based bytecode and its body is replaced with an interpreter
+  // of that bytecode. The registers are 8-byte units of a stack array: every value gets one or more of them,
+  // and constants are copied into theirs from a constant pool on entry. A bytecode instruction is a 16-byte slot,
+  // the address of its handler followed by 16-bit fields (registers, small immediates, jump targets), and the code
+  // is aligned so that no slot crosses a cache line; longer instructions continue in extension slots of 8 fields.
+  //
+  // The handlers are blocks of the function, specialized for the types and the shape of an operation, and the code
+  // is direct-threaded: every handler ends with an indirect branch to the handler address of the next instruction,
+  // which the branch predictor learns per handler. Short sequences of instructions of a block, e.g. a `getelementptr`
+  // and the `load` that uses it, or an `icmp` and the `br` on it, run as a single superinstruction whose intermediate
+  // values don't go through registers. The copies for the phi nodes of an edge are grouped and fused with the jump
+  // that follows them.
+  //
+  // Functions with exception handling, indirect branches, taken block addresses, tokens, `musttail` calls,
+  // or operand bundles are left native
+  class VirtualizePass : public BaseAnnotatedPass<VirtualizePass> {
+  private:
+    static constexpr const char *annotationName = "virtualize";
+
+    static constexpr unsigned slotSize = 16;
+    static constexpr unsigned extensionFieldNum = 8;
+    static constexpr unsigned unitSize = 8;
+
+    // Instructions of a superinstruction, including the root
+    static constexpr unsigned maxChainLength = 3;
+
+    // Fields hold register units and instruction indices
+    static constexpr unsigned maxFieldValue = UINT16_MAX;
+
+    // Fields of the first slot of an instruction, after the address of its handler
+    static unsigned getFieldNum(const DataLayout &DL) {
+      return (VirtualizePass::slotSize - DL.getPointerSize(DL.getProgramAddressSpace())) / 2;
+    }
+
+    static unsigned getSlotNum(const VirtualInst &inst, unsigned fieldNum) {
+      unsigned extensionFields = inst.fields.size() > fieldNum ? inst.fields.size() - fieldNum : 0;
+      return 1 + divideCeil(extensionFields, VirtualizePass::extensionFieldNum);
+    }
+
+    static unsigned getUnits(const DataLayout &DL, Type *type) {
+      return std::max<uint64_t>(1, divideCeil(DL.getTypeAllocSize(type), VirtualizePass::unitSize));
+    }
+
+    // Instructions without an effect on the execution, whose operands are no longer values once they are in registers
+    static bool isDropped(const Instruction &inst) {
+      return isa<DbgInfoIntrinsic>(inst) || isa<AssumeInst>(inst) || isa<NoAliasScopeDeclInst>(inst)
+        || isa<PseudoProbeInst>(inst) || inst.isLifetimeStartOrEnd();
+    }
+
+    // Static allocas stay in the entry block of the interpreter, and the registers hold their addresses
+    static bool isNativeAlloca(const Instruction &inst) {
+      auto *alloca = dyn_cast<AllocaInst>(&inst);
+      return alloca && alloca->isStaticAlloca();
+    }
+
+    static bool isPure(const Instruction &inst) {
+      return !inst.mayReadOrWriteMemory() && !inst.mayHaveSideEffects() && !isa<AllocaInst>(inst);
+    }
+
+    static bool storesResult(const Instruction &inst) {
+      return !inst.isTerminator() && !inst.getType()->isVoidTy() && !inst.use_empty();
+    }
+
+    // Integer constants that fit into a field
+    static std::optional<uint16_t> getImmediate(const Value *value) {
+      auto *constant = dyn_cast<ConstantInt>(value);
+      if (!constant || !constant->getType()->isIntegerTy() || constant->getBitWidth() > 64
+          || !isIntN(16, constant->getSExtValue())) {
+        return std::nullopt;
+      }
+
+      return (uint16_t)constant->getSExtValue();
+    }
+
+    // Operands that stay in the handler instead of being read from a register or a field: operands of intrinsics,
+    // immediate arguments, callees that must be called directly, struct indices, case values, and metadata
+    static bool isEmbedded(const Instruction &inst, unsigned operandIdx) {
+      const Value *operand = inst.getOperand(operandIdx);
+      if (isa<Instruction>(operand) || isa<Argument>(operand)) {
+        return false;
+      }
+      if (!isa<Constant>(operand) || isa<UndefValue>(operand) || isa<ConstantPointerNull>(operand)) {
+        return true;
+      }
+
+      if (auto *call = dyn_cast<CallBase>(&inst)) {
+        const Function *callee = call->getCalledFunction();
+        if (callee && (callee->isIntrinsic() || callee->hasFnAttribute(Attribute::ReturnsTwice))) {
+          return true;
+        }
+        return operandIdx < call->arg_size() && call->paramHasAttr(operandIdx, Attribute::ImmArg);
+      }
+
+      if (isa<SwitchInst>(inst) || isa<AllocaInst>(inst)) {
+        return true;
+      }
+
+      if (auto *gep = dyn_cast<GetElementPtrInst>(&inst)) {
+        unsigned idx = 1;
+        for (auto it = gep_type_begin(gep); it != gep_type_end(gep); it++, idx++) {
+          if (idx == operandIdx) {
+            return it.isStruct();
+          }
+        }
+      }
+
+      return false;
+    }
+
+    static unsigned getSourceFieldNum(const Instruction &inst, unsigned operandIdx) {
+      return isa<BasicBlock>(inst.getOperand(operandIdx)) || !VirtualizePass::isEmbedded(inst, operandIdx) ? 1 : 0;
+    }
+
+    // Why `F` can't be virtualized, nothing if it can
+    std::optional<std::string> getUnsupportedReason(Function &F) const {
+      const DataLayout &DL = F.getParent()->getDataLayout();
+
+      if (!this->isWholeFunction()) {
+        return std::string("only whole functions are virtualized");
+      }
+
+      unsigned pointerSize = DL.getPointerSize(DL.getProgramAddressSpace());
+      if (pointerSize != 2 && pointerSize != 4 && pointerSize != 8) {
+        return std::string("code pointers don't fit into a bytecode slot");
+      }
+
+      if (F.hasFnAttribute(Attribute::Naked) || F.isPresplitCoroutine() || F.hasGC()) {
+        return std::string("naked functions, coroutines, and garbage-collected functions are not supported");
+      }
+
+      for (auto &arg : F.args()) {
+        if (arg.hasSwiftErrorAttr()) {
+          return std::string("swifterror arguments are not supported");
+        }
+      }
+
+      for (auto &block : F) {
+        if (block.hasAddressTaken()) {
+          return std::string("taken block addresses");
+        }
+
+        Instruction *terminator = block.getTerminator();
+        if (block.isEHPad() || !(isa<BranchInst>(terminator) || isa<SwitchInst>(terminator)
+            || isa<ReturnInst>(terminator) || isa<UnreachableInst>(terminator))) {
+          return std::string("exception handling or indirect branches");
+        }
+
+        for (auto &inst : block) {
+          if (VirtualizePass::isDropped(inst)) {
+            continue;
+          }
+
+          Type *type = inst.getType();
+          if (!type->isVoidTy() && (!type->isSized() || DL.getTypeAllocSize(type).isScalable())) {
+            return formatv("values of unsupported types").str();
+          }
+
+          if (auto *alloca = dyn_cast<AllocaInst>(&inst)) {
+            if (alloca->isUsedWithInAlloca() || alloca->isSwiftError()) {
+              return std::string("inalloca and swifterror allocas are not supported");
+            }
+          }
+
+          if (auto *call = dyn_cast<CallBase>(&inst)) {
+            if (call->isMustTailCall()) {
+              return std::string("musttail calls");
+            }
+            if (call->hasOperandBundles()) {
+              return std::string("calls with operand bundles");
+            }
+            if (call->getIntrinsicID() == Intrinsic::localescape) {
+              return std::string("llvm.localescape");
+            }
+          }
+        }
+      }
+
+      return std::nullopt;
+    }
+
+    // An instruction is fused into its only user later in the block if it can be moved there:
+    // it doesn't touch memory, or nothing in between does
+    static bool isFusable(const Instruction &inst, const Instruction &user) {
+      if (
+        !VirtualizeSuperinstructions || inst.getParent() != user.getParent() || !inst.hasOneUse()
+        || isa<PHINode>(inst) || isa<PHINode>(user) || isa<AllocaInst>(inst)
+      ) {
+        return false;
+      }
+
+      if (VirtualizePass::isPure(inst)) {
+        return true;
+      }
+
+      for (const Instruction *next = inst.getNextNode(); next != &user; next = next->getNextNode()) {
+        if (!VirtualizePass::isPure(*next) && !VirtualizePass::isDropped(*next)) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    // Chooses the instructions of `block` that are fused into their users, as long as a superinstruction
+    // fits into a slot and an extension
+    void fuse(BasicBlock &block, unsigned fieldNum, DenseMap<Instruction *, Instruction *> &fusedInto) const {
+      const unsigned fusedFieldNum = fieldNum + VirtualizePass::extensionFieldNum;
+      // Fields of the operands of every instruction, including the ones of the instructions fused into it
+      DenseMap<Instruction *, unsigned> operandFields;
+      DenseMap<Instruction *, unsigned> chainLengths;
+
+      for (auto &inst : block) {
+        if (isa<PHINode>(inst) || this->isDropped(inst) || this->isNativeAlloca(inst)) {
+          continue;
+        }
+
+        unsigned fields = 0;
+        for (unsigned operandIdx = 0; operandIdx < inst.getNumOperands(); operandIdx++) {
+          fields += this->getSourceFieldNum(inst, operandIdx);
+        }
+        unsigned length = 1;
+
+        for (Value *operand : inst.operands()) {
+          auto *operandInst = dyn_cast<Instruction>(operand);
+          if (!operandInst || !operandFields.count(operandInst) || !this->isFusable(*operandInst, inst)) {
+            continue;
+          }
+
+          unsigned fusedFields = fields - 1 + operandFields[operandInst];
+          unsigned fusedLength = length + chainLengths[operandInst];
+          if (fusedFields + this->storesResult(inst) > fusedFieldNum || fusedLength > VirtualizePass::maxChainLength) {
+            continue;
+          }
+
+          fusedInto[operandInst] = &inst;
+          fields = fusedFields;
+          length = fusedLength;
+        }
+
+        operandFields[&inst] = fields;
+        chainLengths[&inst] = length;
+      }
+    }
+
+    static void collectChain(
+      Instruction *inst, const DenseMap<Instruction *, Instruction *> &fusedInto, std::vector<Instruction *> &chain
+    ) {
+      for (Value *operand : inst->operands()) {
+        auto *operandInst = dyn_cast<Instruction>(operand);
+        auto it = operandInst ? fusedInto.find(operandInst) : fusedInto.end();
+        if (it != fusedInto.end() && it->second == inst) {
+          VirtualizePass::collectChain(operandInst, fusedInto, chain);
+        }
+      }
+
+      chain.push_back(inst);
+    }
+
+    // Phi nodes of single-block loops share their registers with the values that flow into them on the back edge,
+    // which saves the copies. It takes that the value is computed after the last read of the phi node
+    // (in the superinstruction that reads it, at the latest). The value may be used after the block: the register
+    // is only written again on the edges into the block, which recomputes the value before it can be left
+    void coalesce(BasicBlock &block, const DenseMap<Instruction *, Instruction *> &fusedInto, Bytecode &bytecode) const {
+      // Instructions are executed at the roots of their superinstructions
+      DenseMap<Instruction *, unsigned> positions;
+      for (auto &inst : block) {
+        positions[&inst] = positions.size();
+      }
+      auto getPosition = [&](Instruction *inst) {
+        for (auto it = fusedInto.find(inst); it != fusedInto.end(); it = fusedInto.find(inst)) {
+          inst = it->second;
+        }
+        return positions.lookup(inst);
+      };
+
+      for (PHINode &phi : block.phis()) {
+        if (phi.getBasicBlockIndex(&block) < 0) {
+          continue;
+        }
+
+        auto *value = dyn_cast<Instruction>(phi.getIncomingValueForBlock(&block));
+        if (!value || value->getParent() != &block || isa<PHINode>(value) || bytecode.registerOwners.count(value)) {
+          continue;
+        }
+
+        unsigned valuePosition = getPosition(value);
+        bool phiDead = llvm::all_of(phi.users(), [&](User *user) {
+          auto *inst = cast<Instruction>(user);
+          return !isa<PHINode>(inst) && inst->getParent() == &block && getPosition(inst) <= valuePosition;
+        });
+
+        if (phiDead) {
+          bytecode.registerOwners[value] = &phi;
+        }
+      }
+    }
+
+    // The value whose register holds `value`
+    static Value *getRegisterValue(const Bytecode &bytecode, Value *value) {
+      auto it = bytecode.registerOwners.find(value);
+      return it != bytecode.registerOwners.end() ? it->second : value;
+    }
+
+    Field getValueField(Bytecode &bytecode, Value *value) const {
+      if (std::optional<uint16_t> immediate = this->getImmediate(value)) {
+        return {Field::Immediate, nullptr, *immediate};
+      }
+
+      auto *constant = dyn_cast<Constant>(value);
+      if (constant && !bytecode.registers.count({constant, false})) {
+        bytecode.registers[{constant, false}] = 0;
+        bytecode.constants.push_back(constant);
+      }
+
+      return {Field::Register, this->getRegisterValue(bytecode, value)};
+    }
+
+    // Adds the instruction for the chain that ends with `root`. Jump targets are the labels of the successors
+    void addChain(
+      Bytecode &bytecode, Instruction *root, const DenseMap<Instruction *, Instruction *> &fusedInto,
+      const DenseMap<BasicBlock *, unsigned> &targetLabels
+    ) const {
+      VirtualInst virtualInst;
+      this->collectChain(root, fusedInto, virtualInst.chain);
+      llvm::sort(virtualInst.chain, [](Instruction *a, Instruction *b) { return a->comesBefore(b); });
+
+      virtualInst.storesResult = this->storesResult(*root);
+      if (virtualInst.storesResult) {
+        virtualInst.fields.push_back({Field::Register, this->getRegisterValue(bytecode, root)});
+      }
+
+      DenseMap<Instruction *, unsigned> chainIdxs;
+      for (Instruction *inst : virtualInst.chain) {
+        chainIdxs[inst] = chainIdxs.size();
+        auto &sources = virtualInst.sources.emplace_back();
+
+        for (unsigned operandIdx = 0; operandIdx < inst->getNumOperands(); operandIdx++) {
+          Value *operand = inst->getOperand(operandIdx);
+          auto *operandInst = dyn_cast<Instruction>(operand);
+
+          if (auto *block = dyn_cast<BasicBlock>(operand)) {
+            sources.push_back({OperandSource::Target, (unsigned)virtualInst.fields.size()});
+            virtualInst.fields.push_back({Field::Label, nullptr, targetLabels.lookup(block)});
+          } else if (operandInst && chainIdxs.count(operandInst)) {
+            sources.push_back({OperandSource::Chained, chainIdxs[operandInst]});
+          } else if (this->isEmbedded(*inst, operandIdx)) {
+            sources.push_back({OperandSource::Embedded, 0, operand});
+          } else {
+            Field field = this->getValueField(bytecode, operand);
+            auto kind = field.kind == Field::Immediate ? OperandSource::Immediate : OperandSource::Register;
+            sources.push_back({kind, (unsigned)virtualInst.fields.size()});
+            virtualInst.fields.push_back(field);
+          }
+        }
+      }
+
+      bytecode.insts.push_back(std::move(virtualInst));
+    }
+
+    // Copies into the registers of the phi nodes of `successor` on the edge from `block`, in the order they run.
+    // If a phi node reads another one of the same block, all of them are copied through shadow registers
+    std::vector<Copy> getCopies(Bytecode &bytecode, BasicBlock *block, BasicBlock *successor) const {
+      std::vector<std::pair<PHINode *, Value *>> incomings;
+      bool shadowed = false;
+
+      for (PHINode &phi : successor->phis()) {
+        Value *incoming = phi.getIncomingValueForBlock(block);
+        if (this->getRegisterValue(bytecode, incoming) == &phi || isa<UndefValue>(incoming)) {
+          continue;
+        }
+
+        auto *incomingPhi = dyn_cast<PHINode>(incoming);
+        shadowed |= incomingPhi && incomingPhi->getParent() == successor;
+        incomings.push_back({&phi, incoming});
+      }
+
+      std::vector<Copy> copies;
+      for (auto &[phi, incoming] : incomings) {
+        Field destination = shadowed ? Field{Field::Shadow, phi} : Field{Field::Register, phi};
+        copies.push_back({phi->getType(), destination, this->getValueField(bytecode, incoming)});
+      }
+
+      if (shadowed) {
+        for (auto &[phi, incoming] : incomings) {
+          copies.push_back({phi->getType(), {Field::Register, phi}, {Field::Shadow, phi}});
+        }
+      }
+
+      return copies;
+    }
+
+    // Adds the copies, up to a slot and an extension of them per instruction, and a jump to `label` fused
+    // into the last one
+    void addCopies(
+      Bytecode &bytecode, const std::vector<Copy> &copies, std::optional<unsigned> label, unsigned fieldNum
+    ) const {
+      const unsigned fusedFieldNum = fieldNum + VirtualizePass::extensionFieldNum;
+      const size_t copiesPerInst = VirtualizeSuperinstructions ? fusedFieldNum / 2 : 1;
+      const size_t firstInst = bytecode.insts.size();
+
+      for (size_t begin = 0; begin < copies.size(); begin += copiesPerInst) {
+        VirtualInst &virtualInst = bytecode.insts.emplace_back();
+
+        for (size_t i = begin; i < std::min(begin + copiesPerInst, copies.size()); i++) {
+          virtualInst.copies.push_back({copies[i].type, copies[i].source.kind == Field::Immediate});
+          virtualInst.fields.push_back(copies[i].destination);
+          virtualInst.fields.push_back(copies[i].source);
+        }
+      }
+
+      if (!label) {
+        return;
+      }
+
+      bool fused = VirtualizeSuperinstructions && bytecode.insts.size() > firstInst
+        && bytecode.insts.back().fields.size() < fusedFieldNum;
+      VirtualInst &jump = fused ? bytecode.insts.back() : bytecode.insts.emplace_back();
+      jump.jumps = true;
+      jump.fields.push_back({Field::Label, nullptr, *label});
+    }
+
+    static bool isSameHandler(const VirtualInst &a, const VirtualInst &b) {
+      if (
+        a.chain.size() != b.chain.size() || a.storesResult != b.storesResult || a.copies != b.copies
+        || a.jumps != b.jumps || a.fields.size() != b.fields.size() || a.sources != b.sources
+      ) {
+        return false;
+      }
+
+      // The handler is cloned from the first instruction of its shape, so the poison-generating and
+      // fast-math flags must match too
+      for (auto [instA, instB] : zip(a.chain, b.chain)) {
+        if (!instA->isSameOperationAs(instB) || !instA->hasSameSubclassOptionalData(instB)) {
+          return false;
+        }
+
+        auto *callA = dyn_cast<CallBase>(instA);
+        if (callA && callA->getFunctionType() != cast<CallBase>(instB)->getFunctionType()) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    // Compiles the reachable blocks of `F` in their order. Nothing is changed yet
+    Bytecode compile(Function &F) const {
+      const DataLayout &DL = F.getParent()->getDataLayout();
+      const unsigned fieldNum = this->getFieldNum(DL);
+
+      Bytecode bytecode;
+      auto addLabel = [&]() {
+        bytecode.labelInsts.push_back(0);
+        return (unsigned)bytecode.labelInsts.size() - 1;
+      };
+      auto placeLabel = [&](unsigned label) {
+        bytecode.labelInsts[label] = bytecode.insts.size();
+      };
+
+      SmallPtrSet<BasicBlock *, 32> reachable;
+      for (BasicBlock *block : depth_first(&F.getEntryBlock())) {
+        reachable.insert(block);
+      }
+
+      std::vector<BasicBlock *> blocks;
+      DenseMap<BasicBlock *, unsigned> blockLabels;
+      DenseMap<Instruction *, Instruction *> fusedInto;
+
+      for (auto &block : F) {
+        if (reachable.count(&block)) {
+          blocks.push_back(&block);
+          blockLabels[&block] = addLabel();
+          this->fuse(block, fieldNum, fusedInto);
+          this->coalesce(block, fusedInto, bytecode);
+        }
+      }
+
+      for (unsigned blockIdx = 0; blockIdx < blocks.size(); blockIdx++) {
+        BasicBlock *block = blocks[blockIdx];
+        BasicBlock *nextBlock = blockIdx + 1 < blocks.size() ? blocks[blockIdx + 1] : nullptr;
+        placeLabel(blockLabels[block]);
+
+        for (auto &inst : *block) {
+          if (isa<PHINode>(inst) || this->isDropped(inst) || this->isNativeAlloca(inst) || fusedInto.count(&inst)) {
+            continue;
+          }
+
+          if (!inst.isTerminator()) {
+            this->addChain(bytecode, &inst, fusedInto, {});
+            continue;
+          }
+
+          // An unconditional branch is a jump after the copies, or nothing if the successor comes next
+          auto *branch = dyn_cast<BranchInst>(&inst);
+          if (branch && branch->isUnconditional()) {
+            BasicBlock *successor = branch->getSuccessor(0);
+            std::optional<unsigned> label;
+            if (successor != nextBlock) {
+              label = blockLabels[successor];
+            }
+            this->addCopies(bytecode, this->getCopies(bytecode, block, successor), label, fieldNum);
+            continue;
+          }
+
+          // Edges with copies go through stubs after the block
+          DenseMap<BasicBlock *, unsigned> targetLabels;
+          std::vector<std::pair<BasicBlock *, std::vector<Copy>>> stubs;
+          for (BasicBlock *successor : successors(block)) {
+            if (targetLabels.count(successor)) {
+              continue;
+            }
+
+            std::vector<Copy> copies = this->getCopies(bytecode, block, successor);
+            if (copies.empty()) {
+              targetLabels[successor] = blockLabels[successor];
+            } else {
+              targetLabels[successor] = addLabel();
+              stubs.push_back({successor, copies});
+            }
+          }
+
+          this->addChain(bytecode, &inst, fusedInto, targetLabels);
+
+          for (unsigned stubIdx = 0; stubIdx < stubs.size(); stubIdx++) {
+            auto &[successor, copies] = stubs[stubIdx];
+            placeLabel(targetLabels[successor]);
+
+            std::optional<unsigned> label;
+            if (stubIdx + 1 < stubs.size() || successor != nextBlock) {
+              label = blockLabels[successor];
+            }
+            this->addCopies(bytecode, copies, label, fieldNum);
+          }
+        }
+      }
+
+      // Constants first, then the other registers in a random order
+      std::vector<std::pair<Value *, bool>> registers;
+      for (auto &inst : bytecode.insts) {
+        for (auto &field : inst.fields) {
+          bool shadow = field.kind == Field::Shadow;
+          if ((field.kind == Field::Register || shadow) && !isa<Constant>(field.value)) {
+            auto [it, inserted] = bytecode.registers.insert({{field.value, shadow}, 0});
+            if (inserted) {
+              registers.push_back(it->first);
+            }
+          }
+        }
+      }
+
+      for (size_t i = registers.size(); i > 1; i--) {
+        std::swap(registers[i - 1], registers[this->random() % i]);
+      }
+
+      for (Constant *constant : bytecode.constants) {
+        bytecode.registers[{constant, false}] = bytecode.registerUnits;
+        bytecode.registerUnits += this->getUnits(DL, constant->getType());
+      }
+      bytecode.constantUnits = bytecode.registerUnits;
+
+      for (auto &key : registers) {
+        bytecode.registers[key] = bytecode.registerUnits;
+        bytecode.registerUnits += this->getUnits(DL, key.first->getType());
+      }
+
+      // Instructions of the same shape share a handler
+      std::map<std::vector<uintptr_t>, std::vector<unsigned>> candidates;
+      for (unsigned instIdx = 0; instIdx < bytecode.insts.size(); instIdx++) {
+        VirtualInst &inst = bytecode.insts[instIdx];
+        bytecode.slotNum += this->getSlotNum(inst, fieldNum);
+
+        std::vector<uintptr_t> signature = {inst.fields.size(), inst.storesResult, inst.jumps};
+        for (Instruction *chainInst : inst.chain) {
+          signature.push_back(chainInst->getOpcode());
+          signature.push_back((uintptr_t)chainInst->getType());
+        }
+        for (auto &[type, immediate] : inst.copies) {
+          signature.push_back((uintptr_t)type + immediate);
+        }
+
+        auto &sameSignature = candidates[signature];
+        auto it = llvm::find_if(sameSignature, [&](unsigned candidateIdx) {
+          return this->isSameHandler(bytecode.insts[candidateIdx], inst);
+        });
+
+        if (it != sameSignature.end()) {
+          inst.handlerIdx = bytecode.insts[*it].handlerIdx;
+        } else {
+          inst.handlerIdx = bytecode.handlerInsts.size();
+          bytecode.handlerInsts.push_back(instIdx);
+          sameSignature.push_back(instIdx);
+        }
+      }
+
+      return bytecode;
+    }
+
+    // Builds the handler of `inst`, which starts with the phi node of the instruction address
+    BasicBlock *buildHandler(Function &F, const VirtualInst &inst, Interpreter &interpreter, PHINode *&pc) const {
+      LLVMContext &context = F.getContext();
+      const DataLayout &DL = F.getParent()->getDataLayout();
+      const unsigned fieldNum = this->getFieldNum(DL);
+      const unsigned pointerSize = DL.getPointerSize(DL.getProgramAddressSpace());
+
+      Type *int8Ty = Type::getInt8Ty(context);
+      Type *int16Ty = Type::getInt16Ty(context);
+      Type *int64Ty = Type::getInt64Ty(context);
+      Type *handlerTy = PointerType::get(context, DL.getProgramAddressSpace());
+
+      BasicBlock *block = BasicBlock::Create(context, "vm.handler", &F);
+      IRBuilder<> builder(block);
+      builder.SetCurrentDebugLocation(interpreter.location);
+      pc = builder.CreatePHI(interpreter.code->getType(), 0, "vm.pc");
+
+      auto loadField = [&](unsigned fieldIdx) {
+        unsigned offset = fieldIdx < fieldNum
+          ? pointerSize + 2 * fieldIdx
+          : VirtualizePass::slotSize * (1 + (fieldIdx - fieldNum) / VirtualizePass::extensionFieldNum)
+            + 2 * ((fieldIdx - fieldNum) % VirtualizePass::extensionFieldNum);
+        return builder.CreateLoad(int16Ty, builder.CreateConstInBoundsGEP1_32(int8Ty, pc, offset), "vm.field");
+      };
+
+      auto getRegister = [&](unsigned fieldIdx) {
+        Value *unit = builder.CreateZExt(loadField(fieldIdx), int64Ty);
+        return builder.CreateInBoundsGEP(int64Ty, interpreter.registers, unit, "vm.register");
+      };
+
+      auto getTarget = [&](unsigned fieldIdx) {
+        Value *offset = builder.CreateShl(builder.CreateZExt(loadField(fieldIdx), int64Ty), Log2_32(VirtualizePass::slotSize));
+        return builder.CreateInBoundsGEP(int8Ty, interpreter.code, offset, "vm.target");
+      };
+
+      auto getNext = [&]() {
+        return builder.CreateConstInBoundsGEP1_32(int8Ty, pc, VirtualizePass::slotSize * this->getSlotNum(inst, fieldNum));
+      };
+
+      auto dispatch = [&](Value *next) {
+        Value *handler = builder.CreateLoad(handlerTy, next, "vm.next.handler");
+        interpreter.dispatches.push_back({builder.CreateIndirectBr(handler), next});
+      };
+
+      std::vector<Value *> chained;
+      auto read = [&](const OperandSource &source, Type *type) -> Value * {
+        switch (source.kind) {
+          case OperandSource::Register:
+            return builder.CreateAlignedLoad(type, getRegister(source.index), Align(VirtualizePass::unitSize));
+          case OperandSource::Immediate:
+            return builder.CreateSExtOrTrunc(loadField(source.index), type);
+          case OperandSource::Chained:
+            return chained[source.index];
+          default:
+            return source.embedded;
+        }
+      };
+
+      if (inst.chain.empty()) {
+        for (unsigned copyIdx = 0; copyIdx < inst.copies.size(); copyIdx++) {
+          auto [type, immediate] = inst.copies[copyIdx];
+          OperandSource source = {immediate ? OperandSource::Immediate : OperandSource::Register, 2 * copyIdx + 1};
+          builder.CreateAlignedStore(read(source, type), getRegister(2 * copyIdx), Align(VirtualizePass::unitSize));
+        }
+
+        dispatch(inst.jumps ? getTarget(2 * inst.copies.size()) : getNext());
+        return block;
+      }
+
+      Instruction *root = inst.chain.back();
+      const unsigned executedNum = root->isTerminator() ? inst.chain.size() - 1 : inst.chain.size();
+
+      for (unsigned chainIdx = 0; chainIdx < executedNum; chainIdx++) {
+        Instruction *original = inst.chain[chainIdx];
+        Instruction *clone = original->clone();
+
+        for (unsigned operandIdx = 0; operandIdx < original->getNumOperands(); operandIdx++) {
+          clone->setOperand(operandIdx, read(inst.sources[chainIdx][operandIdx], original->getOperand(operandIdx)->getType()));
+        }
+
+        // The handler is shared by all instructions of this shape, their metadata may differ
+        clone->dropUnknownNonDebugMetadata();
+        clone->setDebugLoc(interpreter.location);
+        if (auto *call = dyn_cast<CallInst>(clone)) {
+          call->setTailCallKind(CallInst::TCK_None);
+        }
+
+        builder.Insert(clone);
+        chained.push_back(clone);
+        interpreter.executed.push_back(clone);
+      }
+
+      const auto &rootSources = inst.sources.back();
+      auto readRootOperand = [&](unsigned operandIdx) {
+        return read(rootSources[operandIdx], root->getOperand(operandIdx)->getType());
+      };
+
+      if (!root->isTerminator()) {
+        if (inst.storesResult) {
+          builder.CreateAlignedStore(chained.back(), getRegister(0), Align(VirtualizePass::unitSize));
+        }
+        dispatch(getNext());
+      } else if (isa<ReturnInst>(root)) {
+        interpreter.executed.push_back(
+          root->getNumOperands() ? builder.CreateRet(readRootOperand(0)) : builder.CreateRetVoid()
+        );
+      } else if (isa<UnreachableInst>(root)) {
+        builder.CreateUnreachable();
+      } else if (auto *branch = dyn_cast<BranchInst>(root)) {
+        if (branch->isUnconditional()) {
+          dispatch(getTarget(rootSources[0].index));
+        } else {
+          // Successor 0 is the last operand
+          Value *condition = readRootOperand(0);
+          Value *onTrue = getTarget(rootSources[2].index);
+          Value *onFalse = getTarget(rootSources[1].index);
+          dispatch(builder.CreateSelect(condition, onTrue, onFalse, "vm.next"));
+        }
+      } else {
+        auto *switchInst = cast<SwitchInst>(root);
+        Value *condition = readRootOperand(0);
+
+        BasicBlock *join = BasicBlock::Create(context, "vm.switch", &F);
+        PHINode *next = PHINode::Create(pc->getType(), switchInst->getNumSuccessors(), "vm.next", join);
+        next->setDebugLoc(interpreter.location);
+
+        auto addCase = [&](unsigned fieldIdx) {
+          BasicBlock *caseBlock = BasicBlock::Create(context, "vm.case", &F, join);
+          builder.SetInsertPoint(caseBlock);
+          next->addIncoming(getTarget(fieldIdx), caseBlock);
+          builder.CreateBr(join);
+          return caseBlock;
+        };
+
+        // Operand 1 is the default destination, followed by pairs of a case value and its destination
+        SwitchInst *clone = SwitchInst::Create(condition, addCase(rootSources[1].index), switchInst->getNumCases(), block);
+        clone->setDebugLoc(interpreter.location);
+        for (unsigned caseIdx = 0; caseIdx < switchInst->getNumCases(); caseIdx++) {
+          auto *caseValue = cast<ConstantInt>(switchInst->getOperand(2 * caseIdx + 2));
+          clone->addCase(caseValue, addCase(rootSources[2 * caseIdx + 3].index));
+        }
+
+        builder.SetInsertPoint(join);
+        dispatch(next);
+      }
+
+      return block;
+    }
+
+    // Replaces the body of `F` with the interpreter of `bytecode`
+    void buildInterpreter(Function &F, const Bytecode &bytecode, const Provenance &provenance) const {
+      Module &M = *F.getParent();
+      LLVMContext &context = F.getContext();
+      const DataLayout &DL = M.getDataLayout();
+      const unsigned fieldNum = this->getFieldNum(DL);
+
+      Type *int16Ty = Type::getInt16Ty(context);
+      Type *int64Ty = Type::getInt64Ty(context);
+      Type *handlerTy = PointerType::get(context, DL.getProgramAddressSpace());
+      StructType *slotTy = StructType::get(handlerTy, ArrayType::get(int16Ty, fieldNum));
+      ArrayType *extensionTy = ArrayType::get(int16Ty, VirtualizePass::extensionFieldNum);
+
+      std::vector<BasicBlock *> originalBlocks;
+      for (auto &block : F) {
+        originalBlocks.push_back(&block);
+      }
+
+      // The address of an instruction is the index of its first slot
+      std::vector<Type *> slotTypes;
+      std::vector<unsigned> slotIdxs;
+      for (auto &inst : bytecode.insts) {
+        slotIdxs.push_back(slotTypes.size());
+        slotTypes.push_back(slotTy);
+        for (unsigned i = 1; i < this->getSlotNum(inst, fieldNum); i++) {
+          slotTypes.push_back(extensionTy);
+        }
+      }
+
+      // Aligned to cache lines, so that no slot crosses one
+      StructType *codeTy = StructType::get(context, slotTypes);
+      auto *code = new GlobalVariable(M, codeTy, true, GlobalValue::PrivateLinkage, nullptr, F.getName() + ".vm.code");
+      code->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+      code->setAlignment(Align(64));
+
+      Interpreter interpreter;
+      interpreter.code = code;
+      if (DISubprogram *subprogram = F.getSubprogram()) {
+        interpreter.location = DILocation::get(context, 0, 0, subprogram);
+      }
+
+      // Collected first, they are no longer static once the original entry block is not the entry
+      std::vector<Instruction *> allocas;
+      for (auto &inst : F.getEntryBlock()) {
+        if (this->isNativeAlloca(inst)) {
+          allocas.push_back(&inst);
+        }
+      }
+
+      BasicBlock *entryBlock = BasicBlock::Create(context, "vm.entry", &F, &F.front());
+      for (Instruction *alloca : allocas) {
+        alloca->moveBefore(*entryBlock, entryBlock->end());
+      }
+
+      IRBuilder<> builder(entryBlock);
+      builder.SetCurrentDebugLocation(interpreter.location);
+
+      AllocaInst *registers = builder.CreateAlloca(ArrayType::get(int64Ty, bytecode.registerUnits), nullptr, "vm.registers");
+      registers->setAlignment(Align(16));
+      interpreter.registers = registers;
+
+      if (!bytecode.constants.empty()) {
+        std::vector<Constant *> elements;
+        for (Constant *constant : bytecode.constants) {
+          elements.push_back(constant);
+
+          uint64_t size = DL.getTypeAllocSize(constant->getType());
+          uint64_t padding = this->getUnits(DL, constant->getType()) * VirtualizePass::unitSize - size;
+          if (padding > 0) {
+            elements.push_back(ConstantAggregateZero::get(ArrayType::get(Type::getInt8Ty(context), padding)));
+          }
+        }
+
+        auto *pool = new GlobalVariable(
+          M, ConstantStruct::getTypeForElements(context, elements, true), true, GlobalValue::PrivateLinkage,
+          ConstantStruct::getAnon(context, elements, true), F.getName() + ".vm.constants"
+        );
+        pool->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+        pool->setAlignment(Align(VirtualizePass::unitSize));
+
+        builder.CreateMemCpy(
+          registers, Align(16), pool, Align(VirtualizePass::unitSize), bytecode.constantUnits * VirtualizePass::unitSize
+        );
+      }
+
+      auto storeRegister = [&](Value *value) {
+        auto it = bytecode.registers.find({value, false});
+        if (it != bytecode.registers.end()) {
+          Value *unit = builder.CreateConstInBoundsGEP1_32(int64Ty, registers, it->second);
+          builder.CreateAlignedStore(value, unit, Align(VirtualizePass::unitSize));
+        }
+      };
+
+      for (auto &arg : F.args()) {
+        storeRegister(&arg);
+      }
+      for (auto &inst : *entryBlock) {
+        if (isa<AllocaInst>(inst) && &inst != registers) {
+          storeRegister(&inst);
+        }
+      }
+
+      interpreter.dispatches.push_back({builder.CreateIndirectBr(builder.CreateLoad(handlerTy, code, "vm.handler")), code});
+
+      // Handlers are laid out in a random order
+      std::vector<unsigned> handlerOrder(bytecode.handlerInsts.size());
+      for (unsigned i = 0; i < handlerOrder.size(); i++) {
+        handlerOrder[i] = i;
+      }
+      for (size_t i = handlerOrder.size(); i > 1; i--) {
+        std::swap(handlerOrder[i - 1], handlerOrder[this->random() % i]);
+      }
+
+      std::vector<BasicBlock *> handlers(handlerOrder.size());
+      std::vector<PHINode *> pcs(handlerOrder.size());
+      for (unsigned handlerIdx : handlerOrder) {
+        const VirtualInst &inst = bytecode.insts[bytecode.handlerInsts[handlerIdx]];
+        handlers[handlerIdx] = this->buildHandler(F, inst, interpreter, pcs[handlerIdx]);
+      }
+
+      for (auto &[branch, next] : interpreter.dispatches) {
+        for (unsigned handlerIdx = 0; handlerIdx < handlers.size(); handlerIdx++) {
+          branch->addDestination(handlers[handlerIdx]);
+          pcs[handlerIdx]->addIncoming(next, branch->getParent());
+        }
+      }
+
+      std::vector<Constant *> slots;
+      for (auto &inst : bytecode.insts) {
+        std::vector<uint16_t> fields;
+        for (auto &field : inst.fields) {
+          switch (field.kind) {
+            case Field::Register:
+            case Field::Shadow:
+              fields.push_back(bytecode.registers.at({field.value, field.kind == Field::Shadow}));
+              break;
+            case Field::Immediate:
+              fields.push_back(field.number);
+              break;
+            case Field::Label:
+              fields.push_back(slotIdxs[bytecode.labelInsts[field.number]]);
+              break;
+          }
+        }
+
+        unsigned slotNum = this->getSlotNum(inst, fieldNum);
+        fields.resize(fieldNum + (slotNum - 1) * VirtualizePass::extensionFieldNum);
+
+        slots.push_back(ConstantStruct::get(slotTy, {
+          BlockAddress::get(&F, handlers[inst.handlerIdx]),
+          ConstantDataArray::get(context, ArrayRef<uint16_t>(fields).take_front(fieldNum)),
+        }));
+        for (unsigned slotIdx = 1; slotIdx < slotNum; slotIdx++) {
+          auto extension = ArrayRef<uint16_t>(fields).slice(
+            fieldNum + (slotIdx - 1) * VirtualizePass::extensionFieldNum, VirtualizePass::extensionFieldNum
+          );
+          slots.push_back(ConstantDataArray::get(context, extension));
+        }
+      }
+      code->setInitializer(ConstantStruct::get(codeTy, slots));
+
+      for (BasicBlock *block : originalBlocks) {
+        block->dropAllReferences();
+      }
+      for (BasicBlock *block : originalBlocks) {
+        block->eraseFromParent();
+      }
+
+      provenance.tag(entryBlock->begin(), entryBlock->end(), "entry");
+      for (auto &block : F) {
+        if (&block != entryBlock) {
+          provenance.tag(block.begin(), block.end(), "dispatch");
+        }
+      }
+      for (Instruction *inst : interpreter.executed) {
+        provenance.tag(inst, "handler");
+      }
+    }
+
+    PreservedAnalyses applyPass(Function &F, FunctionAnalysisManager &FAM) const override {
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      Provenance provenance(*F.getParent(), VirtualizePass::annotationName);
+
+      std::optional<std::string> reason = this->getUnsupportedReason(F);
+
+      Bytecode bytecode;
+      if (!reason) {
+        bytecode = this->compile(F);
+        if (bytecode.registerUnits > VirtualizePass::maxFieldValue + 1 || bytecode.slotNum > VirtualizePass::maxFieldValue + 1) {
+          reason = formatv("more than {0} registers or bytecode slots", VirtualizePass::maxFieldValue + 1).str();
+        }
+      }
+
+      if (reason) {
+        NumFunctionsUnsupported++;
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "Unsupported", &F) << "not virtualized: " << *reason;
+        });
+        return PreservedAnalyses::all();
+      }
+
+      this->buildInterpreter(F, bytecode, provenance);
+
+      unsigned superinstructionNum = llvm::count_if(bytecode.insts, [](const VirtualInst &inst) {
+        return inst.chain.size() + inst.copies.size() + inst.jumps > 1;
+      });
+
+      NumFunctionsVirtualized++;
+      NumBytecodeInsts += bytecode.insts.size();
+      NumSuperinstructions += superinstructionNum;
+      NumHandlers += bytecode.handlerInsts.size();
+
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Virtualized", &F)
+          << "virtualized into " << ore::NV("Instructions", (unsigned)bytecode.insts.size())
+          << " bytecode instructions (" << ore::NV("Superinstructions", superinstructionNum)
+          << " superinstructions) in " << ore::NV("Slots", bytecode.slotNum) << " slots, executed by "
+          << ore::NV("Handlers", (unsigned)bytecode.handlerInsts.size()) << " handlers with "
+          << ore::NV("RegisterBytes", bytecode.registerUnits * VirtualizePass::unitSize) << " bytes of registers";
+      });
+
+      return PreservedAnalyses::none();
+    }
+
+  protected:
+    std::string getConfiguration() const override {
+      return formatv("superinstructions={0}", (bool)VirtualizeSuperinstructions).str();
+    }
+
+  public:
+    VirtualizePass() : BaseAnnotatedPass(VirtualizePass::annotationName) {}
+  };
+} // namespace
+
+PassPluginLibraryInfo getVirtualizePassPluginInfo() {
+  return {
+    LLVM_PLUGIN_API_VERSION,
+    "VirtualizePass",
+    LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](
+          StringRef Name,
+          FunctionPassManager &FPM,
+          ArrayRef<PassBuilder::PipelineElement>
+        ) {
+          if (Name == "virtualize") {
+            FPM.addPass(VirtualizePass());
+            return true;
+          }
+          return false;
+        }
+      );
+    }
+  };
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getVirtualizePassPluginInfo();
+}
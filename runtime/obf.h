@@ -0,0 +1,20 @@
+// Source-level regions for the obfuscation passes.
+//
+// The code between `OBF_REGION_BEGIN("<annotation>")` and `OBF_REGION_END("<annotation>")` is obfuscated as if
+// it were an annotated function, without the call. Regions may span blocks and loops: everything reachable from
+// the beginning marker before an end marker of the same annotation belongs to the region. Supported annotations
+// are `flatten`, `bogus-switch`, `bogus-branch`, `encode`, and `mba`.
+//
+// The markers are removed by the annotation pass, which must run before the optimizations (see docker/run.sh),
+// so they cost nothing in the binary
+
+#ifndef OBF_H
+#define OBF_H
+
+void __obf_region_begin(const char *annotation);
+void __obf_region_end(const char *annotation);
+
+#define OBF_REGION_BEGIN(annotation) __obf_region_begin(annotation)
+#define OBF_REGION_END(annotation) __obf_region_end(annotation)
+
+#endif
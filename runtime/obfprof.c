@@ -0,0 +1,193 @@
+// Runtime of the dispatcher profiling mode (`-flatten-profile`, `-bogus-switch-profile`).
+//
+// Instrumented functions call `__obfprof_counters` once per invocation and then increment
+// thread-local counters without synchronization. Counter blocks of all threads are kept alive
+// until exit, when they are summed per function and written to `$OBFPROF_FILE` (default `obfprof.out`).
+//
+// File format (native endianness, which readers tell from the version):
+//   char magic[8] = "OBFPROF\0"; uint32 version; uint32 functionNum;
+//   per function: uint32 nameLength; char name[nameLength]; uint32 caseNum; uint32 flags;
+//                 int32 caseValues[caseNum]; uint64 counters[counterNum(caseNum, flags)]
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBFPROF_VERSION 1
+#define OBFPROF_RECORD_TRANSITIONS 1u
+
+// Must match the descriptor emitted by DispatcherProfiler
+struct obfprof_desc {
+  uint32_t version;
+  uint32_t case_num;
+  uint32_t flags;
+  int32_t id;
+  const char *name;
+  const int32_t *case_values;
+  struct obfprof_desc *next;
+};
+
+struct obfprof_block {
+  struct obfprof_desc *desc;
+  uint64_t *counters;
+  struct obfprof_block *next;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct obfprof_desc *descriptors = NULL;
+static struct obfprof_block *blocks = NULL;
+static int32_t next_id = 0;
+
+static __thread uint64_t **thread_blocks = NULL;
+static __thread int32_t thread_capacity = 0;
+
+static size_t counter_num(const struct obfprof_desc *desc) {
+  size_t num = desc->case_num;
+  if (desc->flags & OBFPROF_RECORD_TRANSITIONS) {
+    num += (size_t)(desc->case_num + 1) * desc->case_num;
+  }
+
+  // Dispatcher iterations and cycles
+  return num + 2;
+}
+
+static void write_u32(FILE *file, uint32_t value) {
+  fwrite(&value, sizeof(value), 1, file);
+}
+
+// Counters of a function summed over all threads, or NULL if out of memory
+static uint64_t *sum_counters(const struct obfprof_desc *desc) {
+  size_t num = counter_num(desc);
+  uint64_t *total = calloc(num, sizeof(uint64_t));
+  if (!total) {
+    return NULL;
+  }
+
+  for (struct obfprof_block *block = blocks; block; block = block->next) {
+    if (block->desc != desc) {
+      continue;
+    }
+    for (size_t i = 0; i < num; i++) {
+      total[i] += block->counters[i];
+    }
+  }
+
+  return total;
+}
+
+static void dump(void) {
+  const char *path = getenv("OBFPROF_FILE");
+  FILE *file = fopen(path ? path : "obfprof.out", "wb");
+  if (!file) {
+    perror("obfprof");
+    return;
+  }
+
+  pthread_mutex_lock(&registry_lock);
+
+  // Totals first, so that the header counts exactly the records that follow
+  uint64_t **totals = calloc((size_t)next_id, sizeof(uint64_t *));
+  uint32_t function_num = 0;
+
+  if (totals) {
+    size_t index = 0;
+    for (struct obfprof_desc *desc = descriptors; desc; desc = desc->next, index++) {
+      totals[index] = sum_counters(desc);
+      function_num += totals[index] != NULL;
+    }
+  }
+
+  if (function_num < (uint32_t)next_id) {
+    fprintf(stderr, "obfprof: out of memory, %u of %d functions not written\n", (uint32_t)next_id - function_num, next_id);
+  }
+
+  fwrite("OBFPROF", 8, 1, file);
+  write_u32(file, OBFPROF_VERSION);
+  write_u32(file, function_num);
+
+  size_t index = 0;
+  for (struct obfprof_desc *desc = descriptors; totals && desc; desc = desc->next, index++) {
+    uint64_t *total = totals[index];
+    if (!total) {
+      continue;
+    }
+
+    uint32_t nameLength = (uint32_t)strlen(desc->name);
+    write_u32(file, nameLength);
+    fwrite(desc->name, 1, nameLength, file);
+    write_u32(file, desc->case_num);
+    write_u32(file, desc->flags);
+    fwrite(desc->case_values, sizeof(int32_t), desc->case_num, file);
+    fwrite(total, sizeof(uint64_t), counter_num(desc), file);
+
+    free(total);
+  }
+
+  pthread_mutex_unlock(&registry_lock);
+
+  free(totals);
+  fclose(file);
+}
+
+// Slow path: registers the function on its first call and allocates the counters of this thread
+static uint64_t *allocate(struct obfprof_desc *desc) {
+  pthread_mutex_lock(&registry_lock);
+
+  if (desc->id == 0) {
+    if (next_id == 0) {
+      atexit(dump);
+    }
+
+    desc->next = descriptors;
+    descriptors = desc;
+    __atomic_store_n(&desc->id, ++next_id, __ATOMIC_RELEASE);
+  }
+
+  struct obfprof_block *block = malloc(sizeof(struct obfprof_block));
+  uint64_t *counters = calloc(counter_num(desc), sizeof(uint64_t));
+  if (!block || !counters) {
+    pthread_mutex_unlock(&registry_lock);
+    abort();
+  }
+
+  block->desc = desc;
+  block->counters = counters;
+  block->next = blocks;
+  blocks = block;
+
+  int32_t id = desc->id;
+
+  pthread_mutex_unlock(&registry_lock);
+
+  if (id >= thread_capacity) {
+    int32_t capacity = thread_capacity ? thread_capacity : 16;
+    while (capacity <= id) {
+      capacity *= 2;
+    }
+
+    uint64_t **grown = realloc(thread_blocks, capacity * sizeof(uint64_t *));
+    if (!grown) {
+      abort();
+    }
+    memset(grown + thread_capacity, 0, (capacity - thread_capacity) * sizeof(uint64_t *));
+
+    thread_blocks = grown;
+    thread_capacity = capacity;
+  }
+
+  thread_blocks[id] = counters;
+
+  return counters;
+}
+
+uint64_t *__obfprof_counters(struct obfprof_desc *desc) {
+  int32_t id = __atomic_load_n(&desc->id, __ATOMIC_ACQUIRE);
+
+  if (id > 0 && id < thread_capacity && thread_blocks[id]) {
+    return thread_blocks[id];
+  }
+
+  return allocate(desc);
+}
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Attributes the runtime of an obfuscated binary to the transforms of the obfuscation passes.
+
+The binary must be built with line tables and `-annotation-provenance` (OBF_PROVENANCE=1 in run.sh). Instructions
+inserted by the passes then have debug locations in `obf-provenance/<pass>/<kind>`. Samples of `perf record`
+are symbolized with llvm-symbolizer, and every function's samples are split by the transform they hit:
+
+  perf record -e cycles -o perf.data ./out.out
+  obf-attribution.py out.out [-i perf.data] [--top N] [--json]
+"""
+
+import argparse
+import collections
+import json
+import os
+import re
+import subprocess
+import sys
+
+# `perf script -F period,ip,sym,symoff,dso`: "<period> <ip> <symbol>+0x<offset> (<dso>)"
+SAMPLE = re.compile(r"^\s*(\d+)\s+([0-9a-f]+)\s+(.+)\+0x([0-9a-f]+)\s+\((.*)\)\s*$")
+PROVENANCE = re.compile(r"(?:^|/)obf-provenance/([^/]+)/([^/:]+):")
+ORIGINAL = "original"
+
+
+def read_samples(binary, perf_data, perf):
+    """Returns (symbol, offset, period) of the samples in `binary` and the total period of all samples"""
+    output = subprocess.run(
+        [perf, "script", "-i", perf_data, "-F", "period,ip,sym,symoff,dso", "--no-demangle"],
+        check=True, capture_output=True, text=True,
+    ).stdout
+
+    binary = os.path.realpath(binary)
+    samples = []
+    total = 0
+
+    for line in output.splitlines():
+        match = SAMPLE.match(line)
+        if not match:
+            continue
+
+        period, _, symbol, offset, dso = match.groups()
+        total += int(period)
+
+        if os.path.realpath(dso) == binary:
+            samples.append((symbol, int(offset, 16), int(period)))
+
+    return samples, total
+
+
+def read_symbols(binary, nm):
+    """Returns the addresses of the function symbols of `binary`"""
+    output = subprocess.run([nm, "--defined-only", binary], check=True, capture_output=True, text=True).stdout
+
+    symbols = {}
+    for line in output.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in "tTwW":
+            # Static functions of different translation units may share a name, the first one wins
+            symbols.setdefault(parts[2], int(parts[0], 16))
+
+    return symbols
+
+
+def classify(binary, addresses, symbolizer):
+    """Maps every address to `<pass>/<kind>` of the innermost debug location, or to `original`"""
+    if not addresses:
+        return {}
+
+    output = subprocess.run(
+        [symbolizer, "--obj=" + binary, "--inlining"],
+        input="".join("0x%x\n" % address for address in addresses),
+        check=True, capture_output=True, text=True,
+    ).stdout
+
+    # Every address is printed as `function` and `file:line:column` lines, innermost frame first,
+    # followed by an empty line
+    blocks = output.split("\n\n")
+    kinds = {}
+
+    for address, block in zip(addresses, blocks):
+        lines = block.strip("\n").splitlines()
+        match = PROVENANCE.search(lines[1]) if len(lines) > 1 else None
+        kinds[address] = "%s/%s" % match.groups() if match else ORIGINAL
+
+    return kinds
+
+
+def attribute(samples, symbols, kinds):
+    """Returns the period of every function split by the transform kind"""
+    functions = collections.defaultdict(collections.Counter)
+
+    for symbol, offset, period in samples:
+        address = symbols.get(symbol)
+        kind = kinds.get(address + offset, ORIGINAL) if address is not None else ORIGINAL
+        functions[symbol][kind] += period
+
+    return functions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("binary")
+    parser.add_argument("-i", "--input", default="perf.data", help="perf.data of the binary")
+    parser.add_argument("--top", type=int, default=10, help="number of functions to report")
+    parser.add_argument("--perf", default="perf")
+    parser.add_argument("--nm", default="nm")
+    parser.add_argument("--symbolizer", default="llvm-symbolizer")
+    parser.add_argument("--json", action="store_true", help="print a machine-readable report")
+    args = parser.parse_args()
+
+    samples, total = read_samples(args.binary, args.input, args.perf)
+    symbols = read_symbols(args.binary, args.nm)
+
+    addresses = sorted({symbols[symbol] + offset for symbol, offset, _ in samples if symbol in symbols})
+    kinds = classify(args.binary, addresses, args.symbolizer)
+
+    functions = attribute(samples, symbols, kinds)
+    total = total or 1
+
+    report = []
+    for name, periods in functions.items():
+        functionTotal = sum(periods.values())
+        report.append({
+            "name": name,
+            "period": functionTotal,
+            "share": functionTotal / total,
+            "transforms": [
+                {
+                    "kind": kind,
+                    "period": period,
+                    "function_share": period / functionTotal,
+                    "share": period / total,
+                }
+                for kind, period in periods.most_common()
+            ],
+        })
+
+    report.sort(key=lambda function: function["period"], reverse=True)
+    report = report[:args.top]
+
+    if args.json:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+        return 0
+
+    overall = collections.Counter()
+    for function in report:
+        print("%s: %5.1f%% of runtime" % (function["name"], function["share"] * 100))
+        for transform in function["transforms"]:
+            overall[transform["kind"]] += transform["period"]
+            print("    %-32s %5.1f%% of function  %5.1f%% of runtime" % (
+                transform["kind"], transform["function_share"] * 100, transform["share"] * 100
+            ))
+
+    print("reported functions:")
+    for kind, period in overall.most_common():
+        print("    %-32s %5.1f%% of runtime" % (kind, period / total * 100))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Reports hot dispatcher states and transitions from a profile written by runtime/obfprof.c.
+
+  obfprof-report.py [obfprof.out] [--top N] [--cpu-ghz F] [--json]
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"OBFPROF\0"
+RECORD_TRANSITIONS = 1
+RECORD_CYCLES = 2
+
+
+def read_profile(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:8] != MAGIC:
+        raise ValueError("%s is not an obfprof profile" % path)
+
+    # The runtime writes in the byte order of the profiled machine, which the version tells
+    for order in "<>":
+        version, functionNum = struct.unpack_from(order + "II", data, 8)
+        if version == 1:
+            break
+    else:
+        raise ValueError("unsupported profile version %d" % struct.unpack_from("<I", data, 8))
+
+    offset = 16
+    functions = []
+
+    for _ in range(functionNum):
+        nameLength, = struct.unpack_from(order + "I", data, offset)
+        offset += 4
+        name = data[offset:offset + nameLength].decode(errors="replace")
+        offset += nameLength
+
+        caseNum, flags = struct.unpack_from(order + "II", data, offset)
+        offset += 8
+
+        caseValues = list(struct.unpack_from(order + "%di" % caseNum, data, offset))
+        offset += 4 * caseNum
+
+        counterNum = caseNum + (caseNum + 1) * caseNum * bool(flags & RECORD_TRANSITIONS) + 2
+        counters = list(struct.unpack_from(order + "%dQ" % counterNum, data, offset))
+        offset += 8 * counterNum
+
+        cases = counters[:caseNum]
+        transitions = counters[caseNum:-2] if flags & RECORD_TRANSITIONS else []
+
+        functions.append({
+            "name": name,
+            "flags": flags,
+            "case_values": caseValues,
+            "cases": cases,
+            "transitions": transitions,
+            "dispatches": counters[-2],
+            "dispatch_cycles": counters[-1] if flags & RECORD_CYCLES else None,
+        })
+
+    return functions
+
+
+def summarize(function, top):
+    caseNum = len(function["cases"])
+    values = function["case_values"]
+    total = sum(function["cases"]) or 1
+
+    hotCases = sorted(range(caseNum), key=lambda i: function["cases"][i], reverse=True)[:top]
+
+    hotTransitions = []
+    if function["transitions"]:
+        ranked = sorted(range(len(function["transitions"])), key=lambda i: function["transitions"][i], reverse=True)
+        for idx in ranked[:top]:
+            count = function["transitions"][idx]
+            if count == 0:
+                break
+            source, target = divmod(idx, caseNum)
+            hotTransitions.append({
+                "from": "entry" if source == caseNum else values[source],
+                "to": values[target],
+                "count": count,
+            })
+
+    summary = {
+        "name": function["name"],
+        "dispatches": function["dispatches"],
+        "hot_cases": [
+            {"case": values[i], "count": function["cases"][i], "share": function["cases"][i] / total}
+            for i in hotCases if function["cases"][i] > 0
+        ],
+        "hot_transitions": hotTransitions,
+    }
+
+    if function["dispatch_cycles"] is not None:
+        summary["dispatch_cycles"] = function["dispatch_cycles"]
+        summary["cycles_per_dispatch"] = function["dispatch_cycles"] / max(function["dispatches"], 1)
+
+    return summary
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("profile", nargs="?", default="obfprof.out")
+    parser.add_argument("--top", type=int, default=10, help="number of hot states and transitions per function")
+    parser.add_argument("--cpu-ghz", type=float, help="convert dispatch cycles to seconds")
+    parser.add_argument("--json", action="store_true", help="print a machine-readable report")
+    args = parser.parse_args()
+
+    summaries = [summarize(f, args.top) for f in read_profile(args.profile)]
+    summaries.sort(key=lambda s: s["dispatches"], reverse=True)
+
+    if args.cpu_ghz:
+        for summary in summaries:
+            if "dispatch_cycles" in summary:
+                summary["dispatch_s"] = summary["dispatch_cycles"] / (args.cpu_ghz * 1e9)
+
+    if args.json:
+        json.dump(summaries, sys.stdout, indent=2)
+        print()
+        return 0
+
+    for summary in summaries:
+        print("%s: %d dispatches" % (summary["name"], summary["dispatches"]))
+
+        if "dispatch_cycles" in summary:
+            line = "  dispatch: %d cycles, %.1f cycles per dispatch" % (
+                summary["dispatch_cycles"], summary["cycles_per_dispatch"]
+            )
+            if "dispatch_s" in summary:
+                line += ", %.3f s" % summary["dispatch_s"]
+            print(line)
+
+        print("  hot states:")
+        for case in summary["hot_cases"]:
+            print("    case %-12d %12d  %5.1f%%" % (case["case"], case["count"], case["share"] * 100))
+
+        if summary["hot_transitions"]:
+            print("  hot transitions:")
+            for transition in summary["hot_transitions"]:
+                print("    %12s -> %-12s %12d" % (transition["from"], transition["to"], transition["count"]))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())